@@ -33,6 +33,7 @@
  */
 #ifndef CCD_H
 #define CCD_H
+#include <stdio.h>
 #include <sptensor/view.h>
 
 typedef struct ccd_result {
@@ -41,7 +42,8 @@ typedef struct ccd_result {
     int n;              /* number of factor matrices */
     unsigned int iter;  /* number of iterations ran */
     double final_error; /* how much the final iteration changed */
-    double fit;         /* ||(A-A*)||/||A|| */
+    double fit;         /* 1 - ||(A-A*)||/||A|| */
+    double *fits;       /* the fit after each iteration */
 } ccd_result;
 
 /*
@@ -74,12 +76,63 @@ ccd_result *ccd_core(tensor_view *a, tensor_view *c, double lambda[],
 		     int max_iter, double tol);
 
 
+/*
+ * Continue a CCD factorization from an earlier result, such as one read
+ * by ccd_read.  The iteration count carries on from result->iter, so 
+ * max_iter is the total for the whole factorization.
+ * Parameters:
+ *      a      - The tensor being factored
+ *      result - The result to continue (which is updated and returned)
+ *      lambda - A set of L1 sparsity constraints, one for each mode of a
+ * Returns:  result
+ */
+ccd_result *ccd_resume(tensor_view *a, ccd_result *result, double lambda[],
+		       int max_iter, double tol);
+
+
 /* 
  * Constructs the tensor described by the ccd_result structure 
  */
 tensor_view *ccd_construct(ccd_result *result);
 
 
+/*
+ * Computes the fit 1 - ||A-A*||/||A|| of a decomposition of a.  This uses
+ * ||A-A*||^2 = ||A||^2 - 2<A,A*> + ||A*||^2, where <A,A*> only visits 
+ * the nonzeros of A and ||A*||^2 comes from the Gram matrices of the 
+ * factors, so A* is never constructed.
+ */
+double ccd_fit(ccd_result *result, tensor_view *a);
+
+
+/*
+ * Write a ccd result to a stream opened in binary mode.  Everything 
+ * needed to resume the factorization is kept.  The numbers are written 
+ * in the machine's native form, so the file is not portable.
+ * Returns:  0 on success, -1 if the write failed
+ */
+int ccd_write(FILE *file, ccd_result *result);
+
+
+/*
+ * Read a ccd result written by ccd_write.
+ * Returns:  The result, or NULL if the stream does not hold one
+ */
+ccd_result *ccd_read(FILE *file);
+
+
+/*
+ * Checkpoint the CCD factorizations which follow.  A checkpoint is taken
+ * every iters iterations or every seconds seconds (whichever comes 
+ * first, and either may be 0 to disable it), and once more at the end.
+ * The result is copied and then written to fname by a background thread,
+ * so the iterations do not wait on the disk.  fname is replaced 
+ * atomically, so it always holds a complete checkpoint.  A NULL fname 
+ * turns checkpointing off.
+ */
+void ccd_checkpoint(const char *fname, int iters, double seconds);
+
+
 /*
  * Free's the ccd result
  * Parameters;
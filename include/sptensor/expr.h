@@ -0,0 +1,73 @@
+/*
+    This is a collection of functions for lazy tensor expressions.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef EXPR_H
+#define EXPR_H
+#include <sptensor/view.h>
+#include <sptensor/tensor_math.h>
+
+/*
+ * A tensor expression is a tree of elementwise operations over tensor
+ * views.  Nothing is computed when the tree is built.  When the tree is
+ * reduced or materialized, all of its nodes are evaluated together in a
+ * single merge over the sorted nonzeros of the leaves, so no intermediate
+ * tensors are created.  For example:
+ *
+ *     e = expr_sub(expr_tensor(a), expr_tensor(b));
+ *     dist = expr_lpnorm(e, 2.0);
+ *     expr_free(e);
+ *
+ * The operations combining expressions take ownership of their operands,
+ * so only the root of the tree is freed.  The leaf views are not owned,
+ * and they must not change while the expression is in use.  Sparse and
+ * dense views are read in place, other views are copied once.  Results
+ * no larger than 1e-7 are dropped just as they are by sptensor_set.
+ */
+struct tensor_expr;
+typedef struct tensor_expr tensor_expr;
+
+/* a leaf of an expression */
+tensor_expr *expr_tensor(tensor_view *v);
+
+/* a + b */
+tensor_expr *expr_add(tensor_expr *a, tensor_expr *b);
+
+/* a - b */
+tensor_expr *expr_sub(tensor_expr *a, tensor_expr *b);
+
+/* s * a */
+tensor_expr *expr_scale(tensor_expr *a, double s);
+
+/* the elementwise product of a and b */
+tensor_expr *expr_hadamard(tensor_expr *a, tensor_expr *b);
+
+/* f(a, arg) applied to each nonzero element of a (f must map 0 to 0) */
+tensor_expr *expr_map(tensor_expr *a, tensor_map_func f, void *arg);
+
+/* the sum of the elements of the expression */
+double expr_sum(tensor_expr *e);
+
+/* the L-p norm of the expression (p may be HUGE_VAL) */
+double expr_lpnorm(tensor_expr *e, double p);
+
+/* evaluate the expression into a newly allocated tensor */
+tensor_view *expr_eval(tensor_expr *e);
+
+/* free an expression tree (but not the views at its leaves) */
+void expr_free(tensor_expr *e);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+    This is a collection of dense matrix kernels used by the tensor 
+    products.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef GEMM_H
+#define GEMM_H
+
+/*
+ * Dense matrix multiply and accumulate, c += a * b.  All matrices are row
+ * major, a is m x k, b is k x n and c is m x n.  The work is tiled for the 
+ * cache, and the inner kernel uses AVX-512 or AVX2 when the processor 
+ * supports them.
+ */
+void dense_gemm(unsigned int m, unsigned int n, unsigned int k,
+		const double *a, const double *b, double *c);
+
+/* y += alpha * x, where x and y have n elements */
+void dense_axpy(unsigned int n, double alpha, const double *x, double *y);
+
+#endif
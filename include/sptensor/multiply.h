@@ -20,13 +20,70 @@
 #define MULTIPLY_H
 #include <sptensor/view.h>
 
-/* Matrix mulitplication between two tensor views, resulting in a
-   sparse tensor view containing a newly allocated sparse tensor. */
+/* 
+ * Matrix mulitplication between two tensor views, resulting in a newly
+ * allocated tensor view.  Its storage follows the operands: block tensors
+ * with matching tiles give a block tensor, a dense operand gives a dense
+ * tensor (when it fits in sptensor_max_memory), and anything else gives a
+ * sparse tensor.  Read the result through the view functions, since
+ * sptensor_view_data is NULL for the dense and block results.
+ */
 tensor_view *matrix_product(tensor_view *a, tensor_view *b);
 
-/* N-Mode multiplication of tensor a by matrix u */
+/* N-Mode multiplication of tensor a by matrix u.  Returns NULL when the
+   columns of u do not match mode n of a.  As with matrix_product, the 
+   result may be a block tensor, and a symmetric a gives a tensor which
+   is symmetric in the rest of its symmetric modes. */
 tensor_view *nmode_product(unsigned int n, tensor_view *a, tensor_view *u);
 
 /* Outer (tensor) product of two tensor views */
 tensor_view *tensor_product(tensor_view *a, tensor_view *b);
+
+/*
+ * Contract a and b over pairs of modes, summing over the indexes of 
+ * modes_a[i] of a and modes_b[i] of b for i = 0 ... count-1 (like einsum
+ * or tensordot).  The result has the remaining modes of a, in order, 
+ * followed by the remaining modes of b.  If every mode is contracted, 
+ * the result is a single element tensor.  The contracted modes must have
+ * the same dimensions, otherwise NULL is returned.  The matching is done
+ * by either a hash join or a sort-merge join, whichever is estimated to
+ * be cheaper, and is spread over sptensor_threads threads.
+ */
+tensor_view *tensor_contract(tensor_view *a, unsigned int *modes_a,
+			     tensor_view *b, unsigned int *modes_b,
+			     unsigned int count);
+
+/*
+ * Multiply a by u[k] along each mode k in modes[0] ... modes[count-1].
+ * The products are done in the order which is estimated to keep the 
+ * intermediate tensors smallest, based on the dimensions and nonzero
+ * counts involved.  u has an entry for every mode of a.  The result is 
+ * newly allocated, even if count is 0.
+ */
+tensor_view *nmode_chain_product(tensor_view *a, tensor_view **u,
+				 unsigned int *modes, unsigned int count);
+
+/*
+ * Matricized tensor times Khatri-Rao product.  Computes
+ *     out = A_(n) (U_{N-1} kr ... kr U_{n+1} kr U_{n-1} kr ... kr U_0)
+ * in a single pass over the nonzeros of a, without forming the Khatri-Rao
+ * product.  This is the A_n B_n^T of a CP decomposition.
+ *   a   - The tensor
+ *   u   - One I_k x R factor for each mode of a (u[n] is not used)
+ *   n   - The mode being computed
+ *   out - The I_n x R result, which is overwritten.  Dense views
+ *         (see dense_tensor_alloc) are filled in place.
+ */
+void mttkrp(tensor_view *a, tensor_view **u, unsigned int n, tensor_view *out);
+
+/* mttkrp over a compressed sparse fiber tree rooted at mode n, which 
+   shares the partial products of each fiber among its nonzeros */
+void mttkrp_csf(tensor_view *a, tensor_view **u, unsigned int n, 
+		tensor_view *out);
+
+/* mttkrp_csf with the nonzeros divided evenly into parts pieces (a
+   heavy mode-n slice may be split among several of them), which run on
+   up to parallel_threads() threads */
+void mttkrp_parallel(tensor_view *a, tensor_view **u, unsigned int n, 
+		     tensor_view *out, unsigned int parts);
 #endif
@@ -0,0 +1,109 @@
+/*
+    This is the thread pool which runs the parallel parts of the library.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <stdlib.h>
+
+/*
+ * The library keeps a pool of worker threads which is created the first
+ * time it is needed, and which grows as more threads are requested.  The
+ * calling thread always takes part in the work.  Parallel calls made
+ * from inside a parallel region (or while another thread is using the
+ * pool) simply run on the calling thread.
+ *
+ * The number of threads is sptensor_threads.  It may be set directly, or
+ * with sptensor_set_threads, and when it is left at its default of 1 the
+ * SPTENSOR_THREADS environment variable is used instead.
+ */
+
+/* the operations of parallel_reduce */
+#define PARALLEL_SUM 0
+#define PARALLEL_MAX 1
+
+/* the body of a parallel loop, covering items first ... last-1 */
+typedef void (*parallel_for_func)(void *arg, unsigned long first,
+				  unsigned long last, unsigned int thread);
+
+/* the body of a parallel reduction, returning the result for its items */
+typedef double (*parallel_reduce_func)(void *arg, unsigned long first,
+				       unsigned long last);
+
+/*
+ * A division of a run of slices (the rows of an unfolding, the slices of
+ * a mode, ...) into parts of about equal cost.  Part p covers the items
+ * first[p] ... first[p+1]-1, starting in slice slice[p].  When slices
+ * may be split, a heavy slice is shared by consecutive parts, and shared
+ * is set for each part which starts part way into a slice.  Such a part
+ * should keep its results for that slice to one side, to be merged into
+ * the slice once all of the parts have finished.  Every other slice is
+ * owned by a single part, so the parts never write to the same place.
+ */
+typedef struct parallel_partition {
+    unsigned int nparts;    /* the number of parts */
+    unsigned long *first;   /* the first item of each part (nparts+1) */
+    unsigned int *slice;    /* the slice holding that item (nparts+1) */
+    int *shared;            /* 1 if the part starts inside a slice */
+} parallel_partition;
+
+/* set the number of threads used by the library */
+void sptensor_set_threads(unsigned int n);
+
+/* the number of threads used by the library */
+unsigned int parallel_threads(void);
+
+/*
+ * Run func over the items 0 ... n-1.  The items are handed out in chunks
+ * of the given size (or of a size picked from n and the thread count if
+ * chunk is 0) as the threads become free.  thread is the number of the
+ * thread running the chunk, from 0 to parallel_threads()-1.
+ */
+void parallel_for(unsigned long n, unsigned long chunk,
+		  parallel_for_func func, void *arg);
+
+/*
+ * Reduce func over the items 0 ... n-1 with PARALLEL_SUM or PARALLEL_MAX.
+ * The chunks are fixed by n and chunk alone, and their results are
+ * combined in order, so the result does not depend on the thread count.
+ */
+double parallel_reduce(unsigned long n, unsigned long chunk,
+		       parallel_reduce_func func, void *arg, int op);
+
+/*
+ * Run func on each of the n tasks (each size bytes long) when the pool is
+ * free.  At most parallel_threads() threads (the calling thread included)
+ * take part, each taking the next task when it finishes one, so tasks 
+ * must not wait on each other.
+ */
+void parallel_tasks(void *(*func)(void *), void *tasks, size_t size,
+		    unsigned int n);
+
+/*
+ * Divide nslices slices into nparts parts of about equal cost.  ptr holds
+ * the prefix sums of the slice costs (the cost of the slices before
+ * slice i is ptr[i], and ptr has nslices+1 entries), and each unit of
+ * cost is one item.  If split is 0 the parts end on slice boundaries,
+ * otherwise they end on items and heavy slices are shared.
+ */
+parallel_partition *parallel_partition_alloc(const unsigned long *ptr,
+					     unsigned int nslices,
+					     unsigned int nparts, int split);
+
+/* free a partition */
+void parallel_partition_free(parallel_partition *part);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+    This is a collection of reduction kernels over arrays of values.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef REDUCE_H
+#define REDUCE_H
+#include <sptensor/view.h>
+
+/* the operations of tensor_reduce */
+#define TENSOR_REDUCE_SUM   0
+#define TENSOR_REDUCE_MAX   1
+#define TENSOR_REDUCE_COUNT 2
+
+/*
+ * All of the sums below are computed pairwise over blocks of the array,
+ * and each block is summed with several independent accumulators (using
+ * AVX-512 or AVX2 when the processor supports them).
+ */
+
+/* the sum of the n elements of x */
+double dense_sum(unsigned int n, const double *x);
+
+/* the sum of the absolute values of x (the L-1 norm) */
+double dense_asum(unsigned int n, const double *x);
+
+/* the L-2 norm of x, scaled so that it does not overflow or underflow */
+double dense_nrm2(unsigned int n, const double *x);
+
+/* the largest absolute value in x (the L-infinity norm) */
+double dense_amax(unsigned int n, const double *x);
+
+/* 
+ * The sum of |x|^p, without scaling.  This is the L-p norm raised to the
+ * p power, and it is the piece to use when a norm is accumulated a block 
+ * at a time.
+ */
+double dense_powsum(unsigned int n, const double *x, double p);
+
+/*
+ * The L-p norm of x.  p may be HUGE_VAL for the L-infinity norm.  Integer
+ * powers are computed by multiplication rather than pow, and the values
+ * are scaled by the largest one when needed to avoid overflow.
+ */
+double dense_lpnorm(unsigned int n, const double *x, double p);
+
+/*
+ * Reduce a tensor along one or more of its modes.  The result has the 
+ * remaining modes of v, in their original order.  Each of its elements 
+ * is the sum, the maximum or the count of the nonzero elements of v 
+ * which share its index (the maximum and count only consider the stored
+ * nonzeros).  When one mode or none remains, the result is a dense 
+ * vector (of length 1 for none), otherwise it is a sparse tensor.
+ *   v     - The tensor to reduce
+ *   modes - The modes to reduce (0 based)
+ *   count - The number of modes to reduce
+ *   op    - TENSOR_REDUCE_SUM, TENSOR_REDUCE_MAX or TENSOR_REDUCE_COUNT
+ */
+tensor_view *tensor_reduce(tensor_view *v, unsigned int *modes, 
+			   unsigned int count, int op);
+
+#endif
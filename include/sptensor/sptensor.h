@@ -21,7 +21,11 @@
 #include <sptensor/storage.h>
 #include <sptensor/binsearch.h>
 #include <sptensor/ccd.h>
+#include <sptensor/expr.h>
+#include <sptensor/gemm.h>
 #include <sptensor/multiply.h>
+#include <sptensor/parallel.h>
+#include <sptensor/reduce.h>
 #include <sptensor/sptensorio.h>
 #include <sptensor/tensor_math.h>
 #include <sptensor/vector.h>
@@ -35,3 +39,6 @@ extern unsigned int sptensor_verbose;
 
 /* default norm level to use in tensor algorithms (default 2) */
 extern int stpensor_default_lp;
+
+/* number of threads used by the library (default 1, see parallel.h) */
+extern unsigned int sptensor_threads;
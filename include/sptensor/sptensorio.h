@@ -51,4 +51,30 @@ sptensor *sptensor_read(FILE *file);
  */ 
 void sptensor_write(FILE *file, sptensor *tns);
 
+
+/*
+ * Write a sparse tensor to a stream in binary.  This is the number of 
+ * modes, the dimensions and the number of nonzeros, followed by the
+ * index array and then the value array, all in the machine's native 
+ * representation.  The stream should be opened in binary mode.
+ *
+ * Parameter: file - The stream to write to.
+ *            tns  - The tensor to write.
+ *
+ * Return: 0 on success, -1 if the write failed.
+ */
+int sptensor_write_binary(FILE *file, sptensor *tns);
+
+
+/*
+ * Read a sparse tensor written by sptensor_write_binary.
+ *
+ * Parameters: file - The file to read from
+ *
+ * Return: The newly read and allocated tensor, or NULL if the stream 
+ *         ended early or holds something which is not a tensor (an
+ *         index out of bounds or out of order, say).
+ */
+sptensor *sptensor_read_binary(FILE *file);
+
 #endif
@@ -71,6 +71,25 @@ double sptensor_get(sptensor *tns, sp_index_t *idx);
 void sptensor_set(sptensor *tns, sp_index_t *idx, double val);
 
 
+/*
+ * Append a value to the end of a sparse tensor without searching.  This
+ * is the bulk builder for kernels which produce their output in sorted
+ * order, so idx must come after every index already in the tensor.
+ * Zero values are dropped just as they are by sptensor_set.
+ *
+ * Parameters: tns - The sparse tensor to write to
+ *             idx - The index of the item
+ *             val - The value to write to the tensor
+ */
+void sptensor_append(sptensor *tns, sp_index_t *idx, double val);
+
+
+/*
+ * Make room for at least nnz nonzero entries in the sparse tensor.
+ */
+void sptensor_reserve(sptensor *tns, unsigned int nnz);
+
+
 /* 
  * Compare two indexes for a given tensor.  Comparison is 
  * performed from left to right.  Pretty much exactly as 
@@ -41,6 +41,35 @@ void tensor_decrease(tensor_view *a, tensor_view *b);
 /* inplace scaling of a tensor by a scalar (t*=s) */
 void tensor_scale(tensor_view *t, double s);
 
+/* 
+ * An elementwise map.  Maps are only applied to the stored elements, so
+ * they should take zero to zero.
+ */
+typedef double (*tensor_map_func)(double x, void *arg);
+
+/* inplace application of f(x, arg) to each nonzero element of t */
+void tensor_map(tensor_view *t, tensor_map_func f, void *arg);
+
+/* inplace absolute value (t = |t|) */
+void tensor_abs(tensor_view *t);
+
+/* inplace clamp of the negative elements to zero (t = max(t, 0)) */
+void tensor_clamp(tensor_view *t);
+
+/* inplace zeroing of the elements where |t| < tau */
+void tensor_threshold(tensor_view *t, double tau);
+
+/* inplace elementwise power (t = t^p) */
+void tensor_pow(tensor_view *t, double p);
+
+/* elementwise product of two tensors (returns a .* b) */
+tensor_view *tensor_hadamard(tensor_view *a, tensor_view *b);
+
+/* elementwise quotient of two tensors (returns a ./ b).  Only the
+   elements where both a and b are nonzero are computed, so the quotients
+   by zero are left out of the result. */
+tensor_view *tensor_elem_div(tensor_view *a, tensor_view *b);
+
 /* compute the LP norm of the tensor */
 double tensor_lpnorm(tensor_view *t, double p);
 #endif
@@ -70,6 +70,25 @@ void vector_free(vector *v);
 void vector_grow(vector *v);
 
 
+/*
+ * Make sure the vector has room for at least capacity elements.
+ *
+ * Parameters: v        - The vector to grow
+ *             capacity - The number of elements it must be able to hold
+ */
+void vector_reserve(vector *v, unsigned int capacity);
+
+
+/*
+ * Replace the contents of a vector with a copy of another vector's
+ * contents.  Both vectors must have the same element size.
+ *
+ * Parameters: v   - The vector to overwrite
+ *             src - The vector to copy
+ */
+void vector_assign(vector *v, vector *src);
+
+
 /*
  * Append an item to the back of the vector, growing if needed.
  * 
@@ -67,6 +67,26 @@ typedef struct tensor_slice_spec {
 } tensor_slice_spec;
 
 
+typedef struct block_tensor {
+    sp_index_t *bdim;       /* The tile size along each mode */
+    unsigned int tile_size; /* The number of elements in each tile */
+    vector *bidx;           /* block coordinates (maintained in sorted order) */
+    vector *tiles;          /* pointers to the dense tiles (row major) */
+    vector *tnnz;           /* the number of nonzero entries in each tile */
+    vector *tptr;           /* the nonzeros before each tile, and the total */
+    int stale;              /* 1 if tptr needs to be rebuilt */
+} block_tensor;
+
+
+typedef struct symmetric_tensor {
+    sptensor *tns;       /* the stored representatives */
+    int *sym;            /* nonzero for each mode in the symmetric group */
+    unsigned int nsym;   /* the number of symmetric modes */
+    unsigned int *start; /* expanded position of each representative */
+    int dirty;           /* 1 if start needs to be recomputed */
+} symmetric_tensor;
+
+
 struct tensor_view_iterator {
     int valid;        /* 1 if iterator is pointing to an item, 0 o.w. */
     tensor_view *tns; /* The view we are iterating over */
@@ -126,6 +146,63 @@ tensor_view *tensor_view_deep_copy(tensor_view *t);
 /* Create a dense tensor view (useful for smaller tensors) */
 tensor_view *dense_tensor_alloc(int nmodes, sp_index_t *dim);
 
+/* Returns the row major (last mode fastest) elements of a dense tensor view,
+   or NULL if v is some other kind of view. */
+double *dense_tensor_elements(tensor_view *v);
+
+
+/*
+ * Create a block sparse tensor view.  The nonzero regions of the tensor
+ * are stored as dense tiles of size bdim[0] x bdim[1] x ..., and the tiles
+ * are kept in a sorted coordinate list.  Block coordinates are 1 based,
+ * just like tensor indexes.
+ *   nmodes - The number of modes
+ *   dim    - The dimensions of the tensor
+ *   bdim   - The tile size along each mode
+ */
+tensor_view *block_tensor_alloc(int nmodes, sp_index_t *dim, sp_index_t *bdim);
+
+/* Returns the block tensor behind v, or NULL if v is not a block tensor */
+block_tensor *tensor_view_block(tensor_view *v);
+
+/*
+ * Returns the dense tile at block coordinate bidx.  If there is no such
+ * tile, a zeroed tile is inserted when create is nonzero, otherwise NULL
+ * is returned.  Callers which write to the tile directly must call
+ * block_tensor_refresh when they are done.
+ */
+double *block_tensor_tile(tensor_view *v, sp_index_t *bidx, int create);
+
+/* Recount the nonzeros of each tile, dropping the tiles which are empty */
+void block_tensor_refresh(tensor_view *v);
+
+/* Compare two block coordinates (a binsearch_cmp_func for bidx) */
+int block_tensor_bincmp(int element_size, void *a, void *b);
+
+
+/*
+ * Create a symmetric tensor view.  The tensor is symmetric in every mode
+ * i where sym[i] is nonzero (or in all modes if sym is NULL), and these
+ * modes must all have the same dimension.  Only the entries whose
+ * symmetric indexes are in nondecreasing order are stored, the other
+ * permutations are produced on access.
+ *   nmodes - The number of modes
+ *   dim    - The dimensions of the tensor
+ *   sym    - Flags for the symmetric modes
+ */
+tensor_view *symmetric_tensor_alloc(int nmodes, sp_index_t *dim, int *sym);
+
+/* Returns the symmetric tensor behind v, or NULL if v is not symmetric */
+symmetric_tensor *tensor_view_symmetric(tensor_view *v);
+
+/* The number of distinct permutations of the symmetric modes of idx */
+unsigned int symmetric_tensor_multiplicity(tensor_view *v, sp_index_t *idx);
+
+/* Step idx to the next lexicographic permutation of its symmetric modes.
+   Returns 0, leaving idx alone, if it is already the last one, so starting
+   from a stored representative visits each of its permutations once. */
+int symmetric_tensor_next(tensor_view *v, sp_index_t *idx);
+
 
 /* 
  * VIEW - sptensor view.  Wraps an sptensor and does no translation.  
@@ -134,12 +211,33 @@ tensor_view *dense_tensor_alloc(int nmodes, sp_index_t *dim);
  */
 tensor_view *sptensor_view(sptensor *tns);
 
+/* Returns the sptensor wrapped by an sptensor view (including those made
+   by tensor_alloc), or NULL if v is some other kind of view. */
+sptensor *sptensor_view_data(tensor_view *v);
+
 /* Unfold a tensor along dimension n */
 tensor_view *unfold_tensor(tensor_view* v, sp_index_t n);
 
 /* An identity tensor (with 1's along its superdiagonal) */
 tensor_view *identity_tensor(int nmodes, sp_index_t *dim);
 
+/*
+ * A lazy Khatri-Rao product of matrices u[0] ... u[count-1], each of
+ * which is I_k x R.  The result is (I_0 * I_1 * ...) x R, with the row
+ * index of the last matrix varying fastest.  Entries are computed on
+ * demand, and the matrices must not be changed while the view is in use.
+ *   u     - The matrices (the array is copied, the matrices are not)
+ *   count - The number of matrices
+ */
+tensor_view *khatri_rao_view(tensor_view **u, unsigned int count);
+
+/*
+ * A lazy Kronecker product of two tensors with the same number of modes.
+ * Each mode of the result has dimension a->dim[i] * b->dim[i], with the
+ * index of b varying fastest.  Entries are computed on demand.
+ */
+tensor_view *kronecker_view(tensor_view *a, tensor_view *b);
+
 /*
  * Allocate a tensor slice spec for the given view.
  */
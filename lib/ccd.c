@@ -16,19 +16,97 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sptensor/ccd.h>
 #include <sptensor/tensor_math.h>
+#include <sptensor/expr.h>
 #include <sptensor/multiply.h>
 #include <sptensor/binsearch.h>
-#define MAX(a, b) ((a)>(b) ? (a) : (b))
+#include <sptensor/gemm.h>
+#include <sptensor/reduce.h>
+#include <sptensor/parallel.h>
+#include <sptensor/sptensorio.h>
+
+/* identifies a binary ccd_result (the last byte is the version) */
+#define CCD_MAGIC "SPCCD\0\0\1"
+#define CCD_MAGIC_LEN 8
+
+/* N is always summed in this many pieces, whatever the thread count */
+#define CCD_MTTKRP_PARTS 64
+
+/* 
+ * A node of the dimension tree.  The node covers modes first ... last-1 
+ * and holds the core multiplied by every factor outside that range.  The
+ * root covers every mode (it is the core itself), and the leaf for mode n
+ * is B_n before unfolding.  Each node is computed from its parent, so 
+ * when a factor changes only the nodes which include it are redone.
+ */
+struct ccd_dtree {
+    int first;               /* first mode left out of the product */
+    int last;                /* end of the modes left out */
+    tensor_view *t;          /* the partial product (NULL if stale) */
+    struct ccd_dtree *left;  /* the first half of the modes */
+    struct ccd_dtree *right; /* the second half of the modes */
+};
+
+/* one thread's block of rows in ccd_update */
+struct ccd_rows {
+    sp_index_t first;        /* first row (0 based) */
+    sp_index_t end;          /* end of the rows */
+    sp_index_t rank;         /* number of columns */
+    double *u;               /* U_n */
+    double *nd;              /* N, less lambda */
+    double *md;              /* M with a zero diagonal */
+    double *unm;             /* U_n M */
+    double *d;               /* the diagonal of M */
+    double *last;            /* the change made by the last pass */
+};
+
+/*
+ * Checkpointing, set by ccd_checkpoint.  A snapshot of the result is
+ * written by a background thread, and at most one write is in flight.
+ */
+static struct {
+    char *fname;             /* the checkpoint file (NULL if disabled) */
+    int iters;               /* iterations between checkpoints */
+    double seconds;          /* seconds between checkpoints */
+    pthread_t writer;        /* the thread writing the last snapshot */
+    int writing;             /* 1 if writer has not been joined */
+} checkpoint = { NULL, 0, 0.0, 0, 0 };
 
 /* static prototypes */
-static void ccd_update(tensor_view *an, tensor_view *bn, double ln,
+static void ccd_update(double *nd, double *md, double ln,
 		       tensor_view *un, int max_iter, double tol);
+static void *ccd_update_rows(void *arg);
 static void ccd_un_init(ccd_result *result, tensor_view *a, int n);
-static tensor_view *ccd_compute_bn(ccd_result *result, int n);
+static tensor_view *ccd_compute_bn(ccd_result *result, 
+				   struct ccd_dtree *tree, int n);
+static double *ccd_compute_n(ccd_result *result, tensor_view *a, 
+			     tensor_view *an, tensor_view *bn, int n);
+static double *ccd_compute_m(ccd_result *result, double **gram,
+			     tensor_view *bn, int n);
+static void ccd_gram(tensor_view *u, double *g);
+static double *ccd_dense(tensor_view *u);
+static double ccd_inner(ccd_result *result, tensor_view *a);
+static double ccd_xnorm2(ccd_result *result, double **gram);
+static double ccd_fit_nm(ccd_result *result, int n, double *nd, 
+			 double *md, double anorm);
+static double ccd_fit_gram(ccd_result *result, tensor_view *a, 
+			   double anorm, double **gram);
 static void ccd_bn_free(tensor_view *bn);
+static int ccd_is_identity(tensor_view *c);
+static struct ccd_dtree *ccd_dtree_alloc(int first, int last);
+static void ccd_dtree_free(struct ccd_dtree *node);
+static void ccd_dtree_invalidate(struct ccd_dtree *node, int n);
+static ccd_result *ccd_copy(ccd_result *result);
+static tensor_view *ccd_read_tensor(FILE *file);
+static void ccd_checkpoint_start(ccd_result *result);
+static void ccd_checkpoint_wait(void);
+static void *ccd_checkpoint_write(void *arg);
 
 
 /*
@@ -86,11 +164,6 @@ ccd_core(tensor_view *a, tensor_view *c, double lambda[],
 	 int max_iter, double tol)
 {
     ccd_result *result;
-    tensor_view *unlast;
-    tensor_view *bn, *b;
-    tensor_view **a_unfold;
-    double max_error;
-    double error;
     int i;
 
     /* allocate and initialize the result */
@@ -101,30 +174,109 @@ ccd_core(tensor_view *a, tensor_view *c, double lambda[],
     result->iter = 0;
     result->final_error = HUGE_VAL;
     result->fit = 0;
+    result->fits = NULL;
     for(i=0; i<result->n; i++) {
 	ccd_un_init(result, a, i);
     }
 
+    return ccd_resume(a, result, lambda, max_iter, tol);
+}
+
+
+/*
+ * Continue a CCD factorization from a previous result (such as one read
+ * back from a checkpoint).
+ */
+ccd_result *
+ccd_resume(tensor_view *a, ccd_result *result, double lambda[],
+	   int max_iter, double tol)
+{
+    tensor_view *unlast;
+    tensor_expr *diff;
+    tensor_view *bn;
+    tensor_view **a_unfold;
+    struct ccd_dtree *tree;
+    double **gram;
+    double *n;
+    double *m;
+    double *nlast, *mlast;
+    size_t nsize, msize;
+    double anorm;
+    double max_error;
+    double error;
+    time_t saved;
+    int i;
+
+    /* room for the fit of every iteration */
+    result->fits = realloc(result->fits, sizeof(double) * 
+			   (result->iter > max_iter ? result->iter+1 : 
+			    max_iter+1));
+
     /* create the unfolds for a */
     a_unfold = malloc(sizeof(tensor_view*) * result->n);
     for(i=0; i<result->n; i++) {
 	a_unfold[i] = unfold_tensor(a, i);
     }
 
+    /* 
+     * Partial products of the core are shared between the modes.  With 
+     * an identity core, B_n is never formed.  B_n B_n^T is then the 
+     * elementwise product of the Gram matrices U_k^T U_k of the other 
+     * factors, and each of those is redone only when its factor changes.
+     */
+    tree = NULL;
+    gram = NULL;
+    if(ccd_is_identity(result->core)) {
+	gram = malloc(sizeof(double*) * result->n);
+	for(i=0; i<result->n; i++) {
+	    gram[i] = malloc(sizeof(double) * result->core->dim[i] * 
+			     result->core->dim[i]);
+	    ccd_gram(result->u[i], gram[i]);
+	}
+    } else {
+	tree = ccd_dtree_alloc(0, result->n);
+    }
+
     /* run the iterations */
+    anorm = tensor_lpnorm(a, 2.0);
+    saved = time(NULL);
+    nlast = mlast = NULL;
     while(result->final_error > tol && result->iter < max_iter) {
 	/* run the updates */
 	max_error = 0;
 	printf("Iteration: %d\n", result->iter);
 	for(i=0; i<result->n; i++) {
 	    unlast = tensor_view_deep_copy(result->u[i]);
-	    bn = ccd_compute_bn(result, i);
-	    ccd_update(a_unfold[i], bn, lambda[i], result->u[i], max_iter, tol);
-	    ccd_bn_free(bn);
+	    bn = gram ? NULL : ccd_compute_bn(result, tree, i);
+	    n = ccd_compute_n(result, a, a_unfold[i], bn, i);
+	    m = ccd_compute_m(result, gram, bn, i);
+
+	    /* the last mode's N and M are kept for the fit */
+	    if(i == result->n-1) {
+		nsize = sizeof(double) * result->u[i]->dim[0] * 
+		    result->u[i]->dim[1];
+		msize = sizeof(double) * result->u[i]->dim[1] * 
+		    result->u[i]->dim[1];
+		nlast = malloc(nsize);
+		mlast = malloc(msize);
+		memcpy(nlast, n, nsize);
+		memcpy(mlast, m, msize);
+	    }
+	    ccd_update(n, m, lambda[i], result->u[i], max_iter, tol);
+	    if(bn) {
+		ccd_bn_free(bn);
+	    }
+	    if(tree) {
+		ccd_dtree_invalidate(tree, i);
+	    }
+	    if(gram) {
+		ccd_gram(result->u[i], gram[i]);
+	    }
 
 	    /* compute the error */
-	    tensor_decrease(unlast, result->u[i]);
-	    error = tensor_lpnorm(unlast, 2.0);
+	    diff = expr_sub(expr_tensor(unlast), expr_tensor(result->u[i]));
+	    error = expr_lpnorm(diff, 2.0);
+	    expr_free(diff);
 	    if(error > max_error) {
 		max_error = error;
 	    }
@@ -135,20 +287,46 @@ ccd_core(tensor_view *a, tensor_view *c, double lambda[],
 
 	/* update iteration stats */
 	result->final_error = max_error;
+	result->fits[result->iter] = ccd_fit_nm(result, result->n-1, 
+						nlast, mlast, anorm);
+	free(nlast);
+	free(mlast);
 	result->iter++;
+
+	/* hand a snapshot to the checkpoint writer when one is due */
+	if(checkpoint.fname && 
+	   ((checkpoint.iters > 0 && result->iter % checkpoint.iters == 0) ||
+	    (checkpoint.seconds > 0 && 
+	     difftime(time(NULL), saved) >= checkpoint.seconds))) {
+	    ccd_checkpoint_start(result);
+	    saved = time(NULL);
+	}
     }
 
-    /* compute the fit */
-    b = ccd_construct(result);
-    tensor_decrease(b, a);
-    result->fit = 1.0 - tensor_lpnorm(b, 2.0)/tensor_lpnorm(a, 2.0);
-    TVFREE(b);
+    /* the fit of the last iteration */
+    result->fit = result->iter ? result->fits[result->iter-1] : 
+	ccd_fit_gram(result, a, anorm, gram);
+
+    /* the final state is always checkpointed */
+    if(checkpoint.fname) {
+	ccd_checkpoint_start(result);
+	ccd_checkpoint_wait();
+    }
 
     /* cleanup */
     for(i=0; i<result->n; i++) {
 	TVFREE(a_unfold[i]);
     }
     free(a_unfold);
+    if(tree) {
+	ccd_dtree_free(tree);
+    }
+    if(gram) {
+	for(i=0; i<result->n; i++) {
+	    free(gram[i]);
+	}
+	free(gram);
+    }
     
     return result;
 }
@@ -161,23 +339,32 @@ tensor_view *
 ccd_construct(ccd_result *result)
 {
     tensor_view *t;
-    tensor_view *prev;
+    unsigned int *modes;
     int i;        
 
-    /* we begin with the core */
-    t = tensor_view_deep_copy(result->core);
-
+    /* multiply the core by every factor */
+    modes = malloc(sizeof(unsigned int) * result->n);
     for(i=0; i<result->n; i++) {
-	/* perform the multiplication */
-	prev = t;
-	t = nmode_product(i, t, result->u[i]);
-	TVFREE(prev);
+	modes[i] = i;
     }
+    t = nmode_chain_product(result->core, result->u, modes, result->n);
+    free(modes);
 
     return t;
 }
 
 
+/*
+ * Computes the fit 1 - ||A - X|| / ||A|| of the decomposition without 
+ * constructing X
+ */
+double
+ccd_fit(ccd_result *result, tensor_view *a)
+{
+    return ccd_fit_gram(result, a, tensor_lpnorm(a, 2.0), NULL);
+}
+
+
 /*
  * Free's the ccd result
  * Parameters;
@@ -190,143 +377,304 @@ ccd_free(ccd_result *result)
 
     /* loop over the factor array, freeing as we go */
     for(i=0; i<result->n; i++) {
-	TVFREE(result->u[i]);
+	if(result->u[i]) TVFREE(result->u[i]);
     }
 
     /* dispose of the rest */
     free(result->u);
-    free(result->core);
+    free(result->fits);
+    if(result->core) TVFREE(result->core);
     free(result);
 }
 
 
-static
-int setcmp(int element_isze, void *a, void *b)
+/*
+ * Write a ccd result to a stream in binary.  The layout is a magic 
+ * string, the factor count, the iteration count, the final error and 
+ * fit, the fit of each iteration, and then the core and each factor as 
+ * written by sptensor_write_binary.
+ */
+int
+ccd_write(FILE *file, ccd_result *result)
 {
-    int *x = (int*)a;
-    int *y = (int*)b;
+    sptensor *tns;
+    int failed;
+    int i;
+
+    if(fwrite(CCD_MAGIC, 1, CCD_MAGIC_LEN, file) != CCD_MAGIC_LEN ||
+       fwrite(&result->n, sizeof(int), 1, file) != 1 ||
+       fwrite(&result->iter, sizeof(unsigned int), 1, file) != 1 ||
+       fwrite(&result->final_error, sizeof(double), 1, file) != 1 ||
+       fwrite(&result->fit, sizeof(double), 1, file) != 1 ||
+       fwrite(result->fits, sizeof(double), result->iter, file) 
+       != result->iter) {
+	return -1;
+    }
+
+    /* the core and factors are written as sparse tensors */
+    for(i=-1; i<result->n; i++) {
+	tns = tensor_view_sptensor(i < 0 ? result->core : result->u[i]);
+	failed = sptensor_write_binary(file, tns);
+	sptensor_free(tns);
+	if(failed) {
+	    return -1;
+	}
+    }
 
-    if(*x < *y) return -1;
-    if(*x > *y) return 1;
     return 0;
 }
 
-static void
-nzrows(vector *v, tensor_view *t)
+
+/* Read a ccd result written by ccd_write */
+ccd_result *
+ccd_read(FILE *file)
 {
+    ccd_result *result;
+    char magic[CCD_MAGIC_LEN];
     int i;
-    sp_index_t r[2];
-    int nnz = TVNNZ(t);
 
-    for(i=0; i<nnz; i++) {
-	TVIDX(t, i, r);
-	vector_set_insert(v, r, setcmp);
+    if(fread(magic, 1, CCD_MAGIC_LEN, file) != CCD_MAGIC_LEN ||
+       memcmp(magic, CCD_MAGIC, CCD_MAGIC_LEN)) {
+	return NULL;
+    }
+
+    /* read the counters */
+    result = malloc(sizeof(ccd_result));
+    result->core = NULL;
+    result->u = NULL;
+    result->fits = NULL;
+    result->n = 0;
+    if(fread(&result->n, sizeof(int), 1, file) != 1 ||
+       fread(&result->iter, sizeof(unsigned int), 1, file) != 1 ||
+       fread(&result->final_error, sizeof(double), 1, file) != 1 ||
+       fread(&result->fit, sizeof(double), 1, file) != 1 ||
+       result->n < 1) {
+	free(result);
+	return NULL;
+    }
+    result->fits = malloc(sizeof(double) * (result->iter+1));
+    result->u = calloc(result->n, sizeof(tensor_view*));
+    if(fread(result->fits, sizeof(double), result->iter, file) 
+       != result->iter) {
+	ccd_free(result);
+	return NULL;
+    }
+
+    /* read the core and the factors */
+    result->core = ccd_read_tensor(file);
+    for(i=0; i<result->n && result->core; i++) {
+	result->u[i] = ccd_read_tensor(file);
+	if(!result->u[i]) break;
     }
+    if(!result->core || i < result->n) {
+	ccd_free(result);
+	return NULL;
+    }
+
+    /* the factors have to be matrices which fit the core */
+    if(result->core->nmodes != (unsigned int) result->n) {
+	ccd_free(result);
+	return NULL;
+    }
+    for(i=0; i<result->n; i++) {
+	if(result->u[i]->nmodes != 2 || 
+	   result->u[i]->dim[1] != result->core->dim[i]) {
+	    ccd_free(result);
+	    return NULL;
+	}
+    }
+
+    return result;
 }
 
 
-static void ccd_update(tensor_view *an, tensor_view *bn, double ln,
+/*
+ * Checkpoint every CCD factorization which follows to fname, every iters
+ * iterations or every seconds seconds, whichever comes first.
+ */
+void
+ccd_checkpoint(const char *fname, int iters, double seconds)
+{
+    ccd_checkpoint_wait();
+    free(checkpoint.fname);
+    checkpoint.fname = NULL;
+    if(fname) {
+	checkpoint.fname = malloc(strlen(fname)+1);
+	strcpy(checkpoint.fname, fname);
+    }
+    checkpoint.iters = iters;
+    checkpoint.seconds = seconds;
+}
+
+
+static
+int setcmp(int element_isze, void *a, void *b)
+{
+    int *x = (int*)a;
+    int *y = (int*)b;
+
+    if(*x < *y) return -1;
+    if(*x > *y) return 1;
+    return 0;
+}
+
+/*
+ * Run the column updates of U_n, given the dense N = A_n B_n^T and 
+ * M = B_n B_n^T.  N and M are used as scratch space and freed.  The 
+ * updates work on a dense copy of U_n, and keep U_n M as they go.
+ * Changing column j of U_n changes U_n M by the outer product of the
+ * change with row j of M, so each column costs O(I_n R) rather than a 
+ * whole matrix product.
+ *
+ * A row of U_n only ever reads its own rows of N and U_n M, so the rows
+ * are divided into blocks which run through all of the columns on their
+ * own threads.  Each row sees the same operations in the same order as
+ * it would serially, so the result does not depend on the thread count.
+ */
+static void ccd_update(double *nd, double *md, double ln,
 		       tensor_view *un, int max_iter, double tol)
 {
-    tensor_view *bnt;  /* transpose of bn */
-    tensor_view *m;
-    tensor_view *n;
-    tensor_view *d;
-    tensor_view *unm;
-    tensor_view *mj;
-    tensor_view *nj;
-    tensor_view *unlast;
-    vector *rows;
+    struct ccd_rows task;
+    struct ccd_rows *tasks;
+    parallel_partition *part;
+    unsigned long *cost;
+    sptensor *tns;
     sp_index_t idx[2];
-    sp_index_t j;
-    sp_index_t jmax;
-    int iter=0;
-    int i;
-    int nnz;
+    sp_index_t rows, rank;
+    sp_index_t i, j;
     double val;
     double error = HUGE_VAL;
-    tensor_slice_spec *slice;
-    double dj;
+    unsigned int nparts, p;
+    int iter=0;
 
     /* get preliminary things set up */
-    jmax = un->dim[1];
-    bnt = tensor_transpose(bn, 0, 1);
-    rows = vector_alloc(sizeof(sp_index_t), 128);
-    slice = tensor_slice_spec_alloc(un);
-    slice->begin[0] = 1;
-    slice->begin[1] = 1;
-    slice->end[0] = un->dim[0];
-    slice->end[1] = un->dim[1];
+    rows = un->dim[0];
+    rank = un->dim[1];
+    task.rank = rank;
+    task.u = ccd_dense(un);
+    task.nd = nd;
+    task.unm = calloc(rows * rank, sizeof(double));
+    task.d = malloc(sizeof(double) * rank);
+    task.md = md;
+    task.last = malloc(sizeof(double) * rows * rank);
 
-    /* compute m and n */
-    m = matrix_product(bn, bnt);
-    n = matrix_product(an, bnt);
-    nnz = TVNNZ(n);
-    for(i=0; i<nnz; i++) {
-	TVIDX(n, i, idx);
-	TVSET(n, idx, TVGETI(n, i) - ln);
+    /* finish n (lambda comes off of its nonzeros) */
+    cost = calloc(rows+1, sizeof(unsigned long));
+    for(i=0; i<rows; i++) {
+	for(j=0; j<rank; j++) {
+	    if(nd[i*rank + j] != 0.0) {
+		nd[i*rank + j] -= ln;
+		cost[i+1]++;
+	    }
+	}
     }
 
     /* compute d and zero M's diagonal */
-    idx[0] = jmax;
-    d = tensor_alloc(1, idx);
-    for(j=1; j<=jmax; j++) {
-	idx[0] = idx[1] = j;
-	TVSET(d, idx, TVGET(m, idx));
-	TVSET(m, idx, 0);
+    for(j=0; j<rank; j++) {
+	task.d[j] = md[j*rank + j];
+	md[j*rank + j] = 0;
+    }
+    dense_gemm(rows, rank, rank, task.u, md, task.unm);
+
+    /* 
+     * Split the rows by the nonzeros of N (plus one for each row, since
+     * every row is visited).  Rows belong to exactly one block.
+     */
+    for(i=0; i<rows; i++) {
+	cost[i+1] += cost[i] + 1;
+    }
+    nparts = parallel_threads() < rows ? parallel_threads() : rows;
+    part = parallel_partition_alloc(cost, rows, nparts, 0);
+    tasks = malloc(sizeof(struct ccd_rows) * part->nparts);
+    for(p=0; p<part->nparts; p++) {
+	tasks[p] = task;
+	tasks[p].first = part->slice[p];
+	tasks[p].end = part->slice[p+1];
     }
 
     /* run the update loop */
     while(error > tol && iter < max_iter) {
-	unlast = tensor_view_deep_copy(un);
         printf("    Iteration: %d\n", iter);
-	/* update each column */
-	for(j=1; j <= jmax; j++) {
-	    slice->fixed[1] = j;
-	    nj = tensor_slice(n, slice);
-	    mj = tensor_slice(m, slice);
-	    unm = matrix_product(un, m);
-	    
-	    /* extract rows */
-	    rows->size=0;
-	    nzrows(rows, un);
-	    nzrows(rows, unm);
-	    nzrows(rows, nj);
-
-	    /* update un */
-	    for(i=0; i<rows->size; i++) {
-		idx[0] = VVAL(sp_index_t, rows, i);
-		idx[1] = j;
-		val = TVGET(n, idx) - TVGET(unm, idx);
-		dj = TVGET(d, &j);
-		if(dj != 0.0) {
-		    val /= TVGET(d, &j);
-		} else {
-		    val = 0;
-		}
-		TVSET(un, idx, MAX(0, val));
-	    }
-
-	    TVFREE(nj);
-	    TVFREE(mj);
-	    TVFREE(unm);
-	}
+	parallel_tasks(ccd_update_rows, tasks, sizeof(struct ccd_rows),
+		       part->nparts);
 
 	/* compute the error and count the iterations */
-	tensor_decrease(unlast, un);
-	error = tensor_lpnorm(unlast, 2.0);
+	error = dense_nrm2(rows * rank, task.last);
 	iter++;
+    }
 
-	/* cleanup */
-	TVFREE(unlast);
+    /* write back u */
+    tns = sptensor_view_data(un);
+    if(tns) {
+	tns->ar->size = 0;
+	tns->idx->size = 0;
+    }
+    for(idx[0]=1; idx[0]<=rows; idx[0]++) {
+	for(idx[1]=1; idx[1]<=rank; idx[1]++) {
+	    val = task.u[(idx[0]-1)*rank + idx[1]-1];
+	    if(tns) {
+		sptensor_append(tns, idx, val);
+	    } else {
+		TVSET(un, idx, val);
+	    }
+	}
     }
 
     /* cleanup! */
-    TVFREE(m);
-    TVFREE(n);
-    TVFREE(d);
-    vector_free(rows);
-    tensor_slice_spec_free(slice);
+    parallel_partition_free(part);
+    free(tasks);
+    free(cost);
+    free(task.u);
+    free(task.nd);
+    free(md);
+    free(task.unm);
+    free(task.d);
+    free(task.last);
+}
+
+
+/*
+ * One pass of the column updates over a block of rows.  The difference
+ * from the previous pass (with small values dropped) is left in last.
+ */
+static void *
+ccd_update_rows(void *arg)
+{
+    struct ccd_rows *task = (struct ccd_rows *) arg;
+    unsigned int rank = task->rank;
+    double *u, *unm;
+    double val, delta;
+    sp_index_t i, j;
+
+    memcpy(task->last + task->first * rank, task->u + task->first * rank,
+	   sizeof(double) * (task->end - task->first) * rank);
+
+    /* update each column */
+    for(j=0; j<rank; j++) {
+	for(i=task->first; i<task->end; i++) {
+	    u = task->u + i*rank;
+	    unm = task->unm + i*rank;
+	    if(task->d[j] != 0.0) {
+		val = (task->nd[i*rank + j] - unm[j]) / task->d[j];
+	    } else {
+		val = 0;
+	    }
+
+	    /* small values are dropped, just as in the sparse U_n */
+	    val = val > 1.0e-7 ? val : 0;
+	    delta = val - u[j];
+	    if(delta == 0.0) continue;
+	    u[j] = val;
+	    dense_axpy(rank, delta, task->md + j*rank, unm);
+	}
+    }
+
+    for(i=task->first * rank; i<task->end * rank; i++) {
+	task->last[i] -= task->u[i];
+	if(fabs(task->last[i]) <= 1.0e-7) task->last[i] = 0;
+    }
+
+    return NULL;
 }
 
 
@@ -381,30 +729,388 @@ ccd_un_init(ccd_result *result, tensor_view *a, int n)
 
 
 static tensor_view *
-ccd_compute_bn(ccd_result *result, int n)
+ccd_compute_bn(ccd_result *result, struct ccd_dtree *tree, int n)
 {
     tensor_view *bn;
-    tensor_view *prev;
-    int i;        
-
-    /* we begin with the core */
-    bn = tensor_view_deep_copy(result->core);
+    tensor_view *base;
+    struct ccd_dtree *node, *child, *other;
+    unsigned int *modes;
+    int i;
 
-    for(i=0; i<result->n; i++) {
-	/* skip the nth product */
-	if(i == n) continue;
-	
+    /* walk down to the leaf for n, filling in stale nodes on the way */
+    node = tree;
+    base = result->core;
+    modes = malloc(sizeof(unsigned int) * result->n);
+    while(node->left) {
+	if(n < node->left->last) {
+	    child = node->left;
+	    other = node->right;
+	} else {
+	    child = node->right;
+	    other = node->left;
+	}
+	if(!child->t) {
+	    for(i=other->first; i<other->last; i++) {
+		modes[i - other->first] = i;
+	    }
+	    child->t = nmode_chain_product(base, result->u, modes, 
+					   other->last - other->first);
+	}
+	base = child->t;
+	node = child;
+    }
+    free(modes);
 
-	/* perform the multiplication */
-	prev = bn;
-	bn = nmode_product(i, bn, result->u[i]);
-	TVFREE(prev);
+    /* 
+     * The leaf goes stale as soon as any other factor changes, so it is 
+     * handed over to the caller rather than kept.
+     */
+    if(node == tree) {
+	bn = tensor_view_deep_copy(result->core);
+    } else {
+	bn = node->t;
+	node->t = NULL;
     }
 
     return unfold_tensor(bn, n);
 }
 
 
+/*
+ * Compute N = A_n B_n^T.  With an identity core this is a matricized
+ * tensor times Khatri-Rao product, which is computed straight from the
+ * nonzeros of a (and bn is not used).  Otherwise the unfolding is 
+ * multiplied by B_n^T.  N is returned as a dense I_n x R array.
+ */
+static double *
+ccd_compute_n(ccd_result *result, tensor_view *a, tensor_view *an,
+	      tensor_view *bn, int n)
+{
+    tensor_view *out;
+    tensor_view *bnt;
+    sp_index_t dim[2];
+    double *nd;
+
+    if(!ccd_is_identity(result->core)) {
+	bnt = tensor_transpose(bn, 0, 1);
+	out = matrix_product(an, bnt);
+	nd = ccd_dense(out);
+	TVFREE(out);
+	TVFREE(bnt);
+	return nd;
+    }
+
+    /* 
+     * mttkrp into a dense matrix, split by nonzeros.  The split is fixed
+     * rather than one piece per thread, and the pieces of a shared slice
+     * are added in slice order, so N (and so U_n) comes out the same for
+     * any number of threads.  The pieces run on parallel_threads()
+     * threads at most.
+     */
+    dim[0] = a->dim[n];
+    dim[1] = result->core->dim[n];
+    out = dense_tensor_alloc(2, dim);
+    mttkrp_parallel(a, result->u, n, out, CCD_MTTKRP_PARTS);
+
+    nd = malloc(sizeof(double) * dim[0] * dim[1]);
+    memcpy(nd, dense_tensor_elements(out), sizeof(double) * dim[0] * dim[1]);
+    TVFREE(out);
+
+    return nd;
+}
+
+
+/*
+ * Compute the dense M = B_n B_n^T.  With an identity core this is the 
+ * elementwise product of the Gram matrices of the other factors, 
+ * otherwise B_n is multiplied by its transpose.
+ */
+static double *
+ccd_compute_m(ccd_result *result, double **gram, tensor_view *bn, int n)
+{
+    tensor_view *bnt;
+    tensor_view *m;
+    sp_index_t idx[2];
+    double *md;
+    unsigned int rank;
+    unsigned int r;
+    int i, k, nnz;
+
+    rank = result->u[n]->dim[1];
+    md = malloc(sizeof(double) * rank * rank);
+    if(gram) {
+	for(r=0; r<rank*rank; r++) {
+	    md[r] = 1.0;
+	}
+	for(k=0; k<result->n; k++) {
+	    if(k == n) continue;
+	    for(r=0; r<rank*rank; r++) {
+		md[r] *= gram[k][r];
+	    }
+	}
+	return md;
+    }
+
+    bnt = tensor_transpose(bn, 0, 1);
+    m = matrix_product(bn, bnt);
+    memset(md, 0, sizeof(double) * rank * rank);
+    nnz = TVNNZ(m);
+    for(i=0; i<nnz; i++) {
+	TVIDX(m, i, idx);
+	md[(idx[0]-1)*rank + idx[1]-1] = TVGETI(m, i);
+    }
+    TVFREE(m);
+    TVFREE(bnt);
+
+    return md;
+}
+
+
+/* Compute the R x R Gram matrix g = U^T U of a factor */
+static void
+ccd_gram(tensor_view *u, double *g)
+{
+    unsigned int rows, rank;
+    unsigned int i, r;
+    double *ud;
+
+    rows = u->dim[0];
+    rank = u->dim[1];
+    ud = ccd_dense(u);
+
+    /* sum the outer product of each row with itself */
+    memset(g, 0, sizeof(double) * rank * rank);
+    for(i=0; i<rows; i++) {
+	for(r=0; r<rank; r++) {
+	    if(ud[i*rank + r] == 0.0) continue;
+	    dense_axpy(rank, ud[i*rank + r], ud + i*rank, g + r*rank);
+	}
+    }
+    free(ud);
+}
+
+
+/* A dense row major copy of a matrix */
+static double *
+ccd_dense(tensor_view *u)
+{
+    sp_index_t idx[2];
+    double *ud;
+    int k, nnz;
+
+    ud = calloc(u->dim[0] * u->dim[1], sizeof(double));
+    nnz = TVNNZ(u);
+    for(k=0; k<nnz; k++) {
+	TVIDX(u, k, idx);
+	ud[(idx[0]-1)*u->dim[1] + idx[1]-1] = TVGETI(u, k);
+    }
+    return ud;
+}
+
+
+/*
+ * The inner product <A, X> of a with the constructed tensor, which only
+ * needs the nonzeros of a.  With an identity core each nonzero meets 
+ * the sum of the elementwise product of its factor rows.  Otherwise the
+ * inner product is <A x_1 U_1^T ... x_N U_N^T, core>.
+ */
+static double
+ccd_inner(ccd_result *result, tensor_view *a)
+{
+    tensor_view **ut;
+    tensor_view *t;
+    tensor_expr *e;
+    unsigned int *modes;
+    sp_index_t *idx;
+    double **ud;
+    double *prod;
+    double sum, row;
+    unsigned int rank, r;
+    int i, k, nnz;
+
+    if(ccd_is_identity(result->core)) {
+	rank = result->u[0]->dim[1];
+	ud = malloc(sizeof(double*) * result->n);
+	for(k=0; k<result->n; k++) {
+	    ud[k] = ccd_dense(result->u[k]);
+	}
+	idx = malloc(sizeof(sp_index_t) * result->n);
+	prod = malloc(sizeof(double) * rank);
+	sum = 0;
+	nnz = TVNNZ(a);
+	for(i=0; i<nnz; i++) {
+	    TVIDX(a, i, idx);
+	    for(r=0; r<rank; r++) {
+		prod[r] = 1.0;
+	    }
+	    for(k=0; k<result->n; k++) {
+		for(r=0; r<rank; r++) {
+		    prod[r] *= ud[k][(idx[k]-1)*rank + r];
+		}
+	    }
+	    for(row=0, r=0; r<rank; r++) {
+		row += prod[r];
+	    }
+	    sum += TVGETI(a, i) * row;
+	}
+	for(k=0; k<result->n; k++) {
+	    free(ud[k]);
+	}
+	free(ud);
+	free(idx);
+	free(prod);
+	return sum;
+    }
+
+    ut = malloc(sizeof(tensor_view*) * result->n);
+    modes = malloc(sizeof(unsigned int) * result->n);
+    for(k=0; k<result->n; k++) {
+	ut[k] = tensor_transpose(result->u[k], 0, 1);
+	modes[k] = k;
+    }
+    t = nmode_chain_product(a, ut, modes, result->n);
+    e = expr_hadamard(expr_tensor(t), expr_tensor(result->core));
+    sum = expr_sum(e);
+    expr_free(e);
+    TVFREE(t);
+    for(k=0; k<result->n; k++) {
+	TVFREE(ut[k]);
+    }
+    free(ut);
+    free(modes);
+
+    return sum;
+}
+
+
+/*
+ * ||X||^2 of the constructed tensor from the Gram matrices of the 
+ * factors.  With an identity core this is the sum of their elementwise
+ * product, otherwise it is <core x_1 G_1 ... x_N G_N, core>.
+ */
+static double
+ccd_xnorm2(ccd_result *result, double **gram)
+{
+    tensor_view **g;
+    tensor_view *t;
+    tensor_expr *e;
+    unsigned int *modes;
+    sp_index_t dim[2];
+    double sum, prod;
+    unsigned int rank, r;
+    int k;
+
+    if(ccd_is_identity(result->core)) {
+	rank = result->u[0]->dim[1];
+	sum = 0;
+	for(r=0; r<rank*rank; r++) {
+	    for(prod=1.0, k=0; k<result->n; k++) {
+		prod *= gram[k][r];
+	    }
+	    sum += prod;
+	}
+	return sum;
+    }
+
+    g = malloc(sizeof(tensor_view*) * result->n);
+    modes = malloc(sizeof(unsigned int) * result->n);
+    for(k=0; k<result->n; k++) {
+	dim[0] = dim[1] = result->u[k]->dim[1];
+	g[k] = dense_tensor_alloc(2, dim);
+	memcpy(dense_tensor_elements(g[k]), gram[k], 
+	       sizeof(double) * dim[0] * dim[1]);
+	modes[k] = k;
+    }
+    t = nmode_chain_product(result->core, g, modes, result->n);
+    e = expr_hadamard(expr_tensor(t), expr_tensor(result->core));
+    sum = expr_sum(e);
+    expr_free(e);
+    TVFREE(t);
+    for(k=0; k<result->n; k++) {
+	TVFREE(g[k]);
+    }
+    free(g);
+    free(modes);
+
+    return sum;
+}
+
+
+/*
+ * The fit from the N = A_n B_n^T and M = B_n B_n^T that the last update
+ * of an iteration used.  Every other factor was final by then, so 
+ * <A, X> = <N, U_n> and ||X||^2 = <U_n M, U_n>, and the fit needs no
+ * further products with A or the core.
+ */
+static double
+ccd_fit_nm(ccd_result *result, int n, double *nd, double *md, double anorm)
+{
+    double *ud, *unm;
+    double inner, xnorm2, dist;
+    sp_index_t rows, rank;
+    sp_index_t r;
+
+    rows = result->u[n]->dim[0];
+    rank = result->u[n]->dim[1];
+    ud = ccd_dense(result->u[n]);
+    unm = calloc(rows * rank, sizeof(double));
+    dense_gemm(rows, rank, rank, ud, md, unm);
+    inner = 0;
+    xnorm2 = 0;
+    for(r=0; r<rows*rank; r++) {
+	inner += nd[r] * ud[r];
+	xnorm2 += unm[r] * ud[r];
+    }
+    free(ud);
+    free(unm);
+
+    /* rounding can leave a tiny negative distance */
+    dist = anorm * anorm - 2.0 * inner + xnorm2;
+    dist = dist > 0 ? sqrt(dist) : 0;
+
+    return 1.0 - dist / anorm;
+}
+
+
+/*
+ * The fit from ||A - X||^2 = ||A||^2 - 2<A, X> + ||X||^2, so X is never
+ * formed.  anorm is ||A||.  gram holds the Gram matrix of each factor,
+ * or is NULL to have them computed here.
+ */
+static double
+ccd_fit_gram(ccd_result *result, tensor_view *a, double anorm, 
+	     double **gram)
+{
+    double **own = NULL;
+    double dist;
+    unsigned int rank;
+    int k;
+
+    if(!gram) {
+	own = gram = malloc(sizeof(double*) * result->n);
+	for(k=0; k<result->n; k++) {
+	    rank = result->u[k]->dim[1];
+	    gram[k] = malloc(sizeof(double) * rank * rank);
+	    ccd_gram(result->u[k], gram[k]);
+	}
+    }
+
+    /* rounding can leave a tiny negative distance */
+    dist = anorm * anorm - 2.0 * ccd_inner(result, a) + 
+	ccd_xnorm2(result, gram);
+    dist = dist > 0 ? sqrt(dist) : 0;
+
+    if(own) {
+	for(k=0; k<result->n; k++) {
+	    free(own[k]);
+	}
+	free(own);
+    }
+
+    return 1.0 - dist / anorm;
+}
+
+
 static void
 ccd_bn_free(tensor_view *bn)
 {
@@ -412,3 +1118,205 @@ ccd_bn_free(tensor_view *bn)
     TVFREE(bn->tns);
     TVFREE(bn);
 }
+
+
+/* Returns 1 if c is an identity tensor, 0 otherwise */
+static int
+ccd_is_identity(tensor_view *c)
+{
+    sp_index_t *idx;
+    unsigned int nnz;
+    int result = 1;
+    int i, j;
+
+    /* all modes must be the same size, with one entry on each diagonal */
+    for(i=1; i<c->nmodes; i++) {
+	if(c->dim[i] != c->dim[0]) {
+	    return 0;
+	}
+    }
+    nnz = TVNNZ(c);
+    if(nnz != c->dim[0]) {
+	return 0;
+    }
+
+    /* check the entries */
+    idx = TVIDX_ALLOC(c);
+    for(i=0; i<nnz && result; i++) {
+	TVIDX(c, i, idx);
+	for(j=1; j<c->nmodes; j++) {
+	    if(idx[j] != idx[0]) {
+		result = 0;
+	    }
+	}
+	if(TVGET(c, idx) != 1.0) {
+	    result = 0;
+	}
+    }
+    free(idx);
+
+    return result;
+}
+
+
+/* Build the dimension tree for modes first ... last-1 */
+static struct ccd_dtree *
+ccd_dtree_alloc(int first, int last)
+{
+    struct ccd_dtree *node;
+    int mid;
+
+    node = malloc(sizeof(struct ccd_dtree));
+    node->first = first;
+    node->last = last;
+    node->t = NULL;
+    node->left = node->right = NULL;
+    if(last - first > 1) {
+	mid = (first + last) / 2;
+	node->left = ccd_dtree_alloc(first, mid);
+	node->right = ccd_dtree_alloc(mid, last);
+    }
+
+    return node;
+}
+
+
+static void
+ccd_dtree_free(struct ccd_dtree *node)
+{
+    if(!node) return;
+    ccd_dtree_free(node->left);
+    ccd_dtree_free(node->right);
+    if(node->t) {
+	TVFREE(node->t);
+    }
+    free(node);
+}
+
+
+/* Drop every partial product which includes factor n */
+static void
+ccd_dtree_invalidate(struct ccd_dtree *node, int n)
+{
+    if(!node) return;
+
+    /* nodes covering n never multiplied by it, but their children might */
+    if(n < node->first || n >= node->last) {
+	if(node->t) {
+	    TVFREE(node->t);
+	    node->t = NULL;
+	}
+    }
+    ccd_dtree_invalidate(node->left, n);
+    ccd_dtree_invalidate(node->right, n);
+}
+
+
+/* A deep copy of a result, taken as a checkpoint snapshot */
+static ccd_result *
+ccd_copy(ccd_result *result)
+{
+    ccd_result *copy;
+    int i;
+
+    copy = malloc(sizeof(ccd_result));
+    *copy = *result;
+    copy->core = tensor_view_deep_copy(result->core);
+    copy->u = malloc(sizeof(tensor_view*) * result->n);
+    for(i=0; i<result->n; i++) {
+	copy->u[i] = tensor_view_deep_copy(result->u[i]);
+    }
+    copy->fits = malloc(sizeof(double) * (result->iter+1));
+    memcpy(copy->fits, result->fits, sizeof(double) * result->iter);
+
+    return copy;
+}
+
+
+/* Read a tensor written by sptensor_write_binary into a new view */
+static tensor_view *
+ccd_read_tensor(FILE *file)
+{
+    tensor_view *v;
+    sptensor *tns, *dst;
+    vector *tmp;
+
+    tns = sptensor_read_binary(file);
+    if(!tns) {
+	return NULL;
+    }
+
+    /* move the storage into a view which owns its tensor */
+    v = tensor_alloc(tns->nmodes, tns->dim);
+    dst = sptensor_view_data(v);
+    tmp = dst->ar; dst->ar = tns->ar; tns->ar = tmp;
+    tmp = dst->idx; dst->idx = tns->idx; tns->idx = tmp;
+    sptensor_free(tns);
+
+    return v;
+}
+
+
+/*
+ * Start writing a snapshot of result to the checkpoint file.  The copy is
+ * made here, so the iterations carry on while the writer runs.  A write 
+ * which is still going is finished first.
+ */
+static void
+ccd_checkpoint_start(ccd_result *result)
+{
+    ccd_result *snapshot;
+
+    snapshot = ccd_copy(result);
+    ccd_checkpoint_wait();
+    if(pthread_create(&checkpoint.writer, NULL, ccd_checkpoint_write, 
+		      snapshot)) {
+	ccd_checkpoint_write(snapshot);
+	return;
+    }
+    checkpoint.writing = 1;
+}
+
+
+/* Wait for the checkpoint writer (if any) to finish */
+static void
+ccd_checkpoint_wait(void)
+{
+    if(checkpoint.writing) {
+	pthread_join(checkpoint.writer, NULL);
+	checkpoint.writing = 0;
+    }
+}
+
+
+/*
+ * Write a snapshot to the checkpoint file and free it.  The snapshot goes
+ * to a temporary file which then replaces the checkpoint, so a crash 
+ * part way through leaves the previous checkpoint intact.
+ */
+static void *
+ccd_checkpoint_write(void *arg)
+{
+    ccd_result *snapshot = (ccd_result *) arg;
+    FILE *file;
+    char *tmp;
+    int failed;
+
+    tmp = malloc(strlen(checkpoint.fname) + 5);
+    sprintf(tmp, "%s.tmp", checkpoint.fname);
+    file = fopen(tmp, "wb");
+    if(!file) {
+	fprintf(stderr, "Could not open %s for writing\n", tmp);
+    } else {
+	failed = ccd_write(file, snapshot);
+	failed = fclose(file) || failed;
+	if(failed || rename(tmp, checkpoint.fname)) {
+	    fprintf(stderr, "Could not write checkpoint %s\n", 
+		    checkpoint.fname);
+	}
+    }
+
+    free(tmp);
+    ccd_free(snapshot);
+    return NULL;
+}
@@ -0,0 +1,501 @@
+/*
+    This is a collection of functions for lazy tensor expressions.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <sptensor/sptensor.h>
+#include <sptensor/expr.h>
+
+/* node types */
+#define EXPR_LEAF     0
+#define EXPR_ADD      1
+#define EXPR_SUB      2
+#define EXPR_SCALE    3
+#define EXPR_HADAMARD 4
+#define EXPR_MAP      5
+
+/* the operands which produced the current element of a merge */
+#define EXPR_FROM_A 1
+#define EXPR_FROM_B 2
+
+/* values are reduced in blocks of this size, and the blocks pairwise */
+#define EXPR_BLOCK  256
+#define EXPR_LEVELS 48
+
+/*
+ * Every node is a cursor over the sorted nonzeros of its subtree.  idx
+ * and val hold the current element, and are only meaningful while valid
+ * is nonzero.
+ */
+struct tensor_expr {
+    int op;                /* the node type */
+    tensor_expr *a, *b;    /* the operands */
+    unsigned int nmodes;   /* the shape of the expression */
+    sp_index_t *dim;
+    double s;              /* the scale factor */
+    tensor_map_func f;     /* the map and its argument */
+    void *arg;
+
+    /* leaves */
+    tensor_view *v;        /* the view */
+    sptensor *tns;         /* the sparse storage being read */
+    sptensor *copy;        /* a sorted copy of v (if it needed one) */
+    double *elem;          /* the dense elements being read */
+    unsigned int pos;      /* the position in the storage */
+    unsigned int len;      /* the length of the storage */
+    sp_index_t *buf;       /* the current index of a dense leaf */
+
+    /* the current element */
+    int valid;
+    int from;
+    sp_index_t *idx;
+    double val;
+};
+
+/* pairwise partial sums of the blocks */
+struct expr_partial {
+    double sum[EXPR_LEVELS];
+    int has[EXPR_LEVELS];
+};
+
+/* static prototypes */
+static tensor_expr *expr_node(int op, tensor_expr *a, tensor_expr *b);
+static void expr_start(tensor_expr *e);
+static void expr_next(tensor_expr *e);
+static void expr_advance(tensor_expr *e);
+static void expr_settle(tensor_expr *e);
+static void expr_current(tensor_expr *e);
+static double expr_accumulate(tensor_expr *e, int sum, double p, double s,
+			      double *amax);
+static void expr_partial_add(struct expr_partial *part, double x);
+static double expr_partial_total(struct expr_partial *part);
+
+
+/* a leaf of an expression */
+tensor_expr *
+expr_tensor(tensor_view *v)
+{
+    tensor_expr *e;
+    unsigned int i;
+
+    e = expr_node(EXPR_LEAF, NULL, NULL);
+    e->v = v;
+    e->nmodes = v->nmodes;
+    e->dim = v->dim;
+
+    /* read sparse and dense storage in place, copy anything else */
+    e->tns = sptensor_view_data(v);
+    e->elem = dense_tensor_elements(v);
+    if(e->elem) {
+	e->len = 1;
+	for(i=0; i<v->nmodes; i++) {
+	    e->len *= v->dim[i];
+	}
+	e->buf = malloc(sizeof(sp_index_t) * v->nmodes);
+    } else if(!e->tns) {
+	e->copy = tensor_view_sptensor(v);
+	e->tns = e->copy;
+    }
+
+    return e;
+}
+
+
+/* a + b */
+tensor_expr *
+expr_add(tensor_expr *a, tensor_expr *b)
+{
+    return expr_node(EXPR_ADD, a, b);
+}
+
+
+/* a - b */
+tensor_expr *
+expr_sub(tensor_expr *a, tensor_expr *b)
+{
+    return expr_node(EXPR_SUB, a, b);
+}
+
+
+/* s * a */
+tensor_expr *
+expr_scale(tensor_expr *a, double s)
+{
+    tensor_expr *e;
+
+    e = expr_node(EXPR_SCALE, a, NULL);
+    e->s = s;
+    return e;
+}
+
+
+/* the elementwise product of a and b */
+tensor_expr *
+expr_hadamard(tensor_expr *a, tensor_expr *b)
+{
+    return expr_node(EXPR_HADAMARD, a, b);
+}
+
+
+/* f(a, arg) applied to each nonzero element of a */
+tensor_expr *
+expr_map(tensor_expr *a, tensor_map_func f, void *arg)
+{
+    tensor_expr *e;
+
+    e = expr_node(EXPR_MAP, a, NULL);
+    e->f = f;
+    e->arg = arg;
+    return e;
+}
+
+
+/* the sum of the elements of the expression */
+double
+expr_sum(tensor_expr *e)
+{
+    double amax;
+
+    return expr_accumulate(e, 1, 1.0, 1.0, &amax);
+}
+
+
+/*
+ * The L-p norm of the expression.  Like dense_lpnorm, the sum is only
+ * evaluated a second time, scaled by the largest element, if it overflows
+ * or underflows.
+ */
+double
+expr_lpnorm(tensor_expr *e, double p)
+{
+    double sum;
+    double amax;
+
+    sum = expr_accumulate(e, 0, p, 1.0, &amax);
+    if(p == HUGE_VAL) {
+	return amax;
+    }
+    if(sum < DBL_MIN || sum > DBL_MAX) {
+	if(amax == 0.0 || amax > DBL_MAX) {
+	    return amax;
+	}
+	sum = expr_accumulate(e, 0, p, 1.0/amax, &amax);
+	return amax * (p == 2.0 ? sqrt(sum) : pow(sum, 1.0/p));
+    }
+
+    return p == 2.0 ? sqrt(sum) : pow(sum, 1.0/p);
+}
+
+
+/* evaluate the expression into a newly allocated tensor */
+tensor_view *
+expr_eval(tensor_expr *e)
+{
+    tensor_view *result;
+    sptensor *tns;
+
+    result = tensor_alloc(e->nmodes, e->dim);
+    tns = sptensor_view_data(result);
+    for(expr_start(e); e->valid; expr_next(e)) {
+	sptensor_append(tns, e->idx, e->val);
+    }
+
+    return result;
+}
+
+
+/* free an expression tree (but not the views at its leaves) */
+void
+expr_free(tensor_expr *e)
+{
+    if(e->a) {
+	expr_free(e->a);
+    }
+    if(e->b) {
+	expr_free(e->b);
+    }
+    if(e->copy) {
+	sptensor_free(e->copy);
+    }
+    free(e->buf);
+    free(e);
+}
+
+
+
+/***************************************
+ * Static Functions
+ ***************************************/
+
+/* allocate a node, taking its shape from the first operand */
+static tensor_expr *
+expr_node(int op, tensor_expr *a, tensor_expr *b)
+{
+    tensor_expr *e;
+
+    e = calloc(1, sizeof(tensor_expr));
+    e->op = op;
+    e->a = a;
+    e->b = b;
+    e->s = 1.0;
+    if(a) {
+	e->nmodes = a->nmodes;
+	e->dim = a->dim;
+    }
+
+    return e;
+}
+
+
+/* move every cursor in the tree to its first element */
+static void
+expr_start(tensor_expr *e)
+{
+    if(e->op == EXPR_LEAF) {
+	e->pos = 0;
+	if(e->tns) {
+	    e->len = e->tns->ar->size;
+	}
+    } else {
+	expr_start(e->a);
+	if(e->b) {
+	    expr_start(e->b);
+	}
+    }
+    expr_settle(e);
+}
+
+
+/* move to the next element */
+static void
+expr_next(tensor_expr *e)
+{
+    expr_advance(e);
+    expr_settle(e);
+}
+
+
+/* step past the current element, advancing the operands which produced it */
+static void
+expr_advance(tensor_expr *e)
+{
+    switch(e->op) {
+    case EXPR_LEAF:
+	e->pos++;
+	break;
+    case EXPR_ADD:
+    case EXPR_SUB:
+	if(e->from & EXPR_FROM_A) {
+	    expr_next(e->a);
+	}
+	if(e->from & EXPR_FROM_B) {
+	    expr_next(e->b);
+	}
+	break;
+    case EXPR_HADAMARD:
+	expr_next(e->a);
+	expr_next(e->b);
+	break;
+    default:
+	expr_next(e->a);
+    }
+}
+
+
+/*
+ * Find the current element.  Like a stored tensor, the results of the
+ * operations are dropped when they are no larger than 1e-7, so reducing
+ * an expression agrees with reducing its materialized value.
+ */
+static void
+expr_settle(tensor_expr *e)
+{
+    expr_current(e);
+    while(e->op != EXPR_LEAF && e->valid && fabs(e->val) <= 1.0e-7) {
+	expr_advance(e);
+	expr_current(e);
+    }
+}
+
+
+/* compute the current element from the storage or the operands */
+static void
+expr_current(tensor_expr *e)
+{
+    tensor_expr *a = e->a;
+    tensor_expr *b = e->b;
+    unsigned int i, rem;
+    int cmp;
+
+    switch(e->op) {
+    case EXPR_LEAF:
+	if(e->elem) {
+	    /* skip the zeroes, then find the index of the element */
+	    while(e->pos < e->len && e->elem[e->pos] == 0.0) {
+		e->pos++;
+	    }
+	    e->valid = e->pos < e->len;
+	    if(e->valid) {
+		rem = e->pos;
+		for(i=e->nmodes; i>0; i--) {
+		    e->buf[i-1] = rem % e->dim[i-1] + 1;
+		    rem /= e->dim[i-1];
+		}
+		e->idx = e->buf;
+		e->val = e->elem[e->pos];
+	    }
+	} else {
+	    e->valid = e->pos < e->len;
+	    if(e->valid) {
+		e->idx = VPTR(e->tns->idx, e->pos);
+		e->val = VVAL(double, e->tns->ar, e->pos);
+	    }
+	}
+	break;
+
+    case EXPR_ADD:
+    case EXPR_SUB:
+	/* the union of the operands */
+	e->valid = a->valid || b->valid;
+	if(!e->valid) {
+	    break;
+	}
+	if(!a->valid) {
+	    cmp = 1;
+	} else if(!b->valid) {
+	    cmp = -1;
+	} else {
+	    cmp = sptensor_indexcmp(e->nmodes, a->idx, b->idx);
+	}
+	if(cmp < 0) {
+	    e->from = EXPR_FROM_A;
+	    e->idx = a->idx;
+	    e->val = a->val;
+	} else if(cmp > 0) {
+	    e->from = EXPR_FROM_B;
+	    e->idx = b->idx;
+	    e->val = e->op == EXPR_SUB ? -b->val : b->val;
+	} else {
+	    e->from = EXPR_FROM_A | EXPR_FROM_B;
+	    e->idx = a->idx;
+	    e->val = e->op == EXPR_SUB ? a->val - b->val : a->val + b->val;
+	}
+	break;
+
+    case EXPR_HADAMARD:
+	/* the intersection of the operands */
+	while(a->valid && b->valid) {
+	    cmp = sptensor_indexcmp(e->nmodes, a->idx, b->idx);
+	    if(cmp == 0) {
+		break;
+	    }
+	    expr_next(cmp < 0 ? a : b);
+	}
+	e->valid = a->valid && b->valid;
+	if(e->valid) {
+	    e->idx = a->idx;
+	    e->val = a->val * b->val;
+	}
+	break;
+
+    case EXPR_SCALE:
+    case EXPR_MAP:
+	e->valid = a->valid;
+	if(e->valid) {
+	    e->idx = a->idx;
+	    e->val = e->op == EXPR_SCALE ? e->s * a->val : e->f(a->val, e->arg);
+	}
+	break;
+    }
+}
+
+
+/*
+ * Evaluate the expression, reducing it a block at a time.  If sum is
+ * nonzero the values are summed, otherwise the sum of |s*x|^p is
+ * computed.  The largest absolute value is returned in amax either way.
+ */
+static double
+expr_accumulate(tensor_expr *e, int sum, double p, double s, double *amax)
+{
+    struct expr_partial part;
+    double block[EXPR_BLOCK];
+    unsigned int n = 0;
+    double m = 0.0;
+    int done;
+
+    memset(&part, 0, sizeof(part));
+    expr_start(e);
+    do {
+	/* fill a block */
+	if(e->valid) {
+	    block[n++] = s * e->val;
+	    if(fabs(e->val) > m) {
+		m = fabs(e->val);
+	    }
+	    expr_next(e);
+	}
+	done = !e->valid;
+
+	/* reduce full blocks (and the last one) */
+	if(n == EXPR_BLOCK || (done && n)) {
+	    if(sum) {
+		expr_partial_add(&part, dense_sum(n, block));
+	    } else if(p != HUGE_VAL) {
+		expr_partial_add(&part, dense_powsum(n, block, p));
+	    }
+	    n = 0;
+	}
+    } while(!done);
+
+    *amax = m;
+    return expr_partial_total(&part);
+}
+
+
+/* add a block sum, combining equal sized partial sums like a counter */
+static void
+expr_partial_add(struct expr_partial *part, double x)
+{
+    unsigned int k;
+
+    for(k=0; k<EXPR_LEVELS-1 && part->has[k]; k++) {
+	x += part->sum[k];
+	part->has[k] = 0;
+    }
+    part->sum[k] = part->has[k] ? part->sum[k] + x : x;
+    part->has[k] = 1;
+}
+
+
+/* the total of the partial sums */
+static double
+expr_partial_total(struct expr_partial *part)
+{
+    double total = 0.0;
+    unsigned int k;
+
+    for(k=0; k<EXPR_LEVELS; k++) {
+	if(part->has[k]) {
+	    total += part->sum[k];
+	}
+    }
+
+    return total;
+}
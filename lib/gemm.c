@@ -0,0 +1,302 @@
+/*
+    This is a collection of dense matrix kernels used by the tensor 
+    products.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <sptensor/gemm.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+/* cache tiles: a KC x NC panel of b stays in L2, MC rows of a in L1 */
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 512
+
+/* register tile of the portable kernel */
+#define GEMM_MR 4
+#define GEMM_NR 8
+
+/* 
+ * A micro-kernel computes c += a * b for an mr x nr tile of c, where a is 
+ * mr x kc and b is kc x nr.  lda, ldb and ldc are the row strides.
+ */
+typedef void (*gemm_kernel_func)(unsigned int kc, 
+				 const double *a, unsigned int lda,
+				 const double *b, unsigned int ldb,
+				 double *c, unsigned int ldc);
+
+struct gemm_kernel {
+    unsigned int mr;        /* rows in the register tile */
+    unsigned int nr;        /* columns in the register tile */
+    gemm_kernel_func func;  /* the kernel */
+};
+
+/* static prototypes */
+static struct gemm_kernel *gemm_select(void);
+static void gemm_kernel_c(unsigned int kc, const double *a, unsigned int lda,
+			  const double *b, unsigned int ldb,
+			  double *c, unsigned int ldc);
+static void gemm_edge(unsigned int m, unsigned int n, unsigned int kc,
+		      const double *a, unsigned int lda,
+		      const double *b, unsigned int ldb,
+		      double *c, unsigned int ldc);
+#ifdef GEMM_X86
+static void gemm_kernel_avx2(unsigned int kc, 
+			     const double *a, unsigned int lda,
+			     const double *b, unsigned int ldb,
+			     double *c, unsigned int ldc);
+static void gemm_kernel_avx512(unsigned int kc, 
+			       const double *a, unsigned int lda,
+			       const double *b, unsigned int ldb,
+			       double *c, unsigned int ldc);
+#endif
+
+
+/* Dense matrix multiply and accumulate, c += a * b */
+void
+dense_gemm(unsigned int m, unsigned int n, unsigned int k,
+	   const double *a, const double *b, double *c)
+{
+    struct gemm_kernel *kern = gemm_select();
+    unsigned int jc, pc, ic, jr, ir;
+    unsigned int nc, kc, mc;
+
+    for(jc=0; jc<n; jc+=GEMM_NC) {
+	nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+	for(pc=0; pc<k; pc+=GEMM_KC) {
+	    kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+	    for(ic=0; ic<m; ic+=GEMM_MC) {
+		mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+
+		/* full register tiles go to the kernel, the rest to the edge */
+		for(jr=0; jr<nc; jr+=kern->nr) {
+		    for(ir=0; ir<mc; ir+=kern->mr) {
+			if(ir + kern->mr <= mc && jr + kern->nr <= nc) {
+			    kern->func(kc, a + (ic+ir)*k + pc, k,
+				       b + pc*n + jc+jr, n,
+				       c + (ic+ir)*n + jc+jr, n);
+			} else {
+			    gemm_edge(mc - ir < kern->mr ? mc - ir : kern->mr,
+				      nc - jr < kern->nr ? nc - jr : kern->nr,
+				      kc, a + (ic+ir)*k + pc, k,
+				      b + pc*n + jc+jr, n,
+				      c + (ic+ir)*n + jc+jr, n);
+			}
+		    }
+		}
+	    }
+	}
+    }
+}
+
+
+/* y += alpha * x */
+void
+dense_axpy(unsigned int n, double alpha, const double *x, double *y)
+{
+    unsigned int i;
+
+    /* unrolled so the compiler can keep four lanes going */
+    for(i=0; i+4<=n; i+=4) {
+	y[i] += alpha * x[i];
+	y[i+1] += alpha * x[i+1];
+	y[i+2] += alpha * x[i+2];
+	y[i+3] += alpha * x[i+3];
+    }
+    for(; i<n; i++) {
+	y[i] += alpha * x[i];
+    }
+}
+
+
+/* Pick the best kernel for this processor (once) */
+static struct gemm_kernel *
+gemm_select(void)
+{
+    static struct gemm_kernel kern;
+    static int selected = 0;
+
+    if(selected) {
+	return &kern;
+    }
+
+    kern.mr = GEMM_MR;
+    kern.nr = GEMM_NR;
+    kern.func = gemm_kernel_c;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+	kern.mr = 4;
+	kern.nr = 16;
+	kern.func = gemm_kernel_avx512;
+    } else if(__builtin_cpu_supports("avx2") && 
+	      __builtin_cpu_supports("fma")) {
+	kern.mr = 4;
+	kern.nr = 8;
+	kern.func = gemm_kernel_avx2;
+    }
+#endif
+    selected = 1;
+
+    return &kern;
+}
+
+
+/* Portable GEMM_MR x GEMM_NR kernel */
+static void
+gemm_kernel_c(unsigned int kc, const double *a, unsigned int lda,
+	      const double *b, unsigned int ldb, double *c, unsigned int ldc)
+{
+    double acc[GEMM_MR][GEMM_NR];
+    const double *brow;
+    double aval;
+    unsigned int i, j, p;
+
+    for(i=0; i<GEMM_MR; i++) {
+	for(j=0; j<GEMM_NR; j++) {
+	    acc[i][j] = 0.0;
+	}
+    }
+
+    for(p=0; p<kc; p++) {
+	brow = b + p*ldb;
+	for(i=0; i<GEMM_MR; i++) {
+	    aval = a[i*lda + p];
+	    for(j=0; j<GEMM_NR; j++) {
+		acc[i][j] += aval * brow[j];
+	    }
+	}
+    }
+
+    for(i=0; i<GEMM_MR; i++) {
+	for(j=0; j<GEMM_NR; j++) {
+	    c[i*ldc + j] += acc[i][j];
+	}
+    }
+}
+
+
+/* Partial tiles along the edges of c */
+static void
+gemm_edge(unsigned int m, unsigned int n, unsigned int kc,
+	  const double *a, unsigned int lda, const double *b, unsigned int ldb,
+	  double *c, unsigned int ldc)
+{
+    unsigned int i, j, p;
+    double aval;
+
+    for(i=0; i<m; i++) {
+	for(p=0; p<kc; p++) {
+	    aval = a[i*lda + p];
+	    for(j=0; j<n; j++) {
+		c[i*ldc + j] += aval * b[p*ldb + j];
+	    }
+	}
+    }
+}
+
+
+#ifdef GEMM_X86
+/* 4 x 8 kernel, two ymm accumulators per row */
+__attribute__((target("avx2,fma")))
+static void
+gemm_kernel_avx2(unsigned int kc, const double *a, unsigned int lda,
+		 const double *b, unsigned int ldb, double *c, unsigned int ldc)
+{
+    __m256d c00, c01, c10, c11, c20, c21, c30, c31;
+    __m256d b0, b1, av;
+    unsigned int p;
+
+    c00 = c01 = c10 = c11 = _mm256_setzero_pd();
+    c20 = c21 = c30 = c31 = _mm256_setzero_pd();
+    for(p=0; p<kc; p++) {
+	b0 = _mm256_loadu_pd(b + p*ldb);
+	b1 = _mm256_loadu_pd(b + p*ldb + 4);
+	av = _mm256_broadcast_sd(a + p);
+	c00 = _mm256_fmadd_pd(av, b0, c00);
+	c01 = _mm256_fmadd_pd(av, b1, c01);
+	av = _mm256_broadcast_sd(a + lda + p);
+	c10 = _mm256_fmadd_pd(av, b0, c10);
+	c11 = _mm256_fmadd_pd(av, b1, c11);
+	av = _mm256_broadcast_sd(a + 2*lda + p);
+	c20 = _mm256_fmadd_pd(av, b0, c20);
+	c21 = _mm256_fmadd_pd(av, b1, c21);
+	av = _mm256_broadcast_sd(a + 3*lda + p);
+	c30 = _mm256_fmadd_pd(av, b0, c30);
+	c31 = _mm256_fmadd_pd(av, b1, c31);
+    }
+
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c00));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), c01));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c10));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), c11));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c20));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), c21));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c30));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), c31));
+}
+
+
+/* 4 x 16 kernel, two zmm accumulators per row */
+__attribute__((target("avx512f")))
+static void
+gemm_kernel_avx512(unsigned int kc, const double *a, unsigned int lda,
+		   const double *b, unsigned int ldb, 
+		   double *c, unsigned int ldc)
+{
+    __m512d c00, c01, c10, c11, c20, c21, c30, c31;
+    __m512d b0, b1, av;
+    unsigned int p;
+
+    c00 = c01 = c10 = c11 = _mm512_setzero_pd();
+    c20 = c21 = c30 = c31 = _mm512_setzero_pd();
+    for(p=0; p<kc; p++) {
+	b0 = _mm512_loadu_pd(b + p*ldb);
+	b1 = _mm512_loadu_pd(b + p*ldb + 8);
+	av = _mm512_set1_pd(a[p]);
+	c00 = _mm512_fmadd_pd(av, b0, c00);
+	c01 = _mm512_fmadd_pd(av, b1, c01);
+	av = _mm512_set1_pd(a[lda + p]);
+	c10 = _mm512_fmadd_pd(av, b0, c10);
+	c11 = _mm512_fmadd_pd(av, b1, c11);
+	av = _mm512_set1_pd(a[2*lda + p]);
+	c20 = _mm512_fmadd_pd(av, b0, c20);
+	c21 = _mm512_fmadd_pd(av, b1, c21);
+	av = _mm512_set1_pd(a[3*lda + p]);
+	c30 = _mm512_fmadd_pd(av, b0, c30);
+	c31 = _mm512_fmadd_pd(av, b1, c31);
+    }
+
+    _mm512_storeu_pd(c, _mm512_add_pd(_mm512_loadu_pd(c), c00));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), c01));
+    c += ldc;
+    _mm512_storeu_pd(c, _mm512_add_pd(_mm512_loadu_pd(c), c10));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), c11));
+    c += ldc;
+    _mm512_storeu_pd(c, _mm512_add_pd(_mm512_loadu_pd(c), c20));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), c21));
+    c += ldc;
+    _mm512_storeu_pd(c, _mm512_add_pd(_mm512_loadu_pd(c), c30));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), c31));
+}
+#endif
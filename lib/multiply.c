@@ -16,52 +16,261 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
 #include <string.h>
-#include <sptensor/multiply.h>
+#include <math.h>
+#include <sptensor/sptensor.h>
+#include <sptensor/gemm.h>
+
+/* compressed sparse row form of a matrix */
+struct csr {
+    sp_index_t nrows;      /* number of rows */
+    sp_index_t ncols;      /* number of columns */
+    unsigned int nnz;      /* number of nonzero entries */
+    unsigned int *rowptr;  /* start of each row in col and val */
+    sp_index_t *col;       /* column of each entry */
+    double *val;           /* value of each entry */
+};
+
+/* a sparse accumulator for one row of a product */
+struct spa {
+    int dense;             /* 1 for a dense accumulator, 0 for a hash */
+    unsigned int size;     /* size of the accumulator */
+    double *acc;           /* accumulated values */
+    sp_index_t *key;       /* column held in each slot (0 if empty) */
+    sp_index_t *touched;   /* list of the occupied columns */
+    unsigned int ntouched; /* number of occupied columns */
+};
+
+/* coordinate list form of a tensor */
+struct coo {
+    unsigned int nmodes;   /* number of modes */
+    unsigned int nnz;      /* number of nonzero entries */
+    unsigned int capacity; /* entries which fit in idx and val */
+    sp_index_t *idx;       /* nmodes indexes per entry */
+    double *val;           /* value of each entry */
+};
+
+/* semi-sparse tensor: a list of fibers which are dense along one mode */
+struct semisparse {
+    unsigned int nmodes;   /* number of modes */
+    unsigned int mode;     /* the dense mode */
+    sp_index_t len;        /* length of the dense mode */
+    unsigned int nfibers;  /* number of fibers in use */
+    unsigned int capacity; /* number of fibers which fit in the buffers */
+    sp_index_t *idx;       /* index of each fiber (the dense mode is unused) */
+    double *val;           /* len values per fiber */
+};
+
+/* compressed sparse fiber tree */
+struct csf {
+    unsigned int nmodes;   /* number of modes (and levels) */
+    unsigned int *mode;    /* the mode at each level */
+    unsigned int *nfib;    /* number of nodes at each level */
+    unsigned int **fptr;   /* first child of each node, all but the leaves */
+    sp_index_t **fids;     /* index of each node */
+    double *val;           /* value of each leaf */
+};
+
+/* one piece of a parallel mttkrp */
+struct mttkrp_task {
+    struct csf *t;         /* the tensor */
+    double **rows;         /* the factors */
+    unsigned int rank;     /* number of columns */
+    double *out;           /* the result */
+    double *head;          /* the first slice's row, if it is shared */
+    unsigned int slice;    /* root slice of the first fiber */
+    unsigned int first;    /* first fiber (level 1 node) */
+    unsigned int last;     /* end of the fibers */
+};
+
+/* one thread's rows of a sparse matrix product */
+struct spgemm_task {
+    struct csr *a, *b;     /* the operands */
+    int dense;             /* 1 to use a dense accumulator */
+    unsigned long maxflops;/* most multiply-adds in any row */
+    unsigned int first;    /* first row */
+    unsigned int last;     /* end of the rows */
+    sptensor *result;      /* the thread's output */
+};
+
+/* 
+ * The matrix of a sparse tensor times matrix, stored by column so that 
+ * each nonzero of the tensor scales one column.  Sparse matrices are kept
+ * as the compressed rows of u^T, dense ones as u^T in row major order so
+ * that each column is contiguous.
+ */
+struct ttm_matrix {
+    sp_index_t nrows;      /* rows of u (the length of each output fiber) */
+    struct csr *sparse;    /* the rows of u^T (or NULL) */
+    double *dense;         /* u^T as a dense K x nrows array (or NULL) */
+};
+
+/* one thread's fibers of a sparse tensor times matrix */
+struct spttm_task {
+    unsigned int n;        /* the product mode */
+    struct coo *a;         /* the tensor */
+    unsigned int *perm;    /* fiber order of a */
+    struct ttm_matrix *u;  /* the matrix */
+    unsigned int first;    /* first entry (in perm) */
+    unsigned int last;     /* end of the entries */
+    sptensor *result;      /* the thread's output */
+};
+
+/* one thread's block of an outer product */
+struct outer_task {
+    struct coo *a, *b;     /* the operands */
+    unsigned int *ap, *bp; /* sorted order of the operands */
+    unsigned int first;    /* first entry of a */
+    unsigned int last;     /* end of the entries of a */
+    sptensor *result;      /* the result */
+    unsigned int pos;      /* where the block starts in the result */
+    unsigned int count;    /* number of entries written */
+};
+
+/* the operands of a tensor contraction */
+struct contraction {
+    struct coo *a, *b;     /* the operands */
+    unsigned int *ka, *kb; /* contracted modes of a and b */
+    unsigned int nkey;     /* number of contracted modes */
+    unsigned int *fa, *fb; /* free modes of a and b */
+    unsigned int nfa, nfb; /* number of free modes */
+    unsigned int nmodes;   /* modes of the result */
+};
+
+/* a pair of key groups which match in a sort-merge contraction */
+struct contract_match {
+    unsigned int afirst, alast; /* the group in a (sorted positions) */
+    unsigned int bfirst, blast; /* the group in b (sorted positions) */
+};
+
+/* hash table of one operand's entries, keyed on the contracted modes */
+struct contract_table {
+    unsigned int size;     /* number of slots (a power of 2) */
+    int *head;             /* first entry with each key (-1 if empty) */
+    int *next;             /* next entry with the same key (-1 at the end) */
+};
+
+/* one thread's share of a contraction */
+struct contract_task {
+    struct contraction *c;         /* the contraction */
+    unsigned int *ap, *bp;         /* merge: sorted order of a and b */
+    struct contract_match *match;  /* merge: matching groups */
+    struct contract_table *table;  /* hash: the table of the build side */
+    int build_a;                   /* hash: 1 if the table holds a */
+    unsigned int first, last;      /* matches or probe entries to do */
+    struct coo *out;               /* the products */
+};
+
+/* Relative cost of a hash probe to a comparison when planning joins */
+#define CONTRACT_HASH_COST 4.0
+
+/* Rows of b no wider than this always use a dense accumulator */
+#define SPGEMM_DENSE_COLS 4096
+
+/* static prototypes */
+static struct csr *csr_alloc(tensor_view *v);
+static void csr_free(struct csr *m);
+static void spgemm(struct csr *a, struct csr *b, sptensor *result);
+static void *spgemm_rows(void *arg);
+static struct coo *coo_alloc(tensor_view *v);
+static void coo_free(struct coo *t);
+static struct coo *coo_empty(unsigned int nmodes);
+static struct coo *symmetric_coo(symmetric_tensor *stns, unsigned int nmodes,
+				 unsigned int n);
+static void coo_push(struct coo *t, sp_index_t *idx, double val);
+static int coo_cmp(struct coo *t, unsigned int *order, unsigned int count,
+		   unsigned int i, unsigned int j);
+static int coo_sorted(struct coo *t, unsigned int *order, unsigned int count);
+static unsigned int *coo_sort(struct coo *t, unsigned int *order, 
+			      unsigned int count);
+static unsigned int *coo_fiber_order(struct coo *t, unsigned int n);
+static void spttm(unsigned int n, struct coo *a, struct ttm_matrix *u, 
+		  sptensor *result);
+static void *spttm_fibers(void *arg);
+static struct csf *csf_alloc(struct coo *t, unsigned int root);
+static void csf_free(struct csf *t);
+static unsigned long *csf_leaves(struct csf *t, unsigned int l);
+static double **mttkrp_rows(tensor_view **u, unsigned int nmodes,
+			    unsigned int n);
+static void mttkrp_rows_free(double **rows, unsigned int nmodes);
+static double *mttkrp_out(tensor_view *out);
+static void mttkrp_finish(tensor_view *out, double *buf);
+static void mttkrp_entry(double **rows, unsigned int nmodes, unsigned int n,
+			 unsigned int rank, sp_index_t *idx, double val,
+			 double *prod, double *buf);
+static void symmetric_mttkrp(tensor_view *a, tensor_view **u, unsigned int n,
+			     tensor_view *out);
+static void csf_mttkrp_level(struct csf *t, double **rows, unsigned int rank,
+			     unsigned int l, unsigned int first, 
+			     unsigned int last, double *work);
+static void csf_mttkrp(struct csf *t, double **rows, unsigned int rank,
+		       double *out, double *head, unsigned int slice,
+		       unsigned int first, unsigned int last);
+static void mttkrp_piece(void *arg, unsigned long first, unsigned long last,
+			 unsigned int thread);
+static void *outer_block(void *arg);
+static void contract_pair(struct contraction *c, unsigned int i, 
+			  unsigned int j, sp_index_t *idx, struct coo *out);
+static void *contract_merge(void *arg);
+static unsigned int contract_hash_key(struct coo *t, unsigned int *modes,
+				      unsigned int count, unsigned int i);
+static int contract_key_cmp(struct coo *x, unsigned int *xm, unsigned int i,
+			    struct coo *y, unsigned int *ym, unsigned int j,
+			    unsigned int count);
+static struct contract_table *contract_table_alloc(struct coo *t,
+						   unsigned int *modes,
+						   unsigned int count);
+static void contract_table_free(struct contract_table *table);
+static void *contract_hash(void *arg);
+static unsigned int product_threads(unsigned int units);
+static void merge_parts(sptensor *result, sptensor **parts, unsigned int n);
+static tensor_view *block_matrix_product(tensor_view *a, tensor_view *b);
+static tensor_view *dense_matrix_product(tensor_view *a, tensor_view *b);
+static void chain_plan(tensor_view *a, tensor_view **u, unsigned int *modes,
+		       unsigned int count, unsigned int *order);
+static tensor_view *block_nmode_product(unsigned int n, tensor_view *a,
+					tensor_view *u);
 
 
 /* Matrix mulitplication between two tensor views, resulting in a
-   sparse tensor view containing a newly allocated sparse tensor. */
+   newly allocated sparse, dense or block tensor view. */
 tensor_view *
 matrix_product(tensor_view *a, tensor_view *b)
 {
     tensor_view *result;          /* the result */
     sp_index_t rdim[2];           /* result dimensions */
-    int i, j;                     /* indexes for loooping over indexes */
-    int annz, bnnz;               /* nnz numbers for both tensors */
-    sp_index_t aidx[2], bidx[2];  /* a index and b index */
-    sp_index_t ridx[2];           /* result index */
-    double val;                   /* working value */
+    struct csr *ac, *bc;          /* compressed rows of a and b */
+    block_tensor *ab, *bb;        /* block representations (if any) */
+    double size;                  /* bytes in a dense result */
+
+    /* block tensors with matching tiles use the dense tile kernels */
+    ab = tensor_view_block(a);
+    bb = tensor_view_block(b);
+    if(ab && bb && ab->bdim[1] == bb->bdim[0]) {
+	return block_matrix_product(a, b);
+    }
+
+    /* dense operands use the dense kernels, if the result fits */
+    size = (double) a->dim[0] * b->dim[1] * sizeof(double);
+    if((dense_tensor_elements(a) || dense_tensor_elements(b)) &&
+       size <= sptensor_max_memory) {
+	return dense_matrix_product(a, b);
+    }
 
     /* compute the dimensions and allocate the tensor */
     rdim[0] = a->dim[0];
     rdim[1] = b->dim[1];
     result = tensor_alloc(2, rdim);
 
-    /* perform the multiplication in an O(n^2 lg n) sort of way */
-    annz = TVNNZ(a);
-    bnnz = TVNNZ(b);
-    for(i=0; i<annz; i++) {
-	/* get the index */
-	TVIDX(a, i, aidx);
-
-	/* loop over b */
-	for(j=0; j<bnnz; j++) {
-	    /* get the index */
-	    TVIDX(b, j, bidx);
-
-	    /* see if this is something which needs multiplying */
-	    if(aidx[1] == bidx[0]) {
-		/* perform the multiplication and summation */
-		ridx[0] = aidx[0];
-		ridx[1] = bidx[1];
-		val = TVGET(a, aidx) * TVGET(b, bidx);
-		val += TVGET(result, ridx);
-		TVSET(result, ridx, val);
-	    }
-	}
-    }
+    /* multiply row by row (Gustavson's algorithm) */
+    ac = csr_alloc(a);
+    bc = csr_alloc(b);
+    spgemm(ac, bc, (sptensor*) result->data);
 
+    /* cleanup and return */
+    csr_free(ac);
+    csr_free(bc);
     return result;
 }
 
@@ -72,46 +281,78 @@ nmode_product(unsigned int n, tensor_view *a, tensor_view *u)
 {
     tensor_view *result;      /* the resultant tensor */
     sp_index_t *idx;          /* general index a->nmodes entries */
-    sp_index_t *aidx;         /* index into the tensor */
-    sp_index_t uidx[2];       /* index into the matrix */
-    int i, j;                 /* indexes */
-    unsigned int annz, unnz;  /* non-zero counts for each tensor */
-    double val;               /* product value */
+    struct coo *ac;           /* coordinate list of a */
+    tensor_view *ut;          /* u transposed */
+    struct ttm_matrix um;     /* the columns of u */
+    double *ud;               /* the elements of a dense u */
+    sp_index_t i, k;          /* matrix indexes */
+    block_tensor *ab, *ub;    /* block representations (if any) */
+    symmetric_tensor *stns;   /* symmetric representation (if any) */
+    sptensor *tns;            /* the result's storage */
+    int *sym;                 /* symmetric modes of the result */
 
-    /* allocate the indexes */
-    idx = malloc(sizeof(sp_index_t)*a->nmodes);
-    aidx = malloc(sizeof(sp_index_t)*a->nmodes);
-
-    /* create the dimensions of the result and allocatethe result. */
-    memmove(idx, a->dim, sizeof(sp_index_t)*a->nmodes);
-    idx[n] = u->dim[0];
-    result = tensor_alloc(a->nmodes, idx);
+    /* the columns of u must match mode n of a */
+    if(u->dim[1] != a->dim[n]) {
+	return NULL;
+    }
 
-    /* go through each index in a */
-    annz = TVNNZ(a);
-    unnz = TVNNZ(u);
-    for(i=0; i<annz; i++) {
-	/* get the index */
-	TVIDX(a, i, aidx);
+    /* block tensors with matching tiles use the dense tile kernels */
+    ab = tensor_view_block(a);
+    ub = tensor_view_block(u);
+    if(ab && ub && ab->bdim[n] == ub->bdim[1]) {
+	return block_nmode_product(n, a, u);
+    }
 
-	/* loop over u */
-	for(j=0; j<unnz; j++) {
-	    TVIDX(u, j, uidx);
+    /* create the dimensions of the result and allocate the result. */
+    idx = malloc(sizeof(sp_index_t)*a->nmodes);
+    memcpy(idx, a->dim, sizeof(sp_index_t)*a->nmodes);
+    idx[n] = u->dim[0];
+    stns = tensor_view_symmetric(a);
+    if(stns) {
+	/* only the representatives are multiplied, and the result stays
+	   symmetric in the other symmetric modes */
+	sym = malloc(sizeof(int) * a->nmodes);
+	memcpy(sym, stns->sym, sizeof(int) * a->nmodes);
+	sym[n] = 0;
+	result = symmetric_tensor_alloc(a->nmodes, idx, sym);
+	tns = tensor_view_symmetric(result)->tns;
+	ac = symmetric_coo(stns, a->nmodes, n);
+	free(sym);
+    } else {
+	result = tensor_alloc(a->nmodes, idx);
+	tns = (sptensor*) result->data;
+	ac = coo_alloc(a);
+    }
 
-	    /* if this is a matched pair, add to the accumulated sum */
-	    if(aidx[n] == uidx[1]) {
-		memmove(idx, aidx, sizeof(sp_index_t)*a->nmodes);
-		idx[n] = uidx[0];
-		val = TVGET(a, aidx) * TVGET(u, uidx);
-		val += TVGET(result, idx);
-		TVSET(result, idx, val);
+    /* lay out the columns of u for the kernel */
+    um.nrows = u->dim[0];
+    um.sparse = NULL;
+    um.dense = NULL;
+    ud = dense_tensor_elements(u);
+    if(ud) {
+	um.dense = malloc(sizeof(double) * (u->dim[0] && u->dim[1] ? 
+					    u->dim[0] * u->dim[1] : 1));
+	for(i=0; i<u->dim[0]; i++) {
+	    for(k=0; k<u->dim[1]; k++) {
+		um.dense[k * u->dim[0] + i] = ud[i * u->dim[1] + k];
 	    }
 	}
+    } else {
+	ut = tensor_transpose(u, 0, 1);
+	um.sparse = csr_alloc(ut);
+	TVFREE(ut);
     }
 
+    /* multiply the mode-n fibers of a by the columns of u */
+    spttm(n, ac, &um, tns);
+
     /* cleanup and return */
+    coo_free(ac);
+    if(um.sparse) {
+	csr_free(um.sparse);
+    }
+    free(um.dense);
     free(idx);
-    free(aidx);
     return result;
 }
 
@@ -119,45 +360,2200 @@ nmode_product(unsigned int n, tensor_view *a, tensor_view *u)
 /* Outer (tensor) product of two tensor views */
 tensor_view *tensor_product(tensor_view *a, tensor_view *b)
 {
-    tensor_view *result;     /* the resultant tensor */
-    sp_index_t *idx;         /* insertion index */
-    sp_index_t *aidx, *bidx; /* tensor indexes */
-    int i, j;                /* indexes */
-    unsigned int annz, bnnz; /* non-zero counts for each tensor */
+    tensor_view *result;      /* the resultant tensor */
+    sptensor *tns;            /* the result's storage */
+    sp_index_t *idx;          /* result dimension */
+    struct coo *ac, *bc;      /* coordinate lists of a and b */
+    unsigned int *ap, *bp;    /* sorted order of a and b */
+    struct outer_task *task;  /* blocks of a */
+    unsigned int nthreads;    /* number of blocks */
+    unsigned int nnz;         /* entries kept so far */
+    unsigned int nmodes;      /* modes of the result */
+    unsigned int i;
 
     /* create the dimension, and allocate the tensor */
-    idx = malloc(sizeof(sp_index_t)*(a->nmodes + b->nmodes));
+    nmodes = a->nmodes + b->nmodes;
+    idx = malloc(sizeof(sp_index_t)*nmodes);
     memcpy(idx, a->dim, sizeof(sp_index_t) * a->nmodes);
     memcpy(idx+a->nmodes, b->dim, sizeof(sp_index_t) * b->nmodes);
-    result = tensor_alloc(a->nmodes+b->nmodes, idx);
+    result = tensor_alloc(nmodes, idx);
+    tns = (sptensor*) result->data;
+
+    /* visit both tensors in sorted order */
+    ac = coo_alloc(a);
+    bc = coo_alloc(b);
+    ap = coo_fiber_order(ac, ac->nmodes);
+    bp = coo_fiber_order(bc, bc->nmodes);
+
+    /* 
+     * Every pairing is written straight into the result in order.  Each
+     * block of a has a fixed place in the result, so the blocks can be
+     * written concurrently and then closed up over the skipped entries.
+     */
+    sptensor_reserve(tns, ac->nnz * bc->nnz);
+    nthreads = product_threads(ac->nnz);
+    task = malloc(sizeof(struct outer_task) * nthreads);
+    for(i=0; i<nthreads; i++) {
+	task[i].a = ac;
+	task[i].b = bc;
+	task[i].ap = ap;
+	task[i].bp = bp;
+	task[i].first = (unsigned int) ((double) ac->nnz * i / nthreads);
+	task[i].last = (unsigned int) ((double) ac->nnz * (i+1) / nthreads);
+	task[i].result = tns;
+	task[i].pos = task[i].first * bc->nnz;
+    }
+    parallel_tasks(outer_block, task, sizeof(struct outer_task), nthreads);
+    nnz = 0;
+    for(i=0; i<nthreads; i++) {
+	if(nnz != task[i].pos) {
+	    memmove(VPTR(tns->idx, nnz), VPTR(tns->idx, task[i].pos),
+		    sizeof(sp_index_t) * nmodes * task[i].count);
+	    memmove(VPTR(tns->ar, nnz), VPTR(tns->ar, task[i].pos),
+		    sizeof(double) * task[i].count);
+	}
+	nnz += task[i].count;
+    }
+    tns->idx->size = nnz;
+    tns->ar->size = nnz;
+
+    /* cleanup and return */
+    coo_free(ac);
+    coo_free(bc);
+    free(ap);
+    free(bp);
+    free(task);
+    free(idx);
+    return result;
+}
+
+
+/* A chain of n-mode products, in the cheapest order */
+tensor_view *
+nmode_chain_product(tensor_view *a, tensor_view **u, unsigned int *modes,
+		    unsigned int count)
+{
+    tensor_view *t;
+    tensor_view *prev;
+    unsigned int *order;
+    unsigned int i;
+
+    if(count == 0) {
+	return tensor_view_deep_copy(a);
+    }
+
+    order = malloc(sizeof(unsigned int) * count);
+    chain_plan(a, u, modes, count, order);
+
+    t = a;
+    for(i=0; i<count; i++) {
+	prev = t;
+	t = nmode_product(order[i], t, u[order[i]]);
+	if(prev != a) {
+	    TVFREE(prev);
+	}
+    }
+
+    free(order);
+    return t;
+}
+
+
+/* Contract a and b over pairs of modes */
+tensor_view *
+tensor_contract(tensor_view *a, unsigned int *modes_a,
+		tensor_view *b, unsigned int *modes_b, unsigned int count)
+{
+    struct contraction c;
+    struct contract_task *task;
+    struct contract_match *match;
+    struct contract_table *table;
+    struct coo *out, *probe;
+    tensor_view *result;
+    sptensor *tns;
+    sp_index_t *rdim;
+    unsigned int *ap, *bp, *perm, *order;
+    unsigned long *work;
+    parallel_partition *part;
+    unsigned int nmatch, nthreads;
+    unsigned int i, j, m;
+    int cmp;
+    int *used;
+    double merge_cost, hash_cost;
+    double na, nb, val;
+
+    /* the contracted modes must line up */
+    for(i=0; i<count; i++) {
+	if(a->dim[modes_a[i]] != b->dim[modes_b[i]]) {
+	    return NULL;
+	}
+    }
+
+    /* sort out the modes */
+    c.a = coo_alloc(a);
+    c.b = coo_alloc(b);
+    c.ka = modes_a;
+    c.kb = modes_b;
+    c.nkey = count;
+    c.fa = malloc(sizeof(unsigned int) * (a->nmodes+1));
+    c.fb = malloc(sizeof(unsigned int) * (b->nmodes+1));
+    used = calloc(a->nmodes + b->nmodes, sizeof(int));
+    for(i=0; i<count; i++) {
+	used[modes_a[i]] = 1;
+	used[a->nmodes + modes_b[i]] = 1;
+    }
+    c.nfa = c.nfb = 0;
+    for(i=0; i<a->nmodes; i++) {
+	if(!used[i]) c.fa[c.nfa++] = i;
+    }
+    for(i=0; i<b->nmodes; i++) {
+	if(!used[a->nmodes + i]) c.fb[c.nfb++] = i;
+    }
+    free(used);
 
-    /* allocate indexes */
-    aidx = malloc(sizeof(sp_index_t) * a->nmodes);
-    bidx = malloc(sizeof(sp_index_t) * b->nmodes);
+    /* allocate the result (a full contraction is a single element) */
+    c.nmodes = c.nfa + c.nfb;
+    rdim = malloc(sizeof(sp_index_t) * (c.nmodes+1));
+    for(i=0; i<c.nfa; i++) {
+	rdim[i] = a->dim[c.fa[i]];
+    }
+    for(i=0; i<c.nfb; i++) {
+	rdim[c.nfa + i] = b->dim[c.fb[i]];
+    }
+    if(c.nmodes == 0) {
+	rdim[0] = 1;
+	c.nmodes = 1;
+    }
+    result = tensor_alloc(c.nmodes, rdim);
+    tns = (sptensor*) result->data;
+
+    /* 
+     * Plan the join.  Sort-merge pays to sort whichever side is not 
+     * already in key order, a hash join pays a probe for every entry.
+     */
+    na = c.a->nnz + 1;
+    nb = c.b->nnz + 1;
+    merge_cost = na + nb;
+    if(!coo_sorted(c.a, c.ka, count)) merge_cost += na * log(na) / log(2.0);
+    if(!coo_sorted(c.b, c.kb, count)) merge_cost += nb * log(nb) / log(2.0);
+    hash_cost = CONTRACT_HASH_COST * (na + nb);
 
-    /* multiply each pairing */
-    annz = TVNNZ(a);
-    bnnz = TVNNZ(b);
-    for(i=0; i<annz; i++) {
-	/* get the index */
-	TVIDX(a, i, aidx);
-	
-	for(j=0; j<bnnz; j++) {
-	    /* get the index */
-	    TVIDX(b, j, bidx);
+    if(merge_cost <= hash_cost) {
+	/* find the key groups which appear in both */
+	ap = coo_sort(c.a, c.ka, count);
+	bp = coo_sort(c.b, c.kb, count);
+	match = malloc(sizeof(struct contract_match) * (c.a->nnz+1));
+	nmatch = 0;
+	i = j = 0;
+	while(i < c.a->nnz && j < c.b->nnz) {
+	    cmp = contract_key_cmp(c.a, c.ka, ap[i], c.b, c.kb, bp[j], count);
+	    if(cmp == 0) {
+		match[nmatch].afirst = i;
+		match[nmatch].bfirst = j;
+		for(i++; i < c.a->nnz && 
+			!coo_cmp(c.a, c.ka, count, ap[i-1], ap[i]); i++);
+		for(j++; j < c.b->nnz && 
+			!coo_cmp(c.b, c.kb, count, bp[j-1], bp[j]); j++);
+		match[nmatch].alast = i;
+		match[nmatch].blast = j;
+		nmatch++;
+	    } else if(cmp < 0) {
+		i++;
+	    } else {
+		j++;
+	    }
+	}
+
+	/* split the matches by the number of pairs they produce */
+	nthreads = product_threads(nmatch);
+	work = malloc(sizeof(unsigned long) * (nmatch+1));
+	work[0] = 0;
+	for(m=0; m<nmatch; m++) {
+	    work[m+1] = work[m] + (unsigned long) 
+		(match[m].alast - match[m].afirst) * 
+		(match[m].blast - match[m].bfirst);
+	}
+	part = parallel_partition_alloc(work, nmatch, nthreads, 0);
+	task = malloc(sizeof(struct contract_task) * nthreads);
+	for(m=0; m<nthreads; m++) {
+	    task[m].c = &c;
+	    task[m].ap = ap;
+	    task[m].bp = bp;
+	    task[m].match = match;
+	    task[m].first = part->slice[m];
+	    task[m].last = part->slice[m+1];
+	    task[m].out = coo_empty(c.nmodes);
+	}
+	parallel_tasks(contract_merge, task, sizeof(struct contract_task), 
+		    nthreads);
+	free(ap);
+	free(bp);
+	free(match);
+	free(work);
+	parallel_partition_free(part);
+    } else {
+	/* build on the smaller side, probe with the larger */
+	nthreads = product_threads(c.a->nnz > c.b->nnz ? c.a->nnz : c.b->nnz);
+	task = malloc(sizeof(struct contract_task) * nthreads);
+	if(c.a->nnz <= c.b->nnz) {
+	    table = contract_table_alloc(c.a, c.ka, count);
+	    probe = c.b;
+	} else {
+	    table = contract_table_alloc(c.b, c.kb, count);
+	    probe = c.a;
+	}
+	for(m=0; m<nthreads; m++) {
+	    task[m].c = &c;
+	    task[m].table = table;
+	    task[m].build_a = probe == c.b;
+	    task[m].first = (unsigned int) ((double) probe->nnz*m/nthreads);
+	    task[m].last = (unsigned int) ((double) probe->nnz*(m+1)/nthreads);
+	    task[m].out = coo_empty(c.nmodes);
+	}
+	parallel_tasks(contract_hash, task, sizeof(struct contract_task),
+		    nthreads);
+	contract_table_free(table);
+    }
 
-	    /* concatenate the indexes to find the result index */
-	    memcpy(idx, aidx, sizeof(sp_index_t) * a->nmodes);
-	    memcpy(idx+a->nmodes, bidx, sizeof(sp_index_t) * b->nmodes);
+    /* gather the products of each thread in order */
+    out = task[0].out;
+    for(m=1; m<nthreads; m++) {
+	for(i=0; i<task[m].out->nnz; i++) {
+	    coo_push(out, task[m].out->idx + i*c.nmodes, task[m].out->val[i]);
+	}
+	coo_free(task[m].out);
+    }
 
-	    /* do the multiplication and put it in the result */
-	    TVSET(result, idx, TVGET(a, aidx) * TVGET(b, bidx));
+    /* sort the products, sum the duplicates and build the result */
+    order = malloc(sizeof(unsigned int) * c.nmodes);
+    for(i=0; i<c.nmodes; i++) {
+	order[i] = i;
+    }
+    perm = coo_sort(out, order, c.nmodes);
+    for(i=0; i<out->nnz; i=j) {
+	val = out->val[perm[i]];
+	for(j=i+1; j<out->nnz && !coo_cmp(out, order, c.nmodes, perm[i], 
+					   perm[j]); j++) {
+	    val += out->val[perm[j]];
 	}
+	sptensor_append(tns, out->idx + perm[i]*c.nmodes, val);
     }
 
     /* cleanup and return */
-    free(aidx);
-    free(bidx);
-    free(idx);
+    free(order);
+    free(perm);
+    coo_free(out);
+    coo_free(c.a);
+    coo_free(c.b);
+    free(c.fa);
+    free(c.fb);
+    free(task);
+    free(rdim);
+    return result;
+}
+
+
+/* Matricized tensor times Khatri-Rao product */
+void
+mttkrp(tensor_view *a, tensor_view **u, unsigned int n, tensor_view *out)
+{
+    struct coo *ac;     /* coordinate list of a */
+    double **rows;      /* the factors as dense arrays */
+    double *buf;        /* the result */
+    double *prod;       /* product of the factor rows */
+    unsigned int rank;  /* number of columns */
+    unsigned int i;
+
+    /* symmetric tensors work from their representatives */
+    if(tensor_view_symmetric(a)) {
+	symmetric_mttkrp(a, u, n, out);
+	return;
+    }
+
+    rank = out->dim[1];
+    ac = coo_alloc(a);
+    rows = mttkrp_rows(u, a->nmodes, n);
+    buf = mttkrp_out(out);
+    prod = malloc(sizeof(double) * rank);
+
+    /* scale the product of the factor rows into each output row */
+    for(i=0; i<ac->nnz; i++) {
+	mttkrp_entry(rows, ac->nmodes, n, rank, ac->idx + i * ac->nmodes,
+		     ac->val[i], prod, buf);
+    }
+
+    /* cleanup */
+    mttkrp_finish(out, buf);
+    mttkrp_rows_free(rows, a->nmodes);
+    coo_free(ac);
+    free(prod);
+}
+
+
+/* mttkrp over a compressed sparse fiber tree rooted at mode n */
+void
+mttkrp_csf(tensor_view *a, tensor_view **u, unsigned int n, tensor_view *out)
+{
+    mttkrp_parallel(a, u, n, out, 1);
+}
+
+
+/* mttkrp_csf with the nonzeros divided into parts pieces */
+void
+mttkrp_parallel(tensor_view *a, tensor_view **u, unsigned int n,
+		tensor_view *out, unsigned int parts)
+{
+    struct coo *ac;
+    struct csf *t;
+    struct mttkrp_task *task;
+    parallel_partition *part;
+    unsigned long *roots, *fibers;
+    double **rows;
+    double *buf, *heads, *orow;
+    unsigned int rank;
+    unsigned int i, r;
+
+    /* a single mode has no fibers to share, and a symmetric tensor is
+       cheaper to walk by its representatives */
+    if(a->nmodes < 2 || tensor_view_symmetric(a)) {
+	mttkrp(a, u, n, out);
+	return;
+    }
+
+    /* build the tree */
+    ac = coo_alloc(a);
+    t = csf_alloc(ac, n);
+    coo_free(ac);
+    rows = mttkrp_rows(u, a->nmodes, n);
+    buf = mttkrp_out(out);
+    rank = out->dim[1];
+
+    /* 
+     * Each piece is a run of fibers holding about the same number of
+     * nonzeros.  Root slices are output rows, and a heavy slice may be
+     * split among several pieces.  Each piece which starts part way into
+     * a slice sums that slice into a row of its own, and those rows are
+     * added in once all the pieces are done, so the pieces never collide.
+     * The pieces are shared out among the pool's threads as they become
+     * free.
+     */
+    if(parts < 1) parts = 1;
+    roots = csf_leaves(t, 0);
+    fibers = csf_leaves(t, 1);
+    part = parallel_partition_alloc(roots, t->nfib[0], parts, 1);
+    heads = calloc(parts * rank, sizeof(double));
+    task = malloc(sizeof(struct mttkrp_task) * (parts+1));
+    for(i=0; i<=parts; i++) {
+	/* move the boundary to the first fiber at or after it */
+	for(task[i].first = i ? task[i-1].first : 0; 
+	    task[i].first < t->nfib[1] && 
+		fibers[task[i].first] < part->first[i]; 
+	    task[i].first++);
+	for(task[i].slice = part->slice[i]; task[i].slice < t->nfib[0] &&
+		t->fptr[0][task[i].slice+1] <= task[i].first; 
+	    task[i].slice++);
+	task[i].head = task[i].slice < t->nfib[0] &&
+	    t->fptr[0][task[i].slice] < task[i].first ? 
+	    heads + i * rank : NULL;
+	task[i].t = t;
+	task[i].rows = rows;
+	task[i].rank = rank;
+	task[i].out = buf;
+	if(i) task[i-1].last = task[i].first;
+    }
+    parallel_for(parts, 1, mttkrp_piece, task);
+
+    /* add in the shared slices */
+    for(i=0; i<parts; i++) {
+	if(!task[i].head || task[i].first == task[i].last) continue;
+	orow = buf + (t->fids[0][task[i].slice]-1) * rank;
+	for(r=0; r<rank; r++) {
+	    orow[r] += task[i].head[r];
+	}
+    }
+
+    /* cleanup */
+    mttkrp_finish(out, buf);
+    mttkrp_rows_free(rows, a->nmodes);
+    parallel_partition_free(part);
+    csf_free(t);
+    free(roots);
+    free(fibers);
+    free(heads);
+    free(task);
+}
+
+
+/***************************************
+ * Dense products
+ ***************************************/
+
+/*
+ * Matrix product where at least one operand is dense.  The result is 
+ * dense.  Dense times dense is a tiled GEMM, a dense a scatters each of
+ * its entries along a sparse row of b, and a sparse a adds scaled dense
+ * rows of b.
+ */
+static tensor_view *
+dense_matrix_product(tensor_view *a, tensor_view *b)
+{
+    tensor_view *result;
+    sp_index_t rdim[2];
+    struct csr *ac, *bc;
+    double *ad, *bd, *c;
+    double aval;
+    unsigned int m, n, k;
+    unsigned int i, l, p;
+
+    /* allocate the result */
+    m = rdim[0] = a->dim[0];
+    n = rdim[1] = b->dim[1];
+    k = a->dim[1];
+    result = dense_tensor_alloc(2, rdim);
+    c = dense_tensor_elements(result);
+    ad = dense_tensor_elements(a);
+    bd = dense_tensor_elements(b);
+
+    if(ad && bd) {
+	dense_gemm(m, n, k, ad, bd, c);
+    } else if(ad) {
+	bc = csr_alloc(b);
+	for(i=0; i<m; i++) {
+	    for(l=0; l<k; l++) {
+		aval = ad[i*k + l];
+		if(aval == 0.0) continue;
+		for(p=bc->rowptr[l]; p<bc->rowptr[l+1]; p++) {
+		    c[i*n + bc->col[p]-1] += aval * bc->val[p];
+		}
+	    }
+	}
+	csr_free(bc);
+    } else {
+	ac = csr_alloc(a);
+	for(i=0; i<m; i++) {
+	    for(p=ac->rowptr[i]; p<ac->rowptr[i+1]; p++) {
+		dense_axpy(n, ac->val[p], bd + (ac->col[p]-1)*n, c + i*n);
+	    }
+	}
+	csr_free(ac);
+    }
+
+    return result;
+}
+
+
+
+/***************************************
+ * Block sparse products
+ ***************************************/
+/* Dense tile micro-kernel: c += a * b where a is m x k and b is k x n */
+static void
+tile_gemm(unsigned int m, unsigned int n, unsigned int k,
+	  const double *a, const double *b, double *c)
+{
+    unsigned int i, j, l;
+    double aval;
+    const double *brow;
+    double *crow;
+
+    for(i=0; i<m; i++) {
+	crow = c + i*n;
+	for(l=0; l<k; l++) {
+	    aval = a[i*k+l];
+	    if(aval == 0.0) continue;
+	    brow = b + l*n;
+	    for(j=0; j<n; j++) {
+		crow[j] += aval * brow[j];
+	    }
+	}
+    }
+}
+
+
+/*
+ * Dense tile micro-kernel for the n-mode product.  The tiles are viewed as 
+ * left x k x right (a) and left x m x right (c) with u being m x k.
+ */
+static void
+tile_ttm(unsigned int left, unsigned int m, unsigned int k, unsigned int right,
+	 const double *a, const double *u, double *c)
+{
+    unsigned int l, i, j, r;
+    double uval;
+    const double *arow;
+    double *crow;
+
+    for(l=0; l<left; l++) {
+	for(i=0; i<m; i++) {
+	    crow = c + (l*m + i)*right;
+	    for(j=0; j<k; j++) {
+		uval = u[i*k+j];
+		if(uval == 0.0) continue;
+		arow = a + (l*k + j)*right;
+		for(r=0; r<right; r++) {
+		    crow[r] += uval * arow[r];
+		}
+	    }
+	}
+    }
+}
+
+
+/* Matrix product of two block tensors with compatible tiles */
+static tensor_view *
+block_matrix_product(tensor_view *a, tensor_view *b)
+{
+    block_tensor *ab = tensor_view_block(a);
+    block_tensor *bb = tensor_view_block(b);
+    tensor_view *result;
+    sp_index_t rdim[2];
+    sp_index_t rbdim[2];
+    sp_index_t ridx[2];
+    sp_index_t *aidx, *bidx;
+    double *rtile;
+    int i, j;
+
+    /* allocate the result */
+    rdim[0] = a->dim[0];
+    rdim[1] = b->dim[1];
+    rbdim[0] = ab->bdim[0];
+    rbdim[1] = bb->bdim[1];
+    result = block_tensor_alloc(2, rdim, rbdim);
+
+    /* multiply each tile of a with the tiles in the matching block row of b */
+    j = 0;
+    for(i=0; i<ab->bidx->size; i++) {
+	aidx = (sp_index_t*) VPTR(ab->bidx, i);
+
+	/* find the first block in the matching row of b */
+	ridx[0] = aidx[1];
+	ridx[1] = 0;
+	j = vector_binsearch(bb->bidx, ridx, block_tensor_bincmp);
+	j = -(j+1);
+
+	for(; j<bb->bidx->size; j++) {
+	    bidx = (sp_index_t*) VPTR(bb->bidx, j);
+	    if(bidx[0] != aidx[1]) break;
+
+	    ridx[0] = aidx[0];
+	    ridx[1] = bidx[1];
+	    rtile = block_tensor_tile(result, ridx, 1);
+	    tile_gemm(ab->bdim[0], bb->bdim[1], ab->bdim[1],
+		      VVAL(double*, ab->tiles, i), VVAL(double*, bb->tiles, j),
+		      rtile);
+	}
+    }
+
+    block_tensor_refresh(result);
+    return result;
+}
+
+
+/* N-Mode product of a block tensor with a block matrix */
+static tensor_view *
+block_nmode_product(unsigned int n, tensor_view *a, tensor_view *u)
+{
+    block_tensor *ab = tensor_view_block(a);
+    block_tensor *ub = tensor_view_block(u);
+    tensor_view *result;
+    sp_index_t *rdim;
+    sp_index_t *ridx;
+    sp_index_t *aidx, *uidx;
+    unsigned int left, right;
+    unsigned int *colptr;   /* start of each block column of u */
+    unsigned int *colblk;   /* tiles of u grouped by block column */
+    unsigned int ncol;
+    double *rtile;
+    int i, j;
+
+    /* allocate the result */
+    rdim = malloc(sizeof(sp_index_t) * a->nmodes);
+    ridx = malloc(sizeof(sp_index_t) * a->nmodes);
+    memcpy(rdim, a->dim, sizeof(sp_index_t) * a->nmodes);
+    rdim[n] = u->dim[0];
+    memcpy(ridx, ab->bdim, sizeof(sp_index_t) * a->nmodes);
+    ridx[n] = ub->bdim[0];
+    result = block_tensor_alloc(a->nmodes, rdim, ridx);
+
+    /* tile shape as seen by the micro-kernel */
+    left = right = 1;
+    for(i=0; i<a->nmodes; i++) {
+	if(i < n) left *= ab->bdim[i];
+	if(i > n) right *= ab->bdim[i];
+    }
+
+    /* group the tiles of u by their block column */
+    ncol = (u->dim[1] + ub->bdim[1] - 1) / ub->bdim[1];
+    colptr = calloc(ncol + 2, sizeof(unsigned int));
+    colblk = malloc(sizeof(unsigned int) * (ub->bidx->size + 1));
+    for(j=0; j<ub->bidx->size; j++) {
+	uidx = (sp_index_t*) VPTR(ub->bidx, j);
+	colptr[uidx[1]+1]++;
+    }
+    for(j=1; j<=ncol+1; j++) {
+	colptr[j] += colptr[j-1];
+    }
+    for(j=0; j<ub->bidx->size; j++) {
+	uidx = (sp_index_t*) VPTR(ub->bidx, j);
+	colblk[colptr[uidx[1]]++] = j;
+    }
+    for(j=ncol+1; j>0; j--) {
+	colptr[j] = colptr[j-1];
+    }
+    colptr[0] = 0;
+
+    /* multiply each tile of a by the tiles in its block column of u */
+    for(i=0; i<ab->bidx->size; i++) {
+	aidx = (sp_index_t*) VPTR(ab->bidx, i);
+	memcpy(ridx, aidx, sizeof(sp_index_t) * a->nmodes);
+	for(j=colptr[aidx[n]]; j<colptr[aidx[n]+1]; j++) {
+	    uidx = (sp_index_t*) VPTR(ub->bidx, colblk[j]);
+	    ridx[n] = uidx[0];
+	    rtile = block_tensor_tile(result, ridx, 1);
+	    tile_ttm(left, ub->bdim[0], ab->bdim[n], right,
+		     VVAL(double*, ab->tiles, i),
+		     VVAL(double*, ub->tiles, colblk[j]), rtile);
+	}
+    }
+
+    /* cleanup and return */
+    block_tensor_refresh(result);
+    free(colptr);
+    free(colblk);
+    free(rdim);
+    free(ridx);
     return result;
 }
+
+
+
+/***************************************
+ * Sparse matrix products
+ ***************************************/
+
+/* Build the compressed row form of a matrix view */
+static struct csr *
+csr_alloc(tensor_view *v)
+{
+    struct csr *m;
+    sptensor *tns;
+    sp_index_t idx[2];
+    sp_index_t *row;
+    sp_index_t *col;
+    double *val;
+    unsigned int *cur;
+    unsigned int k;
+    int i;
+
+    /* allocate the matrix */
+    m = malloc(sizeof(struct csr));
+    m->nrows = v->dim[0];
+    m->ncols = v->dim[1];
+    m->rowptr = calloc(m->nrows + 1, sizeof(unsigned int));
+    tns = sptensor_view_data(v);
+
+    /* sptensors are sorted, so they are already in row order */
+    if(tns) {
+	m->nnz = tns->ar->size;
+	m->col = malloc(sizeof(sp_index_t) * (m->nnz+1));
+	m->val = malloc(sizeof(double) * (m->nnz+1));
+	for(i=0; i<m->nnz; i++) {
+	    row = (sp_index_t*) VPTR(tns->idx, i);
+	    m->rowptr[row[0]]++;
+	    m->col[i] = row[1];
+	    m->val[i] = VVAL(double, tns->ar, i);
+	}
+	for(i=0; i<m->nrows; i++) {
+	    m->rowptr[i+1] += m->rowptr[i];
+	}
+	return m;
+    }
+
+    /* gather the entries of everything else */
+    m->nnz = TVNNZ(v);
+    row = malloc(sizeof(sp_index_t) * (m->nnz+1));
+    col = malloc(sizeof(sp_index_t) * (m->nnz+1));
+    val = malloc(sizeof(double) * (m->nnz+1));
+    for(i=0; i<m->nnz; i++) {
+	TVIDX(v, i, idx);
+	row[i] = idx[0];
+	col[i] = idx[1];
+	val[i] = TVGET(v, idx);
+	m->rowptr[idx[0]]++;
+    }
+    for(i=0; i<m->nrows; i++) {
+	m->rowptr[i+1] += m->rowptr[i];
+    }
+
+    /* counting sort by row, keeping the view's order within each row */
+    m->col = malloc(sizeof(sp_index_t) * (m->nnz+1));
+    m->val = malloc(sizeof(double) * (m->nnz+1));
+    cur = malloc(sizeof(unsigned int) * (m->nrows+1));
+    memcpy(cur, m->rowptr, sizeof(unsigned int) * (m->nrows+1));
+    for(i=0; i<m->nnz; i++) {
+	k = cur[row[i]-1]++;
+	m->col[k] = col[i];
+	m->val[k] = val[i];
+    }
+
+    /* cleanup and return */
+    free(cur);
+    free(row);
+    free(col);
+    free(val);
+    return m;
+}
+
+
+static void
+csr_free(struct csr *m)
+{
+    free(m->rowptr);
+    free(m->col);
+    free(m->val);
+    free(m);
+}
+
+
+/* an entry of a finished row */
+struct spa_entry {
+    sp_index_t col;
+    double val;
+};
+
+
+static int
+spa_entry_cmp(const void *a, const void *b)
+{
+    sp_index_t x = ((struct spa_entry *)a)->col;
+    sp_index_t y = ((struct spa_entry *)b)->col;
+
+    if(x < y) return -1;
+    if(x > y) return 1;
+    return 0;
+}
+
+
+/* 
+ * Set up the accumulator.  A dense accumulator has a slot for every 
+ * column, a hash accumulator has room for twice the most flops of any row.
+ */
+static void
+spa_init(struct spa *spa, int dense, sp_index_t ncols, unsigned long maxflops)
+{
+    spa->dense = dense;
+    if(dense) {
+	spa->size = ncols;
+    } else {
+	for(spa->size = 16; spa->size < 2 * maxflops; spa->size *= 2);
+    }
+    spa->acc = malloc(sizeof(double) * spa->size);
+    spa->key = calloc(spa->size, sizeof(sp_index_t));
+    spa->touched = malloc(sizeof(sp_index_t) * 
+			  (maxflops < ncols ? maxflops : ncols));
+    spa->ntouched = 0;
+}
+
+
+static void
+spa_free(struct spa *spa)
+{
+    free(spa->acc);
+    free(spa->key);
+    free(spa->touched);
+}
+
+
+/* add val to column col of the accumulator */
+static void
+spa_add(struct spa *spa, sp_index_t col, double val)
+{
+    unsigned int slot;
+
+    /* find the slot */
+    if(spa->dense) {
+	slot = col - 1;
+    } else {
+	slot = (col * 2654435761u) & (spa->size - 1);
+	while(spa->key[slot] && spa->key[slot] != col) {
+	    slot = (slot + 1) & (spa->size - 1);
+	}
+    }
+
+    /* accumulate */
+    if(spa->key[slot]) {
+	spa->acc[slot] += val;
+    } else {
+	spa->key[slot] = col;
+	spa->acc[slot] = val;
+	spa->touched[spa->ntouched++] = slot;
+    }
+}
+
+
+/* move the accumulated row into entries (sorted by column) and clear it */
+static unsigned int
+spa_gather(struct spa *spa, struct spa_entry *entries)
+{
+    unsigned int n;
+    unsigned int i;
+    unsigned int slot;
+
+    n = spa->ntouched;
+    for(i=0; i<n; i++) {
+	slot = spa->touched[i];
+	entries[i].col = spa->key[slot];
+	entries[i].val = spa->acc[slot];
+	spa->key[slot] = 0;
+    }
+    spa->ntouched = 0;
+    qsort(entries, n, sizeof(struct spa_entry), spa_entry_cmp);
+
+    return n;
+}
+
+
+/* 
+ * Pick the accumulator for a product.  The dense accumulator is the 
+ * fastest, but each thread's copy has to hold all of b's columns.  When 
+ * the output rows are far sparser than that the hash accumulator is 
+ * kinder to the cache.
+ */
+static int
+spgemm_use_dense(struct csr *a, struct csr *b, unsigned long flops,
+		 unsigned long maxflops, unsigned int nthreads)
+{
+    unsigned int rows = 0;
+    unsigned long size;
+    int i;
+
+    /* every thread has its own accumulator (values, keys and the touched
+       list), and they all have to fit in our memory budget */
+    size = (unsigned long) b->ncols * (sizeof(double) + sizeof(sp_index_t)) +
+	(maxflops < b->ncols ? maxflops : b->ncols) * sizeof(sp_index_t);
+    if(size > sptensor_max_memory / nthreads) {
+	return 0;
+    }
+
+    /* small enough to always stay in cache */
+    if(b->ncols <= SPGEMM_DENSE_COLS) {
+	return 1;
+    }
+
+    /* otherwise it depends on how full the average output row is */
+    for(i=0; i<a->nrows; i++) {
+	if(a->rowptr[i+1] > a->rowptr[i]) rows++;
+    }
+    return rows && flops / rows * 32 >= b->ncols;
+}
+
+
+/* Sparse matrix-matrix product, result = a * b (result must be empty) */
+static void
+spgemm(struct csr *a, struct csr *b, sptensor *result)
+{
+    struct spgemm_task *task;
+    sptensor **parts;
+    unsigned long *work;
+    unsigned long maxflops = 0;
+    unsigned long rowflops;
+    parallel_partition *part;
+    unsigned int nthreads;
+    sp_index_t k;
+    unsigned int p;
+    int dense;
+    int i;
+
+    /* estimate the work in each row (as a running total) */
+    work = malloc(sizeof(unsigned long) * (a->nrows+1));
+    work[0] = 0;
+    for(i=0; i<a->nrows; i++) {
+	rowflops = 0;
+	for(p=a->rowptr[i]; p<a->rowptr[i+1]; p++) {
+	    k = a->col[p] - 1;
+	    rowflops += b->rowptr[k+1] - b->rowptr[k];
+	}
+	work[i+1] = work[i] + rowflops;
+	if(rowflops > maxflops) maxflops = rowflops;
+    }
+    if(maxflops == 0) {
+	free(work);
+	return;
+    }
+    /* give each thread a run of rows with about the same work */
+    nthreads = product_threads(a->nrows);
+    dense = spgemm_use_dense(a, b, work[a->nrows], maxflops, nthreads);
+    part = parallel_partition_alloc(work, a->nrows, nthreads, 0);
+    task = malloc(sizeof(struct spgemm_task) * nthreads);
+    parts = malloc(sizeof(sptensor*) * nthreads);
+    for(i=0; i<nthreads; i++) {
+	task[i].a = a;
+	task[i].b = b;
+	task[i].dense = dense;
+	task[i].maxflops = maxflops;
+	task[i].first = part->slice[i];
+	task[i].last = part->slice[i+1];
+	task[i].result = nthreads > 1 ? 
+	    sptensor_alloc(2, result->dim) : result;
+	parts[i] = task[i].result;
+    }
+    parallel_tasks(spgemm_rows, task, sizeof(struct spgemm_task), nthreads);
+
+    /* put the rows together */
+    if(nthreads > 1) {
+	merge_parts(result, parts, nthreads);
+	for(i=0; i<nthreads; i++) {
+	    sptensor_free(parts[i]);
+	}
+    }
+
+    /* cleanup */
+    free(work);
+    parallel_partition_free(part);
+    free(task);
+    free(parts);
+}
+
+
+/* Compute rows first ... last-1 of a sparse matrix product */
+static void *
+spgemm_rows(void *arg)
+{
+    struct spgemm_task *task = (struct spgemm_task *) arg;
+    struct csr *a = task->a;
+    struct csr *b = task->b;
+    struct spa spa;
+    struct spa_entry *entries;
+    sp_index_t idx[2];
+    sp_index_t k;
+    unsigned int p, q;
+    unsigned int n;
+    int i, j;
+
+    /* set up the accumulator */
+    spa_init(&spa, task->dense, b->ncols, task->maxflops);
+    entries = malloc(sizeof(struct spa_entry) * 
+		     (task->maxflops < b->ncols ? task->maxflops : b->ncols));
+
+    /* compute each row of the result */
+    for(i=task->first; i<task->last; i++) {
+	for(p=a->rowptr[i]; p<a->rowptr[i+1]; p++) {
+	    k = a->col[p] - 1;
+	    for(q=b->rowptr[k]; q<b->rowptr[k+1]; q++) {
+		spa_add(&spa, b->col[q], a->val[p] * b->val[q]);
+	    }
+	}
+
+	/* write the row in sorted order */
+	n = spa_gather(&spa, entries);
+	idx[0] = i+1;
+	for(j=0; j<n; j++) {
+	    idx[1] = entries[j].col;
+	    sptensor_append(task->result, idx, entries[j].val);
+	}
+    }
+
+    /* cleanup */
+    spa_free(&spa);
+    free(entries);
+    return NULL;
+}
+
+
+
+/***************************************
+ * Sparse tensor times matrix
+ ***************************************/
+
+/* Gather the entries of a view into a coordinate list */
+static struct coo *
+coo_alloc(tensor_view *v)
+{
+    struct coo *t;
+    sptensor *tns;
+    int i;
+
+    t = malloc(sizeof(struct coo));
+    t->nmodes = v->nmodes;
+    tns = sptensor_view_data(v);
+    t->nnz = tns ? tns->ar->size : TVNNZ(v);
+    t->capacity = t->nnz+1;
+    t->idx = malloc(sizeof(sp_index_t) * t->nmodes * (t->nnz+1));
+    t->val = malloc(sizeof(double) * (t->nnz+1));
+
+    /* sptensors can be copied wholesale */
+    if(tns) {
+	memcpy(t->idx, tns->idx->ar, sizeof(sp_index_t) * t->nmodes * t->nnz);
+	memcpy(t->val, tns->ar->ar, sizeof(double) * t->nnz);
+	return t;
+    }
+
+    for(i=0; i<t->nnz; i++) {
+	TVIDX(v, i, t->idx + i*t->nmodes);
+	t->val[i] = TVGET(v, t->idx + i*t->nmodes);
+    }
+    return t;
+}
+
+
+static void
+coo_free(struct coo *t)
+{
+    free(t->idx);
+    free(t->val);
+    free(t);
+}
+
+
+/* Compare entries i and j of t on every mode except n */
+static int
+coo_fiber_cmp(struct coo *t, unsigned int n, unsigned int i, unsigned int j)
+{
+    sp_index_t *x = t->idx + i * t->nmodes;
+    sp_index_t *y = t->idx + j * t->nmodes;
+    unsigned int m;
+
+    for(m=0; m<t->nmodes; m++) {
+	if(m == n || x[m] == y[m]) continue;
+	return x[m] < y[m] ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/*
+ * The entries of a symmetric tensor which a product along mode n needs.
+ * If n is not symmetric these are the stored representatives.  Otherwise
+ * each representative appears once for every distinct index among its 
+ * symmetric modes, with that index moved to mode n and the others left 
+ * sorted, so that the entries are the representatives of a tensor which 
+ * is symmetric in all but mode n.
+ */
+static struct coo *
+symmetric_coo(symmetric_tensor *stns, unsigned int nmodes, unsigned int n)
+{
+    struct coo *t;
+    sp_index_t *idx, *jdx;
+    double val;
+    unsigned int i, j, k, m, d;
+
+    t = coo_empty(nmodes);
+    jdx = malloc(sizeof(sp_index_t) * nmodes);
+    for(i=0; i<stns->tns->ar->size; i++) {
+	idx = VPTR(stns->tns->idx, i);
+	val = VVAL(double, stns->tns->ar, i);
+	if(!stns->sym[n]) {
+	    coo_push(t, idx, val);
+	    continue;
+	}
+
+	/* the symmetric indexes of idx are sorted, so runs are adjacent */
+	for(k=0, j=nmodes; k<nmodes; k++) {
+	    if(!stns->sym[k]) continue;
+	    if(j < nmodes && idx[j] == idx[k]) {
+		j = k;
+		continue;
+	    }
+	    j = k;
+
+	    /* pull idx[k] out to mode n, closing up the rest in order */
+	    memcpy(jdx, idx, sizeof(sp_index_t) * nmodes);
+	    for(m=0, d=0; m<nmodes; m++) {
+		if(!stns->sym[m] || m == k) continue;
+		while(!stns->sym[d] || d == n) d++;
+		jdx[d++] = idx[m];
+	    }
+	    jdx[n] = idx[k];
+	    coo_push(t, jdx, val);
+	}
+    }
+
+    free(jdx);
+    return t;
+}
+
+
+/* An empty coordinate list */
+static struct coo *
+coo_empty(unsigned int nmodes)
+{
+    struct coo *t;
+
+    t = malloc(sizeof(struct coo));
+    t->nmodes = nmodes;
+    t->nnz = 0;
+    t->capacity = 64;
+    t->idx = malloc(sizeof(sp_index_t) * nmodes * t->capacity);
+    t->val = malloc(sizeof(double) * t->capacity);
+    return t;
+}
+
+
+/* Add an entry to the end of the list */
+static void
+coo_push(struct coo *t, sp_index_t *idx, double val)
+{
+    if(t->nnz == t->capacity) {
+	t->capacity *= 2;
+	t->idx = realloc(t->idx, sizeof(sp_index_t)*t->nmodes*t->capacity);
+	t->val = realloc(t->val, sizeof(double) * t->capacity);
+    }
+    memcpy(t->idx + t->nnz * t->nmodes, idx, sizeof(sp_index_t) * t->nmodes);
+    t->val[t->nnz++] = val;
+}
+
+
+/* Compare entries i and j of t on the modes order[0] ... order[count-1] */
+static int
+coo_cmp(struct coo *t, unsigned int *order, unsigned int count,
+	unsigned int i, unsigned int j)
+{
+    sp_index_t *x = t->idx + i * t->nmodes;
+    sp_index_t *y = t->idx + j * t->nmodes;
+    unsigned int m;
+
+    for(m=0; m<count; m++) {
+	if(x[order[m]] == y[order[m]]) continue;
+	return x[order[m]] < y[order[m]] ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* Are the entries of t already sorted by order[0] ... order[count-1]? */
+static int
+coo_sorted(struct coo *t, unsigned int *order, unsigned int count)
+{
+    unsigned int i;
+
+    for(i=1; i<t->nnz && coo_cmp(t, order, count, i-1, i) <= 0; i++);
+    return i >= t->nnz;
+}
+
+
+/*
+ * Returns the order in which to visit the entries of t so that they are
+ * sorted by the modes order[0] ... order[count-1].  Entries which tie keep
+ * their original order.
+ */
+static unsigned int *
+coo_sort(struct coo *t, unsigned int *order, unsigned int count)
+{
+    unsigned int *perm, *tmp, *swap;
+    unsigned int width, lo, mid, hi;
+    unsigned int i, j, k;
+
+    perm = malloc(sizeof(unsigned int) * (t->nnz+1));
+    for(i=0; i<t->nnz; i++) {
+	perm[i] = i;
+    }
+
+    /* sorted tensors often are in the right order already */
+    if(coo_sorted(t, order, count)) {
+	return perm;
+    }
+
+    /* bottom up merge sort */
+    tmp = malloc(sizeof(unsigned int) * (t->nnz+1));
+    for(width=1; width < t->nnz; width *= 2) {
+	for(lo=0; lo < t->nnz; lo += 2*width) {
+	    mid = lo + width < t->nnz ? lo + width : t->nnz;
+	    hi = mid + width < t->nnz ? mid + width : t->nnz;
+	    i = lo;
+	    j = mid;
+	    k = lo;
+	    while(i < mid && j < hi) {
+		if(coo_cmp(t, order, count, perm[j], perm[i]) < 0) {
+		    tmp[k++] = perm[j++];
+		} else {
+		    tmp[k++] = perm[i++];
+		}
+	    }
+	    while(i < mid) tmp[k++] = perm[i++];
+	    while(j < hi) tmp[k++] = perm[j++];
+	}
+	swap = perm;
+	perm = tmp;
+	tmp = swap;
+    }
+
+    free(tmp);
+    return perm;
+}
+
+
+/*
+ * Returns the order in which to visit the entries of t so that each
+ * mode-n fiber is contiguous, and the fibers are sorted by their other
+ * indexes.  Entries within a fiber keep their original order.
+ */
+static unsigned int *
+coo_fiber_order(struct coo *t, unsigned int n)
+{
+    unsigned int *order;
+    unsigned int *perm;
+    unsigned int m, count;
+
+    order = malloc(sizeof(unsigned int) * t->nmodes);
+    count = 0;
+    for(m=0; m<t->nmodes; m++) {
+	if(m != n) order[count++] = m;
+    }
+    perm = coo_sort(t, order, count);
+
+    free(order);
+    return perm;
+}
+
+
+static void
+semisparse_init(struct semisparse *ss, unsigned int nmodes, unsigned int mode,
+		sp_index_t len, unsigned int capacity)
+{
+    ss->nmodes = nmodes;
+    ss->mode = mode;
+    ss->len = len;
+    ss->nfibers = 0;
+    ss->capacity = capacity;
+    ss->idx = malloc(sizeof(sp_index_t) * nmodes * capacity);
+    ss->val = calloc((size_t) len * capacity, sizeof(double));
+}
+
+
+static void
+semisparse_free(struct semisparse *ss)
+{
+    free(ss->idx);
+    free(ss->val);
+}
+
+
+/* Double the number of fibers the buffers can hold */
+static void
+semisparse_grow(struct semisparse *ss)
+{
+    ss->idx = realloc(ss->idx, sizeof(sp_index_t) * ss->nmodes * 
+		      ss->capacity * 2);
+    ss->val = realloc(ss->val, sizeof(double) * ss->len * ss->capacity * 2);
+    memset(ss->val + (size_t) ss->len * ss->capacity, 0, 
+	   sizeof(double) * ss->len * ss->capacity);
+    ss->capacity *= 2;
+}
+
+
+/* Do fibers f and g share their indexes before the dense mode? */
+static int
+semisparse_same_prefix(struct semisparse *ss, unsigned int f, unsigned int g)
+{
+    return memcmp(ss->idx + f * ss->nmodes, ss->idx + g * ss->nmodes,
+		  sizeof(sp_index_t) * ss->mode) == 0;
+}
+
+
+/*
+ * Append the fibers to result and empty the buffers.  The fibers must be
+ * sorted by their sparse indexes and sort after everything in result.
+ */
+static void
+semisparse_flush(struct semisparse *ss, sptensor *result)
+{
+    unsigned int first, last;
+    unsigned int f;
+    sp_index_t j;
+    sp_index_t *idx;
+
+    /* fibers with a common prefix interleave along the dense mode */
+    for(first=0; first < ss->nfibers; first=last) {
+	for(last=first+1; last < ss->nfibers && 
+		semisparse_same_prefix(ss, first, last); last++);
+	for(j=1; j<=ss->len; j++) {
+	    for(f=first; f<last; f++) {
+		idx = ss->idx + f * ss->nmodes;
+		idx[ss->mode] = j;
+		sptensor_append(result, idx, ss->val[(size_t) f*ss->len + j-1]);
+	    }
+	}
+    }
+
+    memset(ss->val, 0, sizeof(double) * ss->len * ss->nfibers);
+    ss->nfibers = 0;
+}
+
+
+/*
+ * Sparse tensor times matrix along mode n.  Every mode-n fiber of a is 
+ * scaled into a dense fiber of the output, so the work is proportional
+ * to nnz(a) times the column lengths of the matrix.
+ */
+static void
+spttm(unsigned int n, struct coo *a, struct ttm_matrix *u, sptensor *result)
+{
+    struct spttm_task *task;
+    sptensor **parts;
+    unsigned int *perm;
+    unsigned int nthreads;
+    unsigned int i;
+
+    if(a->nnz == 0) {
+	return;
+    }
+    perm = coo_fiber_order(a, n);
+
+    /* give each thread about the same number of nonzeros, in whole fibers */
+    nthreads = product_threads(a->nnz);
+    task = malloc(sizeof(struct spttm_task) * nthreads);
+    parts = malloc(sizeof(sptensor*) * nthreads);
+    for(i=0; i<nthreads; i++) {
+	task[i].n = n;
+	task[i].a = a;
+	task[i].perm = perm;
+	task[i].u = u;
+	task[i].first = i ? task[i-1].last : 0;
+	task[i].last = (unsigned int) ((double) a->nnz * (i+1) / nthreads);
+	if(task[i].last < task[i].first) task[i].last = task[i].first;
+	while(task[i].last > task[i].first && task[i].last < a->nnz &&
+	      !coo_fiber_cmp(a, n, perm[task[i].last-1], perm[task[i].last])) {
+	    task[i].last++;
+	}
+	task[i].result = nthreads > 1 ? 
+	    sptensor_alloc(result->nmodes, result->dim) : result;
+	parts[i] = task[i].result;
+    }
+    parallel_tasks(spttm_fibers, task, sizeof(struct spttm_task), nthreads);
+
+    /* 
+     * Fibers which share a prefix interleave in the output, so the parts
+     * may overlap and have to be merged.
+     */
+    if(nthreads > 1) {
+	merge_parts(result, parts, nthreads);
+	for(i=0; i<nthreads; i++) {
+	    sptensor_free(parts[i]);
+	}
+    }
+
+    /* cleanup */
+    free(perm);
+    free(task);
+    free(parts);
+}
+
+
+/* Compute the fibers of entries first ... last-1 of a sparse TTM */
+static void *
+spttm_fibers(void *arg)
+{
+    struct spttm_task *task = (struct spttm_task *) arg;
+    struct coo *a = task->a;
+    struct csr *ut = task->u->sparse;
+    double *ud = task->u->dense;
+    sp_index_t len = task->u->nrows;
+    unsigned int *perm = task->perm;
+    unsigned int n = task->n;
+    struct semisparse ss;
+    unsigned int nfibers;
+    unsigned int capacity;
+    unsigned int p, q, e, f;
+    sp_index_t k;
+    double aval;
+    double *fiber;
+
+    if(task->first >= task->last) {
+	return NULL;
+    }
+
+    /* count the fibers */
+    nfibers = 1;
+    for(p=task->first+1; p<task->last; p++) {
+	if(coo_fiber_cmp(a, n, perm[p-1], perm[p])) nfibers++;
+    }
+
+    /* hold as many fibers as the memory budget allows */
+    capacity = sptensor_max_memory / (sizeof(double) * len + 1);
+    if(capacity > nfibers) capacity = nfibers;
+    if(capacity < 1) capacity = 1;
+    semisparse_init(&ss, a->nmodes, n, len, capacity);
+
+    for(p=task->first; p<task->last; ) {
+	/* start a fiber, flushing if the full buffer ends a prefix */
+	e = perm[p];
+	if(ss.nfibers == ss.capacity) {
+	    if(memcmp(ss.idx + (ss.nfibers-1) * ss.nmodes, 
+		      a->idx + e * a->nmodes, sizeof(sp_index_t) * n)) {
+		semisparse_flush(&ss, task->result);
+	    } else {
+		semisparse_grow(&ss);
+	    }
+	}
+	f = ss.nfibers;
+	memcpy(ss.idx + f * ss.nmodes, a->idx + e * a->nmodes,
+	       sizeof(sp_index_t) * a->nmodes);
+	ss.nfibers++;
+	fiber = ss.val + (size_t) f * ss.len;
+
+	/* scale the matching columns into the fiber */
+	for(; p<task->last && coo_fiber_cmp(a, n, e, perm[p]) == 0; p++) {
+	    k = a->idx[perm[p] * a->nmodes + n] - 1;
+	    aval = a->val[perm[p]];
+	    if(ud) {
+		dense_axpy(len, aval, ud + (size_t) k * len, fiber);
+		continue;
+	    }
+	    for(q=ut->rowptr[k]; q<ut->rowptr[k+1]; q++) {
+		fiber[ut->col[q]-1] += aval * ut->val[q];
+	    }
+	}
+    }
+    semisparse_flush(&ss, task->result);
+
+    /* cleanup */
+    semisparse_free(&ss);
+    return NULL;
+}
+
+
+
+/***************************************
+ * Outer products
+ ***************************************/
+
+/*
+ * Write the products of entries first ... last-1 of a (in sorted order)
+ * with all of b into the preallocated arrays of the result, starting at
+ * entry pos.  Products which are too small to store are skipped, and the
+ * number of entries written is left in count.
+ */
+static void *
+outer_block(void *arg)
+{
+    struct outer_task *task = (struct outer_task *) arg;
+    struct coo *a = task->a;
+    struct coo *b = task->b;
+    unsigned int nmodes = a->nmodes + b->nmodes;
+    sp_index_t *idx;
+    double *val;
+    double x;
+    unsigned int i, j;
+
+    idx = (sp_index_t*) VPTR(task->result->idx, task->pos);
+    val = (double*) VPTR(task->result->ar, task->pos);
+    task->count = 0;
+    for(i=task->first; i<task->last; i++) {
+	for(j=0; j<b->nnz; j++) {
+	    x = a->val[task->ap[i]] * b->val[task->bp[j]];
+	    if(fabs(x) <= 1.0e-7) continue;
+
+	    memcpy(idx, a->idx + task->ap[i] * a->nmodes, 
+		   sizeof(sp_index_t) * a->nmodes);
+	    memcpy(idx + a->nmodes, b->idx + task->bp[j] * b->nmodes, 
+		   sizeof(sp_index_t) * b->nmodes);
+	    *val = x;
+	    idx += nmodes;
+	    val++;
+	    task->count++;
+	}
+    }
+
+    return NULL;
+}
+
+
+
+/***************************************
+ * MTTKRP
+ ***************************************/
+
+/* 
+ * Build a compressed sparse fiber tree with the root at mode root and the 
+ * remaining modes below it in ascending order. 
+ */
+static struct csf *
+csf_alloc(struct coo *t, unsigned int root)
+{
+    struct csf *f;
+    unsigned int *perm;
+    unsigned int nmodes = t->nmodes;
+    unsigned int p, l, lev;
+    sp_index_t *x, *prev;
+
+    /* allocate the tree */
+    f = malloc(sizeof(struct csf));
+    f->nmodes = nmodes;
+    f->mode = malloc(sizeof(unsigned int) * nmodes);
+    f->nfib = calloc(nmodes, sizeof(unsigned int));
+    f->fptr = malloc(sizeof(unsigned int*) * nmodes);
+    f->fids = malloc(sizeof(sp_index_t*) * nmodes);
+    f->val = malloc(sizeof(double) * (t->nnz+1));
+    f->mode[0] = root;
+    for(l=0, p=1; l<nmodes; l++) {
+	if(l != root) f->mode[p++] = l;
+    }
+    for(l=0; l<nmodes; l++) {
+	f->fptr[l] = l < nmodes-1 ? malloc(sizeof(unsigned int)*(t->nnz+1)) :
+	                            NULL;
+	f->fids[l] = malloc(sizeof(sp_index_t) * (t->nnz+1));
+    }
+
+    /* each entry starts new nodes from the first level it differs at */
+    perm = coo_sort(t, f->mode, nmodes);
+    prev = NULL;
+    for(p=0; p<t->nnz; p++) {
+	x = t->idx + perm[p] * nmodes;
+	lev = 0;
+	if(prev) {
+	    while(lev < nmodes-1 && x[f->mode[lev]] == prev[f->mode[lev]]) {
+		lev++;
+	    }
+	}
+	for(l=lev; l<nmodes; l++) {
+	    if(l < nmodes-1) {
+		f->fptr[l][f->nfib[l]] = f->nfib[l+1];
+	    }
+	    f->fids[l][f->nfib[l]++] = x[f->mode[l]];
+	}
+	f->val[f->nfib[nmodes-1]-1] = t->val[perm[p]];
+	prev = x;
+    }
+    for(l=0; l<nmodes-1; l++) {
+	f->fptr[l][f->nfib[l]] = f->nfib[l+1];
+    }
+
+    free(perm);
+    return f;
+}
+
+
+static void
+csf_free(struct csf *t)
+{
+    unsigned int l;
+
+    for(l=0; l<t->nmodes; l++) {
+	free(t->fptr[l]);
+	free(t->fids[l]);
+    }
+    free(t->mode);
+    free(t->nfib);
+    free(t->fptr);
+    free(t->fids);
+    free(t->val);
+    free(t);
+}
+
+
+/*
+ * The number of leaves before each node at level l of the tree, with the
+ * total at the end (so the result has nfib[l]+1 entries).
+ */
+static unsigned long *
+csf_leaves(struct csf *t, unsigned int l)
+{
+    unsigned long *leaves;
+    unsigned int i, k, node;
+
+    leaves = malloc(sizeof(unsigned long) * (t->nfib[l]+1));
+    for(i=0; i<=t->nfib[l]; i++) {
+	for(node=i, k=l; k<t->nmodes-1; k++) {
+	    node = t->fptr[k][node];
+	}
+	leaves[i] = node;
+    }
+    return leaves;
+}
+
+
+/* Copy the factors (all but u[n]) into row major arrays */
+static double **
+mttkrp_rows(tensor_view **u, unsigned int nmodes, unsigned int n)
+{
+    double **rows;
+    double *elem;
+    sp_index_t idx[2];
+    unsigned int k, i, nnz;
+
+    rows = calloc(nmodes, sizeof(double*));
+    for(k=0; k<nmodes; k++) {
+	if(k == n) continue;
+	rows[k] = calloc((size_t) u[k]->dim[0] * u[k]->dim[1], sizeof(double));
+	elem = dense_tensor_elements(u[k]);
+	if(elem) {
+	    memcpy(rows[k], elem, 
+		   sizeof(double) * u[k]->dim[0] * u[k]->dim[1]);
+	    continue;
+	}
+	nnz = TVNNZ(u[k]);
+	for(i=0; i<nnz; i++) {
+	    TVIDX(u[k], i, idx);
+	    rows[k][(idx[0]-1) * u[k]->dim[1] + idx[1]-1] = TVGET(u[k], idx);
+	}
+    }
+
+    return rows;
+}
+
+
+static void
+mttkrp_rows_free(double **rows, unsigned int nmodes)
+{
+    unsigned int k;
+
+    for(k=0; k<nmodes; k++) {
+	free(rows[k]);
+    }
+    free(rows);
+}
+
+
+/* Returns a zeroed row major buffer for the result */
+static double *
+mttkrp_out(tensor_view *out)
+{
+    double *elem;
+    size_t size = (size_t) out->dim[0] * out->dim[1];
+
+    elem = dense_tensor_elements(out);
+    if(elem) {
+	memset(elem, 0, sizeof(double) * size);
+	return elem;
+    }
+    return calloc(size, sizeof(double));
+}
+
+
+/* Store buf in out (unless it already is out) */
+static void
+mttkrp_finish(tensor_view *out, double *buf)
+{
+    sp_index_t idx[2];
+
+    if(buf == dense_tensor_elements(out)) {
+	return;
+    }
+    for(idx[0]=1; idx[0]<=out->dim[0]; idx[0]++) {
+	for(idx[1]=1; idx[1]<=out->dim[1]; idx[1]++) {
+	    TVSET(out, idx, buf[(idx[0]-1) * out->dim[1] + idx[1]-1]);
+	}
+    }
+    free(buf);
+}
+
+
+/* Add val times the factor rows of idx into row idx[n] of buf */
+static void
+mttkrp_entry(double **rows, unsigned int nmodes, unsigned int n,
+	     unsigned int rank, sp_index_t *idx, double val, double *prod,
+	     double *buf)
+{
+    double *urow, *orow;
+    unsigned int k, r;
+
+    for(r=0; r<rank; r++) {
+	prod[r] = val;
+    }
+    for(k=0; k<nmodes; k++) {
+	if(k == n) continue;
+	urow = rows[k] + (idx[k]-1) * rank;
+	for(r=0; r<rank; r++) {
+	    prod[r] *= urow[r];
+	}
+    }
+    orow = buf + (idx[n]-1) * rank;
+    for(r=0; r<rank; r++) {
+	orow[r] += prod[r];
+    }
+}
+
+
+/*
+ * mttkrp over the representatives of a symmetric tensor.  When the 
+ * symmetric modes other than n all have the same factor, the permutations
+ * of a representative which agree in mode n add the same row, so each is
+ * added once scaled by how many there are.  Otherwise the permutations of
+ * each representative are stepped through in turn.
+ */
+static void
+symmetric_mttkrp(tensor_view *a, tensor_view **u, unsigned int n,
+		 tensor_view *out)
+{
+    symmetric_tensor *stns;
+    tensor_view *f;
+    double **rows;
+    double *buf, *prod;
+    double val, mult;
+    sp_index_t *idx, *jdx;
+    unsigned int rank, count;
+    unsigned int i, j, k;
+    int same;
+
+    /* do the symmetric factors agree? */
+    stns = tensor_view_symmetric(a);
+    f = NULL;
+    same = 1;
+    for(k=0; k<a->nmodes; k++) {
+	if(k == n || !stns->sym[k]) continue;
+	if(!f) f = u[k];
+	if(u[k] != f) same = 0;
+    }
+
+    rank = out->dim[1];
+    rows = mttkrp_rows(u, a->nmodes, n);
+    buf = mttkrp_out(out);
+    prod = malloc(sizeof(double) * rank);
+    idx = malloc(sizeof(sp_index_t) * a->nmodes);
+    jdx = malloc(sizeof(sp_index_t) * a->nmodes);
+    for(i=0; i<stns->tns->ar->size; i++) {
+	memcpy(idx, VPTR(stns->tns->idx, i), sizeof(sp_index_t) * a->nmodes);
+	val = VVAL(double, stns->tns->ar, i);
+	if(!same) {
+	    do {
+		mttkrp_entry(rows, a->nmodes, n, rank, idx, val, prod, buf);
+	    } while(symmetric_tensor_next(a, idx));
+	    continue;
+	}
+
+	mult = symmetric_tensor_multiplicity(a, idx);
+	if(!stns->sym[n]) {
+	    mttkrp_entry(rows, a->nmodes, n, rank, idx, val*mult, prod, buf);
+	    continue;
+	}
+
+	/* each distinct symmetric index takes its turn in mode n, in 
+	   count/nsym of the permutations */
+	for(k=0; k<a->nmodes; k++) {
+	    if(!stns->sym[k]) continue;
+	    for(j=0; j<k && !(stns->sym[j] && idx[j] == idx[k]); j++);
+	    if(j < k) continue;
+	    for(count=0, j=k; j<a->nmodes; j++) {
+		if(stns->sym[j] && idx[j] == idx[k]) count++;
+	    }
+	    memcpy(jdx, idx, sizeof(sp_index_t) * a->nmodes);
+	    jdx[n] = idx[k];
+	    jdx[k] = idx[n];
+	    mttkrp_entry(rows, a->nmodes, n, rank, jdx,
+			 val * mult * count / stns->nsym, prod, buf);
+	}
+    }
+
+    /* cleanup */
+    mttkrp_finish(out, buf);
+    mttkrp_rows_free(rows, a->nmodes);
+    free(prod);
+    free(idx);
+    free(jdx);
+}
+
+
+/*
+ * Sum the contributions of nodes first ... last-1 at level l into row l of
+ * work.  The contribution of a leaf is its value times its factor row, and
+ * the contribution of any other node is its factor row times the sum of 
+ * its children.
+ */
+static void
+csf_mttkrp_level(struct csf *t, double **rows, unsigned int rank,
+		 unsigned int l, unsigned int first, unsigned int last,
+		 double *work)
+{
+    double *acc = work + l * rank;
+    double *child = work + (l+1) * rank;
+    double *urow;
+    unsigned int node, r;
+
+    memset(acc, 0, sizeof(double) * rank);
+    for(node=first; node<last; node++) {
+	urow = rows[t->mode[l]] + (t->fids[l][node]-1) * rank;
+	if(l == t->nmodes-1) {
+	    for(r=0; r<rank; r++) {
+		acc[r] += t->val[node] * urow[r];
+	    }
+	} else {
+	    csf_mttkrp_level(t, rows, rank, l+1, t->fptr[l][node], 
+			     t->fptr[l][node+1], work);
+	    for(r=0; r<rank; r++) {
+		acc[r] += child[r] * urow[r];
+	    }
+	}
+    }
+}
+
+
+/*
+ * Add the products of fibers first ... last-1 into their output rows.
+ * slice is the root slice of the first fiber, and if head is not NULL 
+ * that slice's sum goes there instead of into out.
+ */
+static void
+csf_mttkrp(struct csf *t, double **rows, unsigned int rank, double *out,
+	   double *head, unsigned int slice, unsigned int first, 
+	   unsigned int last)
+{
+    double *work;
+    double *orow;
+    unsigned int s, f, end, r;
+
+    work = malloc(sizeof(double) * rank * t->nmodes);
+    for(s=slice, f=first; f<last; s++, f=end) {
+	end = t->fptr[0][s+1] < last ? t->fptr[0][s+1] : last;
+	csf_mttkrp_level(t, rows, rank, 1, f, end, work);
+	orow = s == slice && head ? head : out + (t->fids[0][s]-1) * rank;
+	for(r=0; r<rank; r++) {
+	    orow[r] += work[rank + r];
+	}
+    }
+    free(work);
+}
+
+
+/* parallel_for body running the mttkrp pieces first ... last-1 */
+static void
+mttkrp_piece(void *arg, unsigned long first, unsigned long last,
+	     unsigned int thread)
+{
+    struct mttkrp_task *task = (struct mttkrp_task *) arg;
+
+    for(; first < last; first++) {
+	csf_mttkrp(task[first].t, task[first].rows, task[first].rank,
+		   task[first].out, task[first].head, task[first].slice,
+		   task[first].first, task[first].last);
+    }
+}
+
+
+
+/***************************************
+ * Threading
+ ***************************************/
+
+/* The number of threads to use for units pieces of work */
+static unsigned int
+product_threads(unsigned int units)
+{
+    unsigned int n = parallel_threads();
+
+    if(n > units) n = units;
+    if(n < 1) n = 1;
+    return n;
+}
+
+
+/*
+ * Fill result with the entries of the sorted parts.  Parts which follow
+ * one another are simply appended, otherwise they are merged.  No index 
+ * may appear in more than one part.
+ */
+static void
+merge_parts(sptensor *result, sptensor **parts, unsigned int n)
+{
+    unsigned int *pos;
+    unsigned int total = 0;
+    unsigned int i, best;
+    int ordered = 1;
+    sptensor *prev = NULL;
+
+    for(i=0; i<n; i++) {
+	total += parts[i]->ar->size;
+	if(parts[i]->ar->size == 0) continue;
+	if(prev && sptensor_indexcmp(result->nmodes, 
+				     VPTR(prev->idx, prev->ar->size-1),
+				     VPTR(parts[i]->idx, 0)) >= 0) {
+	    ordered = 0;
+	}
+	prev = parts[i];
+    }
+    sptensor_reserve(result, result->ar->size + total);
+
+    /* parts in order can be copied wholesale */
+    if(ordered) {
+	for(i=0; i<n; i++) {
+	    memcpy(VPTR(result->idx, result->idx->size), parts[i]->idx->ar,
+		   parts[i]->idx->element_size * parts[i]->idx->size);
+	    memcpy(VPTR(result->ar, result->ar->size), parts[i]->ar->ar,
+		   sizeof(double) * parts[i]->ar->size);
+	    result->idx->size += parts[i]->idx->size;
+	    result->ar->size += parts[i]->ar->size;
+	}
+	return;
+    }
+
+    /* otherwise repeatedly take the smallest head */
+    pos = calloc(n, sizeof(unsigned int));
+    for(;;) {
+	best = n;
+	for(i=0; i<n; i++) {
+	    if(pos[i] >= parts[i]->ar->size) continue;
+	    if(best == n || 
+	       sptensor_indexcmp(result->nmodes, VPTR(parts[i]->idx, pos[i]),
+				 VPTR(parts[best]->idx, pos[best])) < 0) {
+		best = i;
+	    }
+	}
+	if(best == n) break;
+	vector_push_back(result->idx, VPTR(parts[best]->idx, pos[best]));
+	vector_push_back(result->ar, VPTR(parts[best]->ar, pos[best]));
+	pos[best]++;
+    }
+    free(pos);
+}
+
+
+
+/***************************************
+ * Product chains
+ ***************************************/
+
+/*
+ * Order the products of a chain greedily, always taking the product with
+ * the smallest estimated result next.  A product along mode k turns each
+ * mode-k fiber into a fiber of u's height.  The number of fibers is 
+ * bounded by both the nonzeros and the product of the other dimensions,
+ * and the fiber fill is estimated from the average column of u.
+ */
+static void
+chain_plan(tensor_view *a, tensor_view **u, unsigned int *modes,
+	   unsigned int count, unsigned int *order)
+{
+    double *dim;         /* current dimensions */
+    double *colnnz;      /* average nonzeros in a column of each u */
+    int *done;           /* products already planned */
+    double nnz;          /* current estimated nonzeros */
+    double other;        /* number of positions of a fiber */
+    double fibers;       /* estimated number of fibers */
+    double fill;         /* estimated nonzeros in each output fiber */
+    double est, best_est;
+    unsigned int i, j, k, m, best;
+
+    dim = malloc(sizeof(double) * a->nmodes);
+    colnnz = malloc(sizeof(double) * count);
+    done = calloc(count, sizeof(int));
+    for(i=0; i<a->nmodes; i++) {
+	dim[i] = a->dim[i];
+    }
+    for(i=0; i<count; i++) {
+	colnnz[i] = (double) TVNNZ(u[modes[i]]) / u[modes[i]]->dim[1];
+    }
+    nnz = TVNNZ(a);
+
+    for(i=0; i<count; i++) {
+	best = count;
+	best_est = 0;
+	for(j=0; j<count; j++) {
+	    if(done[j]) continue;
+	    k = modes[j];
+
+	    /* estimate the nonzeros of the product along k */
+	    other = 1;
+	    for(m=0; m<a->nmodes; m++) {
+		if(m != k) other *= dim[m];
+	    }
+	    fibers = nnz < other ? nnz : other;
+	    fill = fibers > 0 ? colnnz[j] * nnz / fibers : 0;
+	    if(fill > u[k]->dim[0]) fill = u[k]->dim[0];
+	    est = fibers * fill;
+
+	    if(best == count || est < best_est) {
+		best = j;
+		best_est = est;
+	    }
+	}
+
+	/* take it */
+	done[best] = 1;
+	order[i] = modes[best];
+	dim[modes[best]] = u[modes[best]]->dim[0];
+	nnz = best_est;
+    }
+
+    free(dim);
+    free(colnnz);
+    free(done);
+}
+
+
+
+/***************************************
+ * Tensor contraction
+ ***************************************/
+
+/* Push the product of entry i of a and entry j of b */
+static void
+contract_pair(struct contraction *c, unsigned int i, unsigned int j,
+	      sp_index_t *idx, struct coo *out)
+{
+    sp_index_t *x = c->a->idx + i * c->a->nmodes;
+    sp_index_t *y = c->b->idx + j * c->b->nmodes;
+    unsigned int m;
+
+    /* a full contraction has the single index 1 */
+    idx[0] = 1;
+    for(m=0; m<c->nfa; m++) {
+	idx[m] = x[c->fa[m]];
+    }
+    for(m=0; m<c->nfb; m++) {
+	idx[c->nfa + m] = y[c->fb[m]];
+    }
+    coo_push(out, idx, c->a->val[i] * c->b->val[j]);
+}
+
+
+/* Produce every pair of the matching key groups first ... last-1 */
+static void *
+contract_merge(void *arg)
+{
+    struct contract_task *task = (struct contract_task *) arg;
+    struct contract_match *match;
+    sp_index_t *idx;
+    unsigned int m, i, j;
+
+    idx = malloc(sizeof(sp_index_t) * task->c->nmodes);
+    for(m=task->first; m<task->last; m++) {
+	match = task->match + m;
+	for(i=match->afirst; i<match->alast; i++) {
+	    for(j=match->bfirst; j<match->blast; j++) {
+		contract_pair(task->c, task->ap[i], task->bp[j], idx, 
+			      task->out);
+	    }
+	}
+    }
+
+    free(idx);
+    return NULL;
+}
+
+
+/* Hash the key of entry i */
+static unsigned int
+contract_hash_key(struct coo *t, unsigned int *modes, unsigned int count,
+		  unsigned int i)
+{
+    sp_index_t *x = t->idx + i * t->nmodes;
+    unsigned int h = 0;
+    unsigned int m;
+
+    for(m=0; m<count; m++) {
+	h = (h ^ x[modes[m]]) * 2654435761u;
+    }
+    return h ^ (h >> 16);
+}
+
+
+/* Compare the key of entry i of x with the key of entry j of y */
+static int
+contract_key_cmp(struct coo *x, unsigned int *xm, unsigned int i,
+		 struct coo *y, unsigned int *ym, unsigned int j,
+		 unsigned int count)
+{
+    sp_index_t *xi = x->idx + i * x->nmodes;
+    sp_index_t *yj = y->idx + j * y->nmodes;
+    unsigned int m;
+
+    for(m=0; m<count; m++) {
+	if(xi[xm[m]] == yj[ym[m]]) continue;
+	return xi[xm[m]] < yj[ym[m]] ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* 
+ * Build a hash table of t's entries on the given modes.  Entries with the
+ * same key are chained in their original order.
+ */
+static struct contract_table *
+contract_table_alloc(struct coo *t, unsigned int *modes, unsigned int count)
+{
+    struct contract_table *table;
+    int *tail;
+    unsigned int slot;
+    unsigned int i;
+
+    table = malloc(sizeof(struct contract_table));
+    for(table->size = 16; table->size < 2 * t->nnz; table->size *= 2);
+    table->head = malloc(sizeof(int) * table->size);
+    table->next = malloc(sizeof(int) * (t->nnz+1));
+    tail = malloc(sizeof(int) * table->size);
+    for(i=0; i<table->size; i++) {
+	table->head[i] = -1;
+    }
+
+    for(i=0; i<t->nnz; i++) {
+	/* find the key's slot */
+	slot = contract_hash_key(t, modes, count, i) & (table->size - 1);
+	while(table->head[slot] >= 0 && 
+	      contract_key_cmp(t, modes, table->head[slot], 
+			       t, modes, i, count)) {
+	    slot = (slot + 1) & (table->size - 1);
+	}
+
+	/* add to the end of the chain */
+	table->next[i] = -1;
+	if(table->head[slot] < 0) {
+	    table->head[slot] = i;
+	} else {
+	    table->next[tail[slot]] = i;
+	}
+	tail[slot] = i;
+    }
+
+    free(tail);
+    return table;
+}
+
+
+static void
+contract_table_free(struct contract_table *table)
+{
+    free(table->head);
+    free(table->next);
+    free(table);
+}
+
+
+/* Probe the table with entries first ... last-1 of the other operand */
+static void *
+contract_hash(void *arg)
+{
+    struct contract_task *task = (struct contract_task *) arg;
+    struct contraction *c = task->c;
+    struct contract_table *table = task->table;
+    struct coo *build, *probe;
+    unsigned int *bm, *pm;
+    sp_index_t *idx;
+    unsigned int slot;
+    unsigned int i;
+    int e;
+
+    if(task->build_a) {
+	build = c->a;
+	bm = c->ka;
+	probe = c->b;
+	pm = c->kb;
+    } else {
+	build = c->b;
+	bm = c->kb;
+	probe = c->a;
+	pm = c->ka;
+    }
+
+    idx = malloc(sizeof(sp_index_t) * c->nmodes);
+    for(i=task->first; i<task->last; i++) {
+	/* find the matching chain */
+	slot = contract_hash_key(probe, pm, c->nkey, i) & (table->size - 1);
+	while(table->head[slot] >= 0 &&
+	      contract_key_cmp(build, bm, table->head[slot], 
+			       probe, pm, i, c->nkey)) {
+	    slot = (slot + 1) & (table->size - 1);
+	}
+
+	/* pair with everything on it */
+	for(e=table->head[slot]; e>=0; e=table->next[e]) {
+	    if(task->build_a) {
+		contract_pair(c, e, i, idx, task->out);
+	    } else {
+		contract_pair(c, i, e, idx, task->out);
+	    }
+	}
+    }
+
+    free(idx);
+    return NULL;
+}
@@ -0,0 +1,406 @@
+/*
+    This is the thread pool which runs the parallel parts of the library.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <sptensor/sptensor.h>
+#include <sptensor/parallel.h>
+
+/* chunks per thread when parallel_for picks the chunk size */
+#define PARALLEL_CHUNKS 8
+
+/* the chunk size of parallel_reduce when none is given */
+#define PARALLEL_REDUCE_CHUNK 4096
+
+/* a parallel loop being run by the pool */
+struct parallel_job {
+    parallel_for_func func;    /* the loop body */
+    void *arg;
+    unsigned long n;           /* the number of items */
+    unsigned long chunk;       /* the items handed out at a time */
+    unsigned long next;        /* the first item not handed out yet */
+    unsigned int nthreads;     /* the threads taking part */
+};
+
+/* the arguments of the parallel_reduce loop */
+struct parallel_reduction {
+    parallel_reduce_func func;
+    void *arg;
+    unsigned long chunk;
+    double *partial;           /* the result of each chunk */
+};
+
+/* the arguments of the parallel_tasks loop */
+struct parallel_taskset {
+    void *(*func)(void *);
+    char *tasks;
+    size_t size;
+};
+
+/*
+ * The worker pool.  Jobs are published by bumping generation, and the
+ * workers numbered below the job's thread count take part in it.  busy
+ * is held for the whole of a job, so only one job runs at a time.
+ */
+static struct {
+    pthread_mutex_t lock;      /* protects the fields below */
+    pthread_cond_t start;      /* a job has been published */
+    pthread_cond_t finish;     /* a worker has started or left a job */
+    pthread_mutex_t busy;      /* held while a job is running */
+    pthread_t *threads;        /* the workers */
+    unsigned int nworkers;
+    unsigned int ready;        /* workers which are waiting for jobs */
+    unsigned long generation;  /* the number of jobs published */
+    unsigned int active;       /* workers still in the current job */
+    struct parallel_job *job;  /* the current job */
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    NULL, 0, 0, 0, 0, NULL
+};
+
+/* 1 once sptensor_set_threads has been called */
+static int threads_set = 0;
+
+/* static prototypes */
+static void parallel_run(struct parallel_job *job);
+static void parallel_chunks(struct parallel_job *job, unsigned int thread);
+static void parallel_grow(unsigned int nworkers);
+static void *parallel_worker(void *arg);
+static void parallel_reduce_chunk(void *arg, unsigned long first,
+				  unsigned long last, unsigned int thread);
+static void parallel_task(void *arg, unsigned long first,
+			  unsigned long last, unsigned int thread);
+
+
+/* set the number of threads used by the library */
+void
+sptensor_set_threads(unsigned int n)
+{
+    sptensor_threads = n ? n : 1;
+    threads_set = 1;
+}
+
+
+/* the number of threads used by the library */
+unsigned int
+parallel_threads(void)
+{
+    static int env_threads = -1;
+    char *env;
+
+    /* the environment only replaces the default */
+    if(env_threads < 0) {
+	env = getenv("SPTENSOR_THREADS");
+	env_threads = env ? atoi(env) : 0;
+    }
+    if(!threads_set && sptensor_threads == 1 && env_threads > 0) {
+	return env_threads;
+    }
+
+    return sptensor_threads ? sptensor_threads : 1;
+}
+
+
+/* Run func over the items 0 ... n-1 in dynamically assigned chunks */
+void
+parallel_for(unsigned long n, unsigned long chunk,
+	     parallel_for_func func, void *arg)
+{
+    struct parallel_job job;
+    unsigned long nchunks;
+    unsigned int nthreads;
+
+    nthreads = parallel_threads();
+    if(chunk == 0) {
+	chunk = n / (nthreads * PARALLEL_CHUNKS);
+	if(chunk < 1) chunk = 1;
+    }
+    nchunks = (n + chunk - 1) / chunk;
+
+    job.func = func;
+    job.arg = arg;
+    job.n = n;
+    job.chunk = chunk;
+    job.next = 0;
+    job.nthreads = nchunks < nthreads ? nchunks : nthreads;
+    parallel_run(&job);
+}
+
+
+/* Reduce func over the items 0 ... n-1 */
+double
+parallel_reduce(unsigned long n, unsigned long chunk,
+		parallel_reduce_func func, void *arg, int op)
+{
+    struct parallel_reduction red;
+    unsigned long nchunks, i;
+    double result;
+
+    if(chunk == 0) {
+	chunk = PARALLEL_REDUCE_CHUNK;
+    }
+    nchunks = (n + chunk - 1) / chunk;
+    if(nchunks == 0) {
+	return 0.0;
+    }
+
+    /* reduce each chunk, then combine them in order */
+    red.func = func;
+    red.arg = arg;
+    red.chunk = chunk;
+    red.partial = malloc(sizeof(double) * nchunks);
+    parallel_for(n, chunk, parallel_reduce_chunk, &red);
+    if(op == PARALLEL_MAX) {
+	result = red.partial[0];
+	for(i=1; i<nchunks; i++) {
+	    result = red.partial[i] > result ? red.partial[i] : result;
+	}
+    } else {
+	result = dense_sum(nchunks, red.partial);
+    }
+
+    free(red.partial);
+    return result;
+}
+
+
+/* Run func on each of the n tasks, on up to parallel_threads() threads */
+void
+parallel_tasks(void *(*func)(void *), void *tasks, size_t size,
+	       unsigned int n)
+{
+    struct parallel_job job;
+    struct parallel_taskset set;
+    unsigned int nthreads;
+
+    set.func = func;
+    set.tasks = (char*) tasks;
+    set.size = size;
+
+    job.func = parallel_task;
+    job.arg = &set;
+    job.n = n;
+    job.chunk = 1;
+    job.next = 0;
+
+    /* extra tasks are taken by whichever thread is free first */
+    nthreads = parallel_threads();
+    job.nthreads = n < nthreads ? n : nthreads;
+    parallel_run(&job);
+}
+
+
+
+/* Divide nslices slices into nparts parts of about equal cost */
+parallel_partition *
+parallel_partition_alloc(const unsigned long *ptr, unsigned int nslices,
+			 unsigned int nparts, int split)
+{
+    parallel_partition *part;
+    unsigned long target;
+    unsigned int i, s, b;
+
+    if(nparts < 1) nparts = 1;
+    part = malloc(sizeof(parallel_partition));
+    part->nparts = nparts;
+    part->first = malloc(sizeof(unsigned long) * (nparts+1));
+    part->slice = malloc(sizeof(unsigned int) * (nparts+1));
+    part->shared = malloc(sizeof(int) * (nparts+1));
+
+    /* place each boundary at its share of the total cost */
+    s = b = 0;
+    for(i=0; i<=nparts; i++) {
+	target = (unsigned long) ((double) ptr[nslices] * i / nparts);
+	if(i == nparts) target = ptr[nslices];
+
+	/* the slice holding the target */
+	while(s < nslices && ptr[s+1] <= target) s++;
+
+	if(split) {
+	    part->first[i] = target;
+	    part->slice[i] = s;
+	    part->shared[i] = s < nslices && target > ptr[s];
+	} else {
+	    /* round to the nearer end of the slice */
+	    b = s > b ? s : b;
+	    if(s < nslices && target - ptr[s] > ptr[s+1] - target) {
+		b = s + 1;
+	    }
+	    part->first[i] = ptr[b];
+	    part->slice[i] = b;
+	    part->shared[i] = 0;
+	}
+    }
+
+    return part;
+}
+
+
+/* free a partition */
+void
+parallel_partition_free(parallel_partition *part)
+{
+    free(part->first);
+    free(part->slice);
+    free(part->shared);
+    free(part);
+}
+
+
+
+/***************************************
+ * Static Functions
+ ***************************************/
+
+/*
+ * Run a job on the calling thread and job->nthreads-1 workers.  If the
+ * pool is already running a job (including when this is called from
+ * inside one), the job runs on the calling thread alone.
+ */
+static void
+parallel_run(struct parallel_job *job)
+{
+    if(job->nthreads <= 1 || pthread_mutex_trylock(&pool.busy) != 0) {
+	job->nthreads = 1;
+	parallel_chunks(job, 0);
+	return;
+    }
+
+    /* publish the job */
+    pthread_mutex_lock(&pool.lock);
+    parallel_grow(job->nthreads - 1);
+    pool.job = job;
+    pool.active = job->nthreads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    /* take part, then wait for the workers to finish */
+    parallel_chunks(job, 0);
+    pthread_mutex_lock(&pool.lock);
+    while(pool.active > 0) {
+	pthread_cond_wait(&pool.finish, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+}
+
+
+/* take chunks of the job until there are none left */
+static void
+parallel_chunks(struct parallel_job *job, unsigned int thread)
+{
+    unsigned long first, last;
+
+    for(;;) {
+	first = __sync_fetch_and_add(&job->next, job->chunk);
+	if(first >= job->n) {
+	    break;
+	}
+	last = first + job->chunk < job->n ? first + job->chunk : job->n;
+	job->func(job->arg, first, last, thread);
+    }
+}
+
+
+/*
+ * Make sure the pool has at least nworkers workers, and wait until they
+ * are all ready for jobs.  The caller must hold pool.lock.
+ */
+static void
+parallel_grow(unsigned int nworkers)
+{
+    unsigned int i;
+
+    if(nworkers <= pool.nworkers) {
+	return;
+    }
+
+    pool.threads = realloc(pool.threads, sizeof(pthread_t) * nworkers);
+    for(i=pool.nworkers; i<nworkers; i++) {
+	pthread_create(pool.threads + i, NULL, parallel_worker,
+		       (void*) (size_t) (i + 1));
+    }
+    pool.nworkers = nworkers;
+    while(pool.ready < pool.nworkers) {
+	pthread_cond_wait(&pool.finish, &pool.lock);
+    }
+}
+
+
+/* a worker thread, which runs its share of each job it takes part in */
+static void *
+parallel_worker(void *arg)
+{
+    unsigned int id = (unsigned int) (size_t) arg;
+    unsigned long seen;
+    struct parallel_job *job;
+
+    pthread_mutex_lock(&pool.lock);
+    seen = pool.generation;
+    pool.ready++;
+    pthread_cond_broadcast(&pool.finish);
+
+    for(;;) {
+	while(pool.generation == seen) {
+	    pthread_cond_wait(&pool.start, &pool.lock);
+	}
+	seen = pool.generation;
+	job = pool.job;
+	if(!job || id >= job->nthreads) {
+	    continue;
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+	parallel_chunks(job, id);
+	pthread_mutex_lock(&pool.lock);
+	if(--pool.active == 0) {
+	    pthread_cond_broadcast(&pool.finish);
+	}
+    }
+
+    return NULL;
+}
+
+
+/* one chunk of a parallel_reduce */
+static void
+parallel_reduce_chunk(void *arg, unsigned long first, unsigned long last,
+		      unsigned int thread)
+{
+    struct parallel_reduction *red = (struct parallel_reduction*) arg;
+
+    (void) thread;
+    red->partial[first / red->chunk] = red->func(red->arg, first, last);
+}
+
+
+/* one task of a parallel_tasks */
+static void
+parallel_task(void *arg, unsigned long first, unsigned long last,
+	      unsigned int thread)
+{
+    struct parallel_taskset *set = (struct parallel_taskset*) arg;
+    unsigned long i;
+
+    (void) thread;
+    for(i=first; i<last; i++) {
+	set->func(set->tasks + i * set->size);
+    }
+}
@@ -25,3 +25,6 @@ unsigned int sptensor_verbose = 0;
 
 /* default norm level to use in tensor algorithms (default 2) */
 int stpensor_default_lp = 2;
+
+/* number of threads used by the library (default 1, see parallel.h) */
+unsigned int sptensor_threads = 1;
@@ -0,0 +1,687 @@
+/*
+    This is a collection of reduction kernels over arrays of values.
+    Copyright (C) 2018 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <sptensor/sptensor.h>
+#include <sptensor/reduce.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REDUCE_X86 1
+#include <immintrin.h>
+#endif
+
+/* the length of the leaves of the pairwise sums */
+#define REDUCE_BLOCK 256
+
+/* the element maps which are summed (each element is scaled by s first) */
+#define REDUCE_SUM 0   /* s*x */
+#define REDUCE_ABS 1   /* |s*x| */
+#define REDUCE_SQR 2   /* (s*x)^2 */
+#define REDUCE_POW 3   /* |s*x|^p */
+
+/* sums op(s*x) over a block of at most REDUCE_BLOCK elements */
+typedef double (*reduce_kernel_func)(unsigned int n, const double *x,
+				     int op, double s);
+
+/* static prototypes */
+static double reduce_pairwise(unsigned int n, const double *x, int op,
+			      double s, double p);
+static double reduce_scaled(unsigned int n, const double *x, int op,
+			    double p);
+static reduce_kernel_func reduce_select(void);
+static double reduce_elem(double x, int op, double s);
+static double reduce_kernel_c(unsigned int n, const double *x, int op,
+			      double s);
+static double reduce_pow_c(unsigned int n, const double *x, double s,
+			   double p);
+static double powi(double x, unsigned int k);
+static double reduce_first(double x, int op);
+static double reduce_combine(double acc, double x, int op);
+static void reduce_segments(sptensor *out, sptensor *tns, 
+			    unsigned int nkeep, int op);
+static void reduce_hash(sptensor *out, tensor_view *v, unsigned int *keep,
+			unsigned int nkeep, int op);
+static unsigned int reduce_key_hash(sp_index_t *key, unsigned int n);
+static void reduce_sort(unsigned int *perm, unsigned int n, sp_index_t *key,
+			unsigned int nkeep);
+#ifdef REDUCE_X86
+static double reduce_kernel_avx2(unsigned int n, const double *x, int op,
+				 double s);
+static double reduce_kernel_avx512(unsigned int n, const double *x, int op,
+				   double s);
+#endif
+
+
+/* the sum of the n elements of x */
+double
+dense_sum(unsigned int n, const double *x)
+{
+    return reduce_pairwise(n, x, REDUCE_SUM, 1.0, 1.0);
+}
+
+
+/* the sum of the absolute values of x (the L-1 norm) */
+double
+dense_asum(unsigned int n, const double *x)
+{
+    return reduce_pairwise(n, x, REDUCE_ABS, 1.0, 1.0);
+}
+
+
+/* the L-2 norm of x, scaled so that it does not overflow or underflow */
+double
+dense_nrm2(unsigned int n, const double *x)
+{
+    return reduce_scaled(n, x, REDUCE_SQR, 2.0);
+}
+
+
+/* the largest absolute value in x (the L-infinity norm) */
+double
+dense_amax(unsigned int n, const double *x)
+{
+    double m0, m1, m2, m3;
+    double v;
+    unsigned int i;
+
+    /* four independent running maxima */
+    m0 = m1 = m2 = m3 = 0.0;
+    for(i=0; i+4<=n; i+=4) {
+	v = fabs(x[i]);
+	m0 = v > m0 ? v : m0;
+	v = fabs(x[i+1]);
+	m1 = v > m1 ? v : m1;
+	v = fabs(x[i+2]);
+	m2 = v > m2 ? v : m2;
+	v = fabs(x[i+3]);
+	m3 = v > m3 ? v : m3;
+    }
+    for(; i<n; i++) {
+	v = fabs(x[i]);
+	m0 = v > m0 ? v : m0;
+    }
+
+    m0 = m1 > m0 ? m1 : m0;
+    m2 = m3 > m2 ? m3 : m2;
+    return m2 > m0 ? m2 : m0;
+}
+
+
+/* the sum of |x|^p, without scaling */
+double
+dense_powsum(unsigned int n, const double *x, double p)
+{
+    if(p == 1.0) {
+	return reduce_pairwise(n, x, REDUCE_ABS, 1.0, 1.0);
+    }
+    if(p == 2.0) {
+	return reduce_pairwise(n, x, REDUCE_SQR, 1.0, 2.0);
+    }
+    return reduce_pairwise(n, x, REDUCE_POW, 1.0, p);
+}
+
+
+/* the L-p norm of x */
+double
+dense_lpnorm(unsigned int n, const double *x, double p)
+{
+    if(p == HUGE_VAL) {
+	return dense_amax(n, x);
+    }
+    if(p == 1.0) {
+	return dense_asum(n, x);
+    }
+    if(p == 2.0) {
+	return dense_nrm2(n, x);
+    }
+    return reduce_scaled(n, x, REDUCE_POW, p);
+}
+
+
+
+/*
+ * Reduce a tensor along one or more of its modes.  When the kept modes
+ * lead the sort order of a sparse tensor, each output element is a run
+ * of consecutive nonzeros, so the reduction is one segmented pass.  Any
+ * other order is grouped in a hash table, and vector results are simply
+ * accumulated in place.
+ */
+tensor_view *
+tensor_reduce(tensor_view *v, unsigned int *modes, unsigned int count, int op)
+{
+    tensor_view *result;
+    sptensor *tns;
+    sp_index_t *rdim;
+    sp_index_t *idx;
+    unsigned int *keep;
+    unsigned int nkeep;
+    unsigned int i, j, nnz;
+    unsigned int pos;
+    double *elem;
+    char *seen;
+    int prefix;
+
+    /* find the kept modes and the shape of the result */
+    keep = malloc(sizeof(unsigned int) * v->nmodes);
+    rdim = malloc(sizeof(sp_index_t) * v->nmodes + sizeof(sp_index_t));
+    nkeep = 0;
+    for(i=0; i<v->nmodes; i++) {
+	for(j=0; j<count && modes[j] != i; j++);
+	if(j == count) {
+	    rdim[nkeep] = v->dim[i];
+	    keep[nkeep++] = i;
+	}
+    }
+    tns = sptensor_view_data(v);
+    nnz = TVNNZ(v);
+
+    /* vectors are accumulated directly */
+    if(nkeep <= 1) {
+	if(nkeep == 0) {
+	    rdim[0] = 1;
+	}
+	result = dense_tensor_alloc(1, rdim);
+	elem = dense_tensor_elements(result);
+	seen = calloc(rdim[0], 1);
+	idx = TVIDX_ALLOC(v);
+	for(i=0; i<nnz; i++) {
+	    TVIDX(v, i, idx);
+	    pos = nkeep ? idx[keep[0]] - 1 : 0;
+	    elem[pos] = seen[pos] ? reduce_combine(elem[pos], TVGETI(v, i), op)
+		: reduce_first(TVGETI(v, i), op);
+	    seen[pos] = 1;
+	}
+	free(idx);
+	free(seen);
+    } else {
+	result = tensor_alloc(nkeep, rdim);
+	prefix = tns != NULL;
+	for(i=0; i<nkeep; i++) {
+	    prefix = prefix && keep[i] == i;
+	}
+	if(prefix) {
+	    reduce_segments(sptensor_view_data(result), tns, nkeep, op);
+	} else {
+	    reduce_hash(sptensor_view_data(result), v, keep, nkeep, op);
+	}
+    }
+
+    /* cleanup and return */
+    free(keep);
+    free(rdim);
+    return result;
+}
+
+
+
+/***************************************
+ * Static Functions
+ ***************************************/
+
+/*
+ * Pairwise sum of op(s*x).  Each half is summed separately down to
+ * blocks of REDUCE_BLOCK, so the rounding error grows with the log of
+ * n rather than with n.
+ */
+static double
+reduce_pairwise(unsigned int n, const double *x, int op, double s, double p)
+{
+    unsigned int h;
+
+    if(n <= REDUCE_BLOCK) {
+	if(op == REDUCE_POW) {
+	    return reduce_pow_c(n, x, s, p);
+	}
+	return (*reduce_select())(n, x, op, s);
+    }
+
+    /* split on a block boundary */
+    h = (n / 2 + REDUCE_BLOCK - 1) / REDUCE_BLOCK * REDUCE_BLOCK;
+    return reduce_pairwise(h, x, op, s, p)
+	+ reduce_pairwise(n - h, x + h, op, s, p);
+}
+
+
+/*
+ * (sum |x|^p)^(1/p).  The sum is first computed unscaled, and only if it
+ * overflows or underflows is it recomputed with every element divided
+ * by the largest one.
+ */
+static double
+reduce_scaled(unsigned int n, const double *x, int op, double p)
+{
+    double sum;
+    double m;
+
+    sum = reduce_pairwise(n, x, op, 1.0, p);
+    if(sum >= DBL_MIN && sum <= DBL_MAX) {
+	return op == REDUCE_SQR ? sqrt(sum) : pow(sum, 1.0/p);
+    }
+
+    /* all zeroes, or values which cannot be scaled */
+    m = dense_amax(n, x);
+    if(m == 0.0 || m > DBL_MAX) {
+	return m;
+    }
+
+    sum = reduce_pairwise(n, x, op, 1.0/m, p);
+    return m * (op == REDUCE_SQR ? sqrt(sum) : pow(sum, 1.0/p));
+}
+
+
+/* Pick the best kernel for this processor (once) */
+static reduce_kernel_func
+reduce_select(void)
+{
+    static reduce_kernel_func kern;
+    static int selected = 0;
+
+    if(selected) {
+	return kern;
+    }
+
+    kern = reduce_kernel_c;
+#ifdef REDUCE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+	kern = reduce_kernel_avx512;
+    } else if(__builtin_cpu_supports("avx2") &&
+	      __builtin_cpu_supports("fma")) {
+	kern = reduce_kernel_avx2;
+    }
+#endif
+    selected = 1;
+
+    return kern;
+}
+
+
+/* op(s*x) for a single element */
+static double
+reduce_elem(double x, int op, double s)
+{
+    x *= s;
+    switch(op) {
+    case REDUCE_ABS:
+	return fabs(x);
+    case REDUCE_SQR:
+	return x * x;
+    }
+    return x;
+}
+
+
+/* Portable kernel with four accumulators */
+static double
+reduce_kernel_c(unsigned int n, const double *x, int op, double s)
+{
+    double a0, a1, a2, a3;
+    unsigned int i;
+
+    a0 = a1 = a2 = a3 = 0.0;
+    for(i=0; i+4<=n; i+=4) {
+	a0 += reduce_elem(x[i], op, s);
+	a1 += reduce_elem(x[i+1], op, s);
+	a2 += reduce_elem(x[i+2], op, s);
+	a3 += reduce_elem(x[i+3], op, s);
+    }
+    for(; i<n; i++) {
+	a0 += reduce_elem(x[i], op, s);
+    }
+
+    return (a0 + a1) + (a2 + a3);
+}
+
+
+/* Sum of |s*x|^p with four accumulators, multiplying out integer powers */
+static double
+reduce_pow_c(unsigned int n, const double *x, double s, double p)
+{
+    double a0, a1, a2, a3;
+    unsigned int i;
+    unsigned int k;
+
+    a0 = a1 = a2 = a3 = 0.0;
+    if(p >= 1.0 && p <= 64.0 && p == floor(p)) {
+	k = (unsigned int) p;
+	for(i=0; i+4<=n; i+=4) {
+	    a0 += powi(fabs(s * x[i]), k);
+	    a1 += powi(fabs(s * x[i+1]), k);
+	    a2 += powi(fabs(s * x[i+2]), k);
+	    a3 += powi(fabs(s * x[i+3]), k);
+	}
+	for(; i<n; i++) {
+	    a0 += powi(fabs(s * x[i]), k);
+	}
+    } else {
+	for(i=0; i<n; i++) {
+	    a0 += pow(fabs(s * x[i]), p);
+	}
+    }
+
+    return (a0 + a1) + (a2 + a3);
+}
+
+
+/* x^k by repeated squaring */
+static double
+powi(double x, unsigned int k)
+{
+    double result = 1.0;
+
+    while(k) {
+	if(k & 1) {
+	    result *= x;
+	}
+	x *= x;
+	k >>= 1;
+    }
+
+    return result;
+}
+
+
+#ifdef REDUCE_X86
+/* four ymm accumulators, 16 elements per step */
+__attribute__((target("avx2,fma")))
+static double
+reduce_kernel_avx2(unsigned int n, const double *x, int op, double s)
+{
+    __m256d a0, a1, a2, a3;
+    __m256d v0, v1, v2, v3;
+    __m256d sv, sign;
+    double part[4];
+    double tail = 0.0;
+    unsigned int i;
+
+    sv = _mm256_set1_pd(s);
+    sign = _mm256_set1_pd(-0.0);
+    a0 = a1 = a2 = a3 = _mm256_setzero_pd();
+    for(i=0; i+16<=n; i+=16) {
+	v0 = _mm256_mul_pd(sv, _mm256_loadu_pd(x + i));
+	v1 = _mm256_mul_pd(sv, _mm256_loadu_pd(x + i + 4));
+	v2 = _mm256_mul_pd(sv, _mm256_loadu_pd(x + i + 8));
+	v3 = _mm256_mul_pd(sv, _mm256_loadu_pd(x + i + 12));
+	if(op == REDUCE_SQR) {
+	    a0 = _mm256_fmadd_pd(v0, v0, a0);
+	    a1 = _mm256_fmadd_pd(v1, v1, a1);
+	    a2 = _mm256_fmadd_pd(v2, v2, a2);
+	    a3 = _mm256_fmadd_pd(v3, v3, a3);
+	    continue;
+	}
+	if(op == REDUCE_ABS) {
+	    v0 = _mm256_andnot_pd(sign, v0);
+	    v1 = _mm256_andnot_pd(sign, v1);
+	    v2 = _mm256_andnot_pd(sign, v2);
+	    v3 = _mm256_andnot_pd(sign, v3);
+	}
+	a0 = _mm256_add_pd(a0, v0);
+	a1 = _mm256_add_pd(a1, v1);
+	a2 = _mm256_add_pd(a2, v2);
+	a3 = _mm256_add_pd(a3, v3);
+    }
+    for(; i<n; i++) {
+	tail += reduce_elem(x[i], op, s);
+    }
+
+    a0 = _mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3));
+    _mm256_storeu_pd(part, a0);
+    return ((part[0] + part[1]) + (part[2] + part[3])) + tail;
+}
+
+
+/* four zmm accumulators, 32 elements per step */
+__attribute__((target("avx512f")))
+static double
+reduce_kernel_avx512(unsigned int n, const double *x, int op, double s)
+{
+    __m512d a0, a1, a2, a3;
+    __m512d v0, v1, v2, v3;
+    __m512d sv;
+    double part[8];
+    double tail = 0.0;
+    unsigned int i;
+
+    sv = _mm512_set1_pd(s);
+    a0 = a1 = a2 = a3 = _mm512_setzero_pd();
+    for(i=0; i+32<=n; i+=32) {
+	v0 = _mm512_mul_pd(sv, _mm512_loadu_pd(x + i));
+	v1 = _mm512_mul_pd(sv, _mm512_loadu_pd(x + i + 8));
+	v2 = _mm512_mul_pd(sv, _mm512_loadu_pd(x + i + 16));
+	v3 = _mm512_mul_pd(sv, _mm512_loadu_pd(x + i + 24));
+	if(op == REDUCE_SQR) {
+	    a0 = _mm512_fmadd_pd(v0, v0, a0);
+	    a1 = _mm512_fmadd_pd(v1, v1, a1);
+	    a2 = _mm512_fmadd_pd(v2, v2, a2);
+	    a3 = _mm512_fmadd_pd(v3, v3, a3);
+	    continue;
+	}
+	if(op == REDUCE_ABS) {
+	    v0 = _mm512_abs_pd(v0);
+	    v1 = _mm512_abs_pd(v1);
+	    v2 = _mm512_abs_pd(v2);
+	    v3 = _mm512_abs_pd(v3);
+	}
+	a0 = _mm512_add_pd(a0, v0);
+	a1 = _mm512_add_pd(a1, v1);
+	a2 = _mm512_add_pd(a2, v2);
+	a3 = _mm512_add_pd(a3, v3);
+    }
+    for(; i<n; i++) {
+	tail += reduce_elem(x[i], op, s);
+    }
+
+    a0 = _mm512_add_pd(_mm512_add_pd(a0, a1), _mm512_add_pd(a2, a3));
+    _mm512_storeu_pd(part, a0);
+    return (((part[0] + part[1]) + (part[2] + part[3]))
+	    + ((part[4] + part[5]) + (part[6] + part[7]))) + tail;
+}
+#endif
+
+
+/* the reduction of a single element */
+static double
+reduce_first(double x, int op)
+{
+    return op == TENSOR_REDUCE_COUNT ? 1.0 : x;
+}
+
+
+/* add an element to a reduction */
+static double
+reduce_combine(double acc, double x, int op)
+{
+    switch(op) {
+    case TENSOR_REDUCE_MAX:
+	return x > acc ? x : acc;
+    case TENSOR_REDUCE_COUNT:
+	return acc + 1.0;
+    }
+    return acc + x;
+}
+
+
+/* 
+ * Reduce a sorted sparse tensor over its trailing modes.  Nonzeros which
+ * agree in the first nkeep modes are consecutive, so each run is reduced
+ * and appended to out in order.
+ */
+static void
+reduce_segments(sptensor *out, sptensor *tns, unsigned int nkeep, int op)
+{
+    unsigned int i;
+    sp_index_t *idx, *start = NULL;
+    double acc = 0.0;
+    double x;
+
+    for(i=0; i<tns->ar->size; i++) {
+	idx = VPTR(tns->idx, i);
+	x = VVAL(double, tns->ar, i);
+	if(start && sptensor_indexcmp(nkeep, start, idx) == 0) {
+	    acc = reduce_combine(acc, x, op);
+	    continue;
+	}
+	if(start) {
+	    sptensor_append(out, start, acc);
+	}
+	start = idx;
+	acc = reduce_first(x, op);
+    }
+    if(start) {
+	sptensor_append(out, start, acc);
+    }
+}
+
+
+/*
+ * Reduce any view by grouping its nonzeros on the kept modes in an open
+ * addressed hash table.  The groups are sorted by index before they are
+ * appended to out.
+ */
+static void
+reduce_hash(sptensor *out, tensor_view *v, unsigned int *keep, 
+	    unsigned int nkeep, int op)
+{
+    unsigned int nnz, size, mask;
+    unsigned int ngroups;
+    unsigned int i, k, h;
+    int *slot;
+    sp_index_t *idx;
+    sp_index_t *key;
+    sp_index_t *gkey;
+    double *val;
+    double x;
+    unsigned int *perm;
+
+    /* there are at most nnz groups, so the table is at most half full */
+    nnz = TVNNZ(v);
+    for(size=1; size < 2*nnz; size <<= 1);
+    mask = size - 1;
+    slot = malloc(sizeof(int) * size);
+    for(i=0; i<size; i++) {
+	slot[i] = -1;
+    }
+    gkey = malloc(sizeof(sp_index_t) * (nkeep && nnz ? nkeep * nnz : 1));
+    val = malloc(sizeof(double) * (nnz ? nnz : 1));
+    idx = TVIDX_ALLOC(v);
+    key = malloc(sizeof(sp_index_t) * nkeep);
+
+    /* group the nonzeros */
+    ngroups = 0;
+    for(i=0; i<nnz; i++) {
+	TVIDX(v, i, idx);
+	x = TVGETI(v, i);
+	for(k=0; k<nkeep; k++) {
+	    key[k] = idx[keep[k]];
+	}
+	h = reduce_key_hash(key, nkeep) & mask;
+	while(slot[h] >= 0 && 
+	      memcmp(gkey + slot[h] * nkeep, key, 
+		     sizeof(sp_index_t) * nkeep) != 0) {
+	    h = (h + 1) & mask;
+	}
+	if(slot[h] < 0) {
+	    slot[h] = ngroups;
+	    memcpy(gkey + ngroups * nkeep, key, sizeof(sp_index_t) * nkeep);
+	    val[ngroups++] = reduce_first(x, op);
+	} else {
+	    val[slot[h]] = reduce_combine(val[slot[h]], x, op);
+	}
+    }
+
+    /* append the groups in order */
+    perm = malloc(sizeof(unsigned int) * (ngroups ? ngroups : 1));
+    for(i=0; i<ngroups; i++) {
+	perm[i] = i;
+    }
+    reduce_sort(perm, ngroups, gkey, nkeep);
+    sptensor_reserve(out, ngroups);
+    for(i=0; i<ngroups; i++) {
+	sptensor_append(out, gkey + perm[i] * nkeep, val[perm[i]]);
+    }
+
+    /* cleanup */
+    free(perm);
+    free(key);
+    free(idx);
+    free(val);
+    free(gkey);
+    free(slot);
+}
+
+
+/* FNV-1a over the index */
+static unsigned int
+reduce_key_hash(sp_index_t *key, unsigned int n)
+{
+    unsigned int h = 2166136261u;
+    unsigned int i;
+
+    for(i=0; i<n; i++) {
+	h = (h ^ key[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+
+/* sort a permutation of the groups by their keys (bottom up merge sort) */
+static void
+reduce_sort(unsigned int *perm, unsigned int n, sp_index_t *key, 
+	    unsigned int nkeep)
+{
+    unsigned int *tmp, *src, *dst, *swap;
+    unsigned int width, lo, mid, hi, i, j, k;
+
+    /* nothing to sort */
+    if(n < 2) {
+	return;
+    }
+
+    tmp = malloc(sizeof(unsigned int) * n);
+    src = perm;
+    dst = tmp;
+    for(width=1; width<n; width*=2) {
+	for(lo=0; lo<n; lo+=2*width) {
+	    mid = lo + width < n ? lo + width : n;
+	    hi = lo + 2*width < n ? lo + 2*width : n;
+	    i = lo;
+	    j = mid;
+	    for(k=lo; k<hi; k++) {
+		if(j >= hi || (i < mid && 
+		   sptensor_indexcmp(nkeep, key + src[i] * nkeep,
+				     key + src[j] * nkeep) <= 0)) {
+		    dst[k] = src[i++];
+		} else {
+		    dst[k] = src[j++];
+		}
+	    }
+	}
+	swap = src;
+	src = dst;
+	dst = swap;
+    }
+
+    /* the result may have ended up in the scratch array */
+    if(src != perm) {
+	memcpy(perm, src, sizeof(unsigned int) * n);
+    }
+    free(tmp);
+}
@@ -20,6 +20,12 @@
 #include <stdlib.h>
 #include <sptensor/sptensorio.h>
 
+/* more modes than this in a binary tensor means the file is corrupt */
+#define SPTENSOR_BINARY_MAX_MODES 1024
+
+/* static prototypes */
+static long binary_remaining(FILE *file);
+
 /* 
  * Read a sparse tensor from a file stream. The file stream is
  * expected to be in the form of:
@@ -110,3 +116,124 @@ sptensor_write(FILE *file, sptensor *tns)
 	fprintf(file, "%g\n", VVAL(double, tns->ar,i));
     }
 }
+
+
+/*
+ * Write a sparse tensor to a stream in binary.  The index and value 
+ * arrays are written as they are stored.
+ * 
+ * Parameter: file - The stream to write to.
+ *            tns  - The tensor to write.
+ *
+ * Return: 0 on success, -1 if the write failed.
+ */
+int
+sptensor_write_binary(FILE *file, sptensor *tns)
+{
+    unsigned int nmodes = tns->nmodes;
+    unsigned int nnz = tns->ar->size;
+
+    if(fwrite(&nmodes, sizeof(unsigned int), 1, file) != 1 ||
+       fwrite(tns->dim, sizeof(sp_index_t), nmodes, file) != nmodes ||
+       fwrite(&nnz, sizeof(unsigned int), 1, file) != 1 ||
+       fwrite(tns->idx->ar, sizeof(sp_index_t) * nmodes, nnz, file) != nnz ||
+       fwrite(tns->ar->ar, sizeof(double), nnz, file) != nnz) {
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Read a sparse tensor written by sptensor_write_binary.  The arrays are
+ * read straight into the tensor's storage.
+ *
+ * Parameters: file - The file to read from
+ *
+ * Return: The newly read and allocated tensor, or NULL if the stream 
+ *         ended early or holds something which is not a tensor.
+ */
+sptensor *
+sptensor_read_binary(FILE *file)
+{
+    unsigned int nmodes;
+    unsigned int nnz;
+    unsigned int i, k;
+    sp_index_t *dim;
+    sp_index_t *idx;
+    sptensor *tns;
+    double size;
+    long remaining;
+
+    /* get the dimensions */
+    if(fread(&nmodes, sizeof(unsigned int), 1, file) != 1 ||
+       nmodes == 0 || nmodes > SPTENSOR_BINARY_MAX_MODES) {
+	return NULL;
+    }
+    dim = (sp_index_t*) malloc(sizeof(sp_index_t)*nmodes);
+    if(fread(dim, sizeof(sp_index_t), nmodes, file) != nmodes ||
+       fread(&nnz, sizeof(unsigned int), 1, file) != 1) {
+	free(dim);
+	return NULL;
+    }
+
+    /* there can't be more nonzeros than elements, or than the file holds */
+    size = 1;
+    for(k=0; k<nmodes; k++) {
+	size *= dim[k];
+    }
+    remaining = binary_remaining(file);
+    if(size < nnz || (remaining >= 0 && (double) remaining < (double) nnz * 
+		      (sizeof(sp_index_t) * nmodes + sizeof(double)))) {
+	free(dim);
+	return NULL;
+    }
+
+    /* allocate the tensor and read its arrays */
+    tns = sptensor_alloc(nmodes, dim);
+    free(dim);
+    sptensor_reserve(tns, nnz);
+    if(fread(tns->idx->ar, sizeof(sp_index_t) * nmodes, nnz, file) != nnz ||
+       fread(tns->ar->ar, sizeof(double), nnz, file) != nnz) {
+	sptensor_free(tns);
+	return NULL;
+    }
+    tns->idx->size = nnz;
+    tns->ar->size = nnz;
+
+    /* every index has to be in bounds, and in strictly increasing order
+       since the lookups search the indexes */
+    for(i=0; i<nnz; i++) {
+	idx = VPTR(tns->idx, i);
+	for(k=0; k<nmodes; k++) {
+	    if(idx[k] < 1 || idx[k] > tns->dim[k]) break;
+	}
+	if(k < nmodes || (i > 0 && sptensor_indexcmp(nmodes, 
+				      VPTR(tns->idx, i-1), idx) >= 0)) {
+	    sptensor_free(tns);
+	    return NULL;
+	}
+    }
+
+    return tns;
+}
+
+
+/* The bytes left in file, or -1 if it can't tell (a pipe, say) */
+static long
+binary_remaining(FILE *file)
+{
+    long pos, end;
+
+    pos = ftell(file);
+    if(pos < 0 || fseek(file, 0, SEEK_END) != 0) {
+	return -1;
+    }
+    end = ftell(file);
+    if(fseek(file, pos, SEEK_SET) != 0 || end < pos) {
+	return -1;
+    }
+
+    return end - pos;
+}
@@ -16,27 +16,112 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
  */
+#include <string.h>
 #include <math.h>
+#include <sptensor/sptensor.h>
+#include <sptensor/reduce.h>
 #include <sptensor/tensor_math.h>
 
+/* the in place maps applied directly to value arrays */
+#define MAP_SCALE     0
+#define MAP_ABS       1
+#define MAP_CLAMP     2
+#define MAP_THRESHOLD 3
+#define MAP_POW       4
+#define MAP_FUNC      5
+
+/* elementwise products and quotients */
+#define ELEM_MUL 0
+#define ELEM_DIV 1
+
+/* the least number of nonzeros worth giving to a thread */
+#define ELEM_GRAIN 4096
+
+/* chunks per thread, so that threads which finish early can take more */
+#define ELEM_CHUNKS 4
+
+/* 
+ * One range of an elementwise product.  The nonzeros first ...
+ * last-1 of s are walked, and each is matched against either the sparse
+ * tensor t (found by galloping) or the dense elements d.
+ */
+struct elem_task {
+    int op;                /* ELEM_MUL or ELEM_DIV */
+    int left;              /* 1 if s is the left operand */
+    sptensor *s;           /* the walked operand */
+    sptensor *t;           /* the searched operand (or NULL) */
+    double *d;             /* the dense operand (or NULL) */
+    unsigned int first;    /* the range of s */
+    unsigned int last;
+    sptensor *result;      /* the products, in order */
+};
+
+/* an elementwise product handed out in chunks by parallel_for */
+struct elem_job {
+    struct elem_task task; /* the operands (the range and result unused) */
+    unsigned long chunk;   /* nonzeros of s in each chunk */
+    sptensor **parts;      /* the products of each chunk */
+};
+
+/* static prototypes */
+static tensor_view *tensor_elementwise(tensor_view *a, tensor_view *b, 
+				       int op);
+static void *elem_range(void *arg);
+static void elem_chunk(void *arg, unsigned long first, unsigned long last,
+		       unsigned int thread);
+static unsigned int elem_gallop(sptensor *t, unsigned int q, sp_index_t *key);
+static void elem_dense(sptensor *result, double *a, double *b, 
+		       sp_index_t *dim, unsigned int nmodes, int op);
+static void tensor_apply(tensor_view *t, int op, double s, 
+			 tensor_map_func f, void *arg);
+static void values_apply(double *val, unsigned int n, int op, double s,
+			 tensor_map_func f, void *arg);
+static double map_value(double x, int op, double s, tensor_map_func f,
+			void *arg);
+static void sptensor_drop_zeros(sptensor *tns);
+static void sptensor_merge(sptensor *result, sptensor *a, sptensor *b, 
+			   double s);
+static void tensor_merge_into(tensor_view *a, tensor_view *b, double s);
+static tensor_view *tensor_merge_alloc(tensor_view *a, tensor_view *b, 
+				       double s);
+
 /* The operations that create a new tensor_view need to produce a copy */
 static tensor_view *
 tensor_alloc_cpy(tensor_view *t)
 {
     tensor_view *result;
+    sptensor *tns;
     int i;
     int nnz;
     sp_index_t *idx;
+    double val;
 
     /* allocate the result */
     result = tensor_alloc(t->nmodes, t->dim);
+    tns = sptensor_view_data(result);
+
+    /* sparse tensors copy their index and value lists whole */
+    if(sptensor_view_data(t)) {
+	vector_assign(tns->idx, sptensor_view_data(t)->idx);
+	vector_assign(tns->ar, sptensor_view_data(t)->ar);
+	return result;
+    }
+
     idx = malloc(sizeof(sp_index_t)*t->nmodes);
 
-    /* copy the non-zero elements of a */
+    /* copy the non-zero elements of a, appending while they are in order */
     nnz = TVNNZ(t);
+    sptensor_reserve(tns, nnz);
     for(i=0; i<nnz; i++) {
 	TVIDX(t, i, idx);
-	TVSET(result, idx, TVGETI(t, i));
+	val = TVGETI(t, i);
+	if(tns->idx->size == 0 ||
+	   sptensor_indexcmp(t->nmodes, 
+			     VPTR(tns->idx, tns->idx->size-1), idx) < 0) {
+	    sptensor_append(tns, idx, val);
+	} else {
+	    TVSET(result, idx, val);
+	}
     }
 
     /* cleanup and return */
@@ -49,15 +134,7 @@ tensor_alloc_cpy(tensor_view *t)
 tensor_view *
 tensor_add(tensor_view *a, tensor_view *b)
 {
-    tensor_view *result;
-
-    /* first, copy the tensor */
-    result = tensor_alloc_cpy(a);
-
-    /* apply the tensor increase */
-    tensor_increase(result, b);
-
-    return result;
+    return tensor_merge_alloc(a, b, 1.0);
 }
 
 
@@ -65,15 +142,7 @@ tensor_add(tensor_view *a, tensor_view *b)
 tensor_view *
 tensor_sub(tensor_view *a, tensor_view *b)
 {
-    tensor_view *result;
-
-    /* first, copy the tensor */
-    result = tensor_alloc_cpy(a);
-
-    /* apply the tensor decrease */
-    tensor_decrease(result, b);
-
-    return result;
+    return tensor_merge_alloc(a, b, -1.0);
 }
 
 
@@ -114,33 +183,234 @@ scalar_div(tensor_view *t, double s)
 void
 tensor_increase(tensor_view *a, tensor_view *b)
 {
-    sp_index_t *idx;
-    int i;
+    tensor_merge_into(a, b, 1.0);
+}
+
+
+/* inplace subtraction of two tensors (a-=b) */
+void
+tensor_decrease(tensor_view *a, tensor_view *b)
+{
+    tensor_merge_into(a, b, -1.0);
+}
+
+
+/* inplace scaling of a tensor by a scalar (t*=s) */
+void
+tensor_scale(tensor_view *t, double s)
+{
+    tensor_apply(t, MAP_SCALE, s, NULL, NULL);
+}
+
+
+/* inplace application of f(x, arg) to each nonzero element of t */
+void
+tensor_map(tensor_view *t, tensor_map_func f, void *arg)
+{
+    tensor_apply(t, MAP_FUNC, 0.0, f, arg);
+}
+
+
+/* inplace absolute value (t = |t|) */
+void
+tensor_abs(tensor_view *t)
+{
+    tensor_apply(t, MAP_ABS, 0.0, NULL, NULL);
+}
+
+
+/* inplace clamp of the negative elements to zero (t = max(t, 0)) */
+void
+tensor_clamp(tensor_view *t)
+{
+    tensor_apply(t, MAP_CLAMP, 0.0, NULL, NULL);
+}
+
+
+/* inplace zeroing of the elements where |t| < tau */
+void
+tensor_threshold(tensor_view *t, double tau)
+{
+    tensor_apply(t, MAP_THRESHOLD, tau, NULL, NULL);
+}
+
+
+/* inplace elementwise power (t = t^p) */
+void
+tensor_pow(tensor_view *t, double p)
+{
+    tensor_apply(t, MAP_POW, p, NULL, NULL);
+}
+
+
+/* elementwise product of two tensors (returns a .* b) */
+tensor_view *
+tensor_hadamard(tensor_view *a, tensor_view *b)
+{
+    return tensor_elementwise(a, b, ELEM_MUL);
+}
+
+
+/* elementwise quotient of two tensors (returns a ./ b) */
+tensor_view *
+tensor_elem_div(tensor_view *a, tensor_view *b)
+{
+    return tensor_elementwise(a, b, ELEM_DIV);
+}
+
+
+/* compute the LP norm of the tensor */
+double
+tensor_lpnorm(tensor_view *t, double p)
+{
+    double result = 0.0;
     int nnz;
+    int i;
+    sptensor *tns;
+    symmetric_tensor *stns;
+    double *val;
+    double m;
+
+    /* sparse and dense tensors reduce their value arrays directly */
+    tns = sptensor_view_data(t);
+    if(tns) {
+	return dense_lpnorm(tns->ar->size, (double*) tns->ar->ar, p);
+    }
+    val = dense_tensor_elements(t);
+    if(val) {
+	nnz = 1;
+	for(i=0; i<t->nmodes; i++) {
+	    nnz *= t->dim[i];
+	}
+	return dense_lpnorm(nnz, val, p);
+    }
 
-    /* allocate the index */
-    idx = malloc(sizeof(sp_index_t) * a->nmodes);
+    /* 
+     * Symmetric tensors weight each representative by its permutations.
+     * A representative x with multiplicity m adds m|x|^p = |m^(1/p) x|^p,
+     * so the scaled representatives go through the dense kernels.  The
+     * largest entry is simply the largest representative.
+     */
+    stns = tensor_view_symmetric(t);
+    if(stns) {
+	nnz = stns->tns->ar->size;
+	val = malloc(sizeof(double) * (nnz ? nnz : 1));
+	for(i=0; i<nnz; i++) {
+	    val[i] = VVAL(double, stns->tns->ar, i);
+	    if(p == HUGE_VAL) continue;
+	    m = symmetric_tensor_multiplicity(t, VPTR(stns->tns->idx, i));
+	    val[i] *= p == 1.0 ? m : p == 2.0 ? sqrt(m) : pow(m, 1.0/p);
+	}
+	result = dense_lpnorm(nnz, val, p);
+	free(val);
+	return result;
+    }
 
-    /* modify all the elements */
-    nnz = TVNNZ(b);
+    /* gather the nonzero values of any other view */
+    nnz = TVNNZ(t);
+    val = malloc(sizeof(double) * (nnz ? nnz : 1));
     for(i=0; i<nnz; i++) {
-	TVIDX(b, i, idx);
-	TVSET(a, idx, TVGET(a,idx)+TVGETI(b,i));
+	val[i] = TVGETI(t, i);
     }
+    result = dense_lpnorm(nnz, val, p);
 
-    /* cleanup */
-    free(idx);
+    /* cleanup and return */
+    free(val);
+    return result;
 }
 
 
-/* inplace subtraction of two tensors (a-=b) */
-void
-tensor_decrease(tensor_view *a, tensor_view *b)
+/***************************************
+ * Static Functions
+ ***************************************/
+
+/*
+ * Merge two sorted sparse tensors into result (result = a + s*b), where
+ * s is 1 or -1.  Both index lists are walked once and the output is 
+ * appended in order, so entries which cancel are dropped as they are 
+ * produced.  result must be empty.
+ */
+static void
+sptensor_merge(sptensor *result, sptensor *a, sptensor *b, double s)
+{
+    unsigned int i, j;      /* positions in a and b */
+    unsigned int na, nb;    /* the number of nonzeros in each */
+    int cmp;
+    double *aval, *bval;
+
+    na = a->ar->size;
+    nb = b->ar->size;
+    aval = (double*) a->ar->ar;
+    bval = (double*) b->ar->ar;
+    sptensor_reserve(result, na + nb);
+
+    i = j = 0;
+    while(i < na && j < nb) {
+	cmp = sptensor_indexcmp(a->nmodes, VPTR(a->idx, i), VPTR(b->idx, j));
+	if(cmp < 0) {
+	    sptensor_append(result, VPTR(a->idx, i), aval[i]);
+	    i++;
+	} else if(cmp > 0) {
+	    sptensor_append(result, VPTR(b->idx, j), s * bval[j]);
+	    j++;
+	} else {
+	    sptensor_append(result, VPTR(a->idx, i), aval[i] + s * bval[j]);
+	    i++;
+	    j++;
+	}
+    }
+
+    /* the tails of either list */
+    for(; i < na; i++) {
+	sptensor_append(result, VPTR(a->idx, i), aval[i]);
+    }
+    for(; j < nb; j++) {
+	sptensor_append(result, VPTR(b->idx, j), s * bval[j]);
+    }
+}
+
+
+/* 
+ * a += s*b.  When a is stored in an sptensor, b is merged with it in one
+ * pass (copying b in order first if it is some other kind of view).  Any
+ * other a is updated one element at a time.
+ */
+static void
+tensor_merge_into(tensor_view *a, tensor_view *b, double s)
 {
+    sptensor *sa, *sb;
+    sptensor *merged;
+    tensor_view *bc = NULL;
+    vector *tmp;
     sp_index_t *idx;
     int i;
     int nnz;
 
+    sa = sptensor_view_data(a);
+    if(sa) {
+	sb = sptensor_view_data(b);
+	if(!sb) {
+	    bc = tensor_alloc_cpy(b);
+	    sb = sptensor_view_data(bc);
+	}
+
+	/* merge, then swap the merged lists into a */
+	merged = sptensor_alloc(sa->nmodes, sa->dim);
+	sptensor_merge(merged, sa, sb, s);
+	tmp = sa->ar;
+	sa->ar = merged->ar;
+	merged->ar = tmp;
+	tmp = sa->idx;
+	sa->idx = merged->idx;
+	merged->idx = tmp;
+	sptensor_free(merged);
+
+	if(bc) {
+	    TVFREE(bc);
+	}
+	return;
+    }
+
     /* allocate the index */
     idx = malloc(sizeof(sp_index_t) * a->nmodes);
 
@@ -148,7 +418,7 @@ tensor_decrease(tensor_view *a, tensor_view *b)
     nnz = TVNNZ(b);
     for(i=0; i<nnz; i++) {
 	TVIDX(b, i, idx);
-	TVSET(a, idx, TVGET(a,idx)-TVGETI(b,i));
+	TVSET(a, idx, TVGET(a,idx) + s * TVGETI(b,i));
     }
 
     /* cleanup */
@@ -156,43 +426,407 @@ tensor_decrease(tensor_view *a, tensor_view *b)
 }
 
 
-/* inplace scaling of a tensor by a scalar (t*=s) */
-void
-tensor_scale(tensor_view *t, double s)
+/* returns a + s*b as a new tensor */
+static tensor_view *
+tensor_merge_alloc(tensor_view *a, tensor_view *b, double s)
 {
+    tensor_view *result;
+    sptensor *sa, *sb;
+
+    /* merge sparse tensors straight into the result */
+    sa = sptensor_view_data(a);
+    sb = sptensor_view_data(b);
+    if(sa && sb) {
+	result = tensor_alloc(a->nmodes, a->dim);
+	sptensor_merge(sptensor_view_data(result), sa, sb, s);
+	return result;
+    }
+
+    /* copy a, then merge b into the copy */
+    result = tensor_alloc_cpy(a);
+    tensor_merge_into(result, b, s);
+    return result;
+}
+
+
+/*
+ * Elementwise product or quotient of a and b.  Only the nonzeros of the
+ * sparse operands are visited: two sparse tensors are intersected by 
+ * walking the one with fewer nonzeros and galloping through the other,
+ * and a sparse tensor with a dense one is evaluated as a mask over the
+ * dense elements.  The walked nonzeros are divided into ranges which run
+ * on separate threads, and the results are concatenated in order.
+ */
+static tensor_view *
+tensor_elementwise(tensor_view *a, tensor_view *b, int op)
+{
+    tensor_view *result;
+    sptensor *sa, *sb;
+    sptensor *ca = NULL, *cb = NULL;
+    double *da, *db;
+    struct elem_task *task;
+    struct elem_job job;
+    sptensor *tns;
+    unsigned long nparts, maxparts;
+    unsigned int i, n, nnz;
+
+    result = tensor_alloc(a->nmodes, a->dim);
+    tns = sptensor_view_data(result);
+
+    /* find the storage of each operand, copying other views */
+    da = dense_tensor_elements(a);
+    db = dense_tensor_elements(b);
+    if(da && db) {
+	elem_dense(tns, da, db, a->dim, a->nmodes, op);
+	return result;
+    }
+    sa = sptensor_view_data(a);
+    sb = sptensor_view_data(b);
+    if(!sa && !da) {
+	sa = ca = tensor_view_sptensor(a);
+    }
+    if(!sb && !db) {
+	sb = cb = tensor_view_sptensor(b);
+    }
+
+    /* walk the sparse operand with fewer nonzeros */
+    task = &job.task;
+    task->op = op;
+    task->d = NULL;
+    task->t = NULL;
+    if(!sb || (sa && sa->ar->size <= sb->ar->size)) {
+	task->left = 1;
+	task->s = sa;
+	task->t = sb;
+	task->d = db;
+    } else {
+	task->left = 0;
+	task->s = sb;
+	task->t = sa;
+	task->d = da;
+    }
+
+    /* 
+     * Cut the walked nonzeros into chunks of at least ELEM_GRAIN, a few 
+     * per thread, which the threads take as they become free.  Each chunk
+     * has its own output, and they are put together in order.
+     */
+    nnz = task->s->ar->size;
+    maxparts = parallel_threads() > 1 ? 
+	(unsigned long) parallel_threads() * ELEM_CHUNKS : 1;
+    nparts = nnz / ELEM_GRAIN;
+    if(nparts > maxparts) nparts = maxparts;
+    if(nparts < 1) nparts = 1;
+    job.chunk = (nnz + nparts - 1) / nparts;
+    if(job.chunk < 1) job.chunk = 1;
+    job.parts = malloc(sizeof(sptensor*) * nparts);
+    for(i=0; i<nparts; i++) {
+	job.parts[i] = i ? sptensor_alloc(a->nmodes, a->dim) : tns;
+    }
+    parallel_for(nnz, job.chunk, elem_chunk, &job);
+
+    /* concatenate the later chunks onto the first */
+    for(i=1; i<nparts; i++) {
+	n = job.parts[i]->ar->size;
+	sptensor_reserve(tns, tns->ar->size + n);
+	memcpy(VPTR(tns->idx, tns->idx->size), job.parts[i]->idx->ar,
+	       n * tns->idx->element_size);
+	memcpy(VPTR(tns->ar, tns->ar->size), job.parts[i]->ar->ar,
+	       n * sizeof(double));
+	tns->idx->size += n;
+	tns->ar->size += n;
+	sptensor_free(job.parts[i]);
+    }
+
+    /* cleanup and return */
+    if(ca) {
+	sptensor_free(ca);
+    }
+    if(cb) {
+	sptensor_free(cb);
+    }
+    free(job.parts);
+    return result;
+}
+
+
+/* one range of an elementwise product */
+static void *
+elem_range(void *arg)
+{
+    struct elem_task *task = (struct elem_task*) arg;
+    sptensor *s = task->s;
+    sptensor *t = task->t;
     sp_index_t *idx;
-    int i;
-    int nnz;
+    unsigned int i, j, q = 0;
+    unsigned long off;
+    double sv, ov;
+    double l, r;
+
+    for(i=task->first; i<task->last; i++) {
+	idx = VPTR(s->idx, i);
+	sv = VVAL(double, s->ar, i);
+
+	/* find the matching element of the other operand */
+	if(t) {
+	    q = elem_gallop(t, q, idx);
+	    if(q >= t->ar->size || 
+	       sptensor_indexcmp(s->nmodes, VPTR(t->idx, q), idx) != 0) {
+		continue;
+	    }
+	    ov = VVAL(double, t->ar, q);
+	} else {
+	    off = 0;
+	    for(j=0; j<s->nmodes; j++) {
+		off = off * s->dim[j] + idx[j] - 1;
+	    }
+	    ov = task->d[off];
+	}
+
+	/* combine them, leaving out the quotients by zero */
+	l = task->left ? sv : ov;
+	r = task->left ? ov : sv;
+	if(task->op == ELEM_MUL) {
+	    sptensor_append(task->result, idx, l * r);
+	} else if(r != 0.0) {
+	    sptensor_append(task->result, idx, l / r);
+	}
+    }
 
-    /* allocate the index */
-    idx = malloc(sizeof(sp_index_t) * t->nmodes);
+    return NULL;
+}
 
-    /* modify all the elements */
-    nnz = TVNNZ(t);
-    for(i=0; i<nnz; i++) {
-	TVIDX(t, i, idx);
-	TVSET(t, idx, TVGET(t,idx)*s);
+
+/* one chunk of an elementwise product, run by parallel_for */
+static void
+elem_chunk(void *arg, unsigned long first, unsigned long last,
+	   unsigned int thread)
+{
+    struct elem_job *job = (struct elem_job*) arg;
+    struct elem_task task;
+
+    (void) thread;
+    task = job->task;
+    task.first = first;
+    task.last = last;
+    task.result = job->parts[first / job->chunk];
+    elem_range(&task);
+}
+
+
+/*
+ * Find the first position at or after q where the index of t is not
+ * less than key.  The search doubles its step from q before bisecting,
+ * so it costs the log of the distance moved rather than of nnz(t).
+ */
+static unsigned int
+elem_gallop(sptensor *t, unsigned int q, sp_index_t *key)
+{
+    unsigned int n = t->ar->size;
+    unsigned int lo, hi, mid, step;
+
+    if(q >= n || sptensor_indexcmp(t->nmodes, VPTR(t->idx, q), key) >= 0) {
+	return q;
+    }
+
+    /* t[lo] < key, and t[hi] >= key (or hi == n) */
+    lo = q;
+    step = 1;
+    while(lo + step < n && 
+	  sptensor_indexcmp(t->nmodes, VPTR(t->idx, lo + step), key) < 0) {
+	lo += step;
+	step *= 2;
+    }
+    hi = lo + step < n ? lo + step : n;
+    while(hi - lo > 1) {
+	mid = lo + (hi - lo) / 2;
+	if(sptensor_indexcmp(t->nmodes, VPTR(t->idx, mid), key) < 0) {
+	    lo = mid;
+	} else {
+	    hi = mid;
+	}
+    }
+
+    return hi;
+}
+
+
+/* elementwise product or quotient of two dense tensors */
+static void
+elem_dense(sptensor *result, double *a, double *b, sp_index_t *dim,
+	   unsigned int nmodes, int op)
+{
+    sp_index_t *idx;
+    unsigned int i, n, j;
+    unsigned int rem;
+
+    n = 1;
+    for(i=0; i<nmodes; i++) {
+	n *= dim[i];
+    }
+
+    idx = malloc(sizeof(sp_index_t) * nmodes);
+    for(i=0; i<n; i++) {
+	if(a[i] == 0.0 || (op == ELEM_DIV && b[i] == 0.0)) {
+	    continue;
+	}
+	rem = i;
+	for(j=nmodes; j>0; j--) {
+	    idx[j-1] = rem % dim[j-1] + 1;
+	    rem /= dim[j-1];
+	}
+	sptensor_append(result, idx, op == ELEM_MUL ? a[i]*b[i] : a[i]/b[i]);
+    }
+
+    free(idx);
+}
+
+
+/*
+ * Apply one of the maps to every stored element of t.  Sparse, symmetric,
+ * dense and block tensors are mapped directly in their value arrays, and
+ * any entries which become zero are dropped afterwards.  Other views
+ * gather their elements first and then write them back one at a time.
+ */
+static void
+tensor_apply(tensor_view *t, int op, double s, tensor_map_func f, void *arg)
+{
+    sptensor *tns;
+    symmetric_tensor *stns;
+    block_tensor *btns;
+    double *elem;
+    sp_index_t *idx;
+    double *val;
+    unsigned int i, n;
+
+    /* sparse tensors (and the representatives of symmetric ones) */
+    tns = sptensor_view_data(t);
+    stns = tensor_view_symmetric(t);
+    if(stns) {
+	tns = stns->tns;
+	stns->dirty = 1;
+    }
+    if(tns) {
+	values_apply((double*) tns->ar->ar, tns->ar->size, op, s, f, arg);
+	sptensor_drop_zeros(tns);
+	return;
+    }
+
+    /* dense tensors map all of their elements */
+    elem = dense_tensor_elements(t);
+    if(elem) {
+	n = 1;
+	for(i=0; i<t->nmodes; i++) {
+	    n *= t->dim[i];
+	}
+	values_apply(elem, n, op, s, f, arg);
+	return;
+    }
+
+    /* block tensors map each tile, then drop the empty ones */
+    btns = tensor_view_block(t);
+    if(btns) {
+	for(i=0; i<btns->tiles->size; i++) {
+	    values_apply(VVAL(double*, btns->tiles, i), btns->tile_size, 
+			 op, s, f, arg);
+	}
+	block_tensor_refresh(t);
+	return;
+    }
+
+    /* gather every element before writing, since writes may move them */
+    n = TVNNZ(t);
+    idx = malloc(sizeof(sp_index_t) * t->nmodes * (n ? n : 1));
+    val = malloc(sizeof(double) * (n ? n : 1));
+    for(i=0; i<n; i++) {
+	TVIDX(t, i, idx + i * t->nmodes);
+	val[i] = map_value(TVGETI(t, i), op, s, f, arg);
+    }
+    for(i=0; i<n; i++) {
+	TVSET(t, idx + i * t->nmodes, val[i]);
     }
 
     /* cleanup */
     free(idx);
+    free(val);
 }
 
 
-/* compute the LP norm of the tensor */
-double
-tensor_lpnorm(tensor_view *t, double p)
+/* apply a map to n contiguous values, with one loop for each of the maps */
+static void
+values_apply(double *val, unsigned int n, int op, double s, 
+	     tensor_map_func f, void *arg)
 {
-    double result = 0.0;
-    int nnz;
-    int i;
+    unsigned int i;
+
+    switch(op) {
+    case MAP_SCALE:
+	for(i=0; i<n; i++) {
+	    val[i] *= s;
+	}
+	break;
+    case MAP_ABS:
+	for(i=0; i<n; i++) {
+	    val[i] = fabs(val[i]);
+	}
+	break;
+    case MAP_CLAMP:
+	for(i=0; i<n; i++) {
+	    val[i] = val[i] < 0.0 ? 0.0 : val[i];
+	}
+	break;
+    case MAP_THRESHOLD:
+	for(i=0; i<n; i++) {
+	    val[i] = fabs(val[i]) < s ? 0.0 : val[i];
+	}
+	break;
+    default:
+	for(i=0; i<n; i++) {
+	    val[i] = map_value(val[i], op, s, f, arg);
+	}
+    }
+}
 
-    /* sum the absolute values raised to the p power */
-    nnz = TVNNZ(t);
-    for(i=0; i<nnz; i++) {
-	result += pow(fabs(TVGETI(t, i)), p);
+
+/* apply a map to a single value */
+static double
+map_value(double x, int op, double s, tensor_map_func f, void *arg)
+{
+    switch(op) {
+    case MAP_SCALE:
+	return x * s;
+    case MAP_ABS:
+	return fabs(x);
+    case MAP_CLAMP:
+	return x < 0.0 ? 0.0 : x;
+    case MAP_THRESHOLD:
+	return fabs(x) < s ? 0.0 : x;
+    case MAP_POW:
+	return pow(x, s);
     }
+    return f(x, arg);
+}
 
-    /* return the norm */
-    return pow(result, 1.0/p);
+
+/* remove the entries of a sparse tensor which have been mapped to zero */
+static void
+sptensor_drop_zeros(sptensor *tns)
+{
+    unsigned int i, j;
+    double *val;
+
+    val = (double*) tns->ar->ar;
+    for(i=j=0; i<tns->ar->size; i++) {
+	if(fabs(val[i]) <= 1.0e-7) {
+	    continue;
+	}
+	if(i != j) {
+	    val[j] = val[i];
+	    memcpy(VPTR(tns->idx, j), VPTR(tns->idx, i), 
+		   tns->idx->element_size);
+	}
+	j++;
+    }
+    tns->ar->size = j;
+    tns->idx->size = j;
 }
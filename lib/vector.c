@@ -105,6 +105,47 @@ vector_grow(vector *v)
 }
 
 
+/*
+ * Make sure the vector has room for at least capacity elements.
+ *
+ * Parameters: v        - The vector to grow
+ *             capacity - The number of elements it must be able to hold
+ */
+void
+vector_reserve(vector *v, unsigned int capacity)
+{
+    void *ar;
+
+    /* nothing to do if we are already big enough */
+    if(v->capacity >= capacity) {
+	return;
+    }
+
+    /* allocate the new array and copy the contents */
+    ar = malloc(capacity * v->element_size);
+    memcpy(ar, v->ar, v->size * v->element_size);
+    free(v->ar);
+    v->ar = ar;
+    v->capacity = capacity;
+}
+
+
+/*
+ * Replace the contents of a vector with a copy of another vector's
+ * contents.  Both vectors must have the same element size.
+ *
+ * Parameters: v   - The vector to overwrite
+ *             src - The vector to copy
+ */
+void
+vector_assign(vector *v, vector *src)
+{
+    vector_reserve(v, src->size);
+    memcpy(v->ar, src->ar, src->size * src->element_size);
+    v->size = src->size;
+}
+
+
 /*
  * Append an item to the back of the vector, growing if needed.
  * 
@@ -162,7 +203,7 @@ void
 vector_remove(vector *v, unsigned int i)
 {
     /* shift everything back one position */
-    memcpy(VPTR(v, i), VPTR(v, i+1), (v->size - i - 1) * v->element_size);
+    memmove(VPTR(v, i), VPTR(v, i+1), (v->size - i - 1) * v->element_size);
     v->size--;
 }
 
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <math.h>
 #include <sptensor/view.h>
+#include <sptensor/binsearch.h>
 
 /********************************
  * generic tensor view functions 
@@ -192,10 +193,16 @@ tensor_view_sptensor(tensor_view *v)
     t = sptensor_alloc(v->nmodes, v->dim);
     nnz = TVNNZ(v);
 
-    /* copy elements */
+    /* copy elements, appending while they come in order */
+    sptensor_reserve(t, nnz);
     for(i=0; i<nnz; i++) {
 	TVIDX(v, i, idx);
-	sptensor_set(t, idx, TVGET(v, idx));
+	if(t->idx->size == 0 ||
+	   sptensor_indexcmp(t->nmodes, VPTR(t->idx, t->idx->size-1), idx) < 0) {
+	    sptensor_append(t, idx, TVGETI(v, i));
+	} else {
+	    sptensor_set(t, idx, TVGETI(v, i));
+	}
     }
 
     /* cleanup and return */
@@ -401,6 +408,17 @@ sptensor_view(sptensor *tns)
 }
 
 
+/* Returns the sptensor wrapped by an sptensor view */
+sptensor *
+sptensor_view_data(tensor_view *v)
+{
+    if(v->get_idx != sptensor_view_get_idx) {
+	return NULL;
+    }
+    return (sptensor *) v->data;
+}
+
+
 /* allocate an sptensor view and create a new sptensor to fill it.
    This uses the base free, which will deallocate the underlying sptensor
    when the view is freed.
@@ -481,17 +499,12 @@ dense_tensor_idx(tensor_view *v, unsigned int i, sp_index_t *idx)
     struct dense_tensor *dtns = (struct dense_tensor *) v->data;
     int ui;
     int j;
-    int first = 1;
 
     /* find the ith non-zero element */
-    for(j=0; i>=0 && j<dtns->totalCount; j++) {
+    for(j=0; j<dtns->totalCount; j++) {
 	if(dtns->elem[j] != 0) {
-	    if(first) {
-		first = 0;
-		if(i == 0) break;
-	    } else {
-		i--;
-	    }
+	    if(i == 0) break;
+	    i--;
 	}
     }
 
@@ -508,17 +521,12 @@ dense_tensor_geti(tensor_view *v, unsigned int i)
 {
     struct dense_tensor *dtns = (struct dense_tensor *) v->data;
     int j;
-    int first = 1;
 
     /* find the ith non-zero element */
-    for(j=0; i>=0 && j<dtns->totalCount; j++) {
+    for(j=0; j<dtns->totalCount; j++) {
 	if(dtns->elem[j] != 0) {
-	    if(first) {
-		first = 0;
-		if(i == 0) break;
-	    } else {
-		i--;
-	    }
+	    if(i == 0) break;
+	    i--;
 	}
     }
 
@@ -610,13 +618,713 @@ dense_tensor_alloc(int nmodes, sp_index_t *dim)
     dtns->totalCount = v->dim[nmodes-1];
     for(i=nmodes-2; i>=0; i--) {
 	dtns->totalCount *= v->dim[i];
-	dtns->mul[i] = dtns->mul[i+1]*v->dim[i];
+	dtns->mul[i] = dtns->mul[i+1]*v->dim[i+1];
     }
     dtns->elem = calloc(dtns->totalCount, sizeof(double));
     return v;
 }
 
 
+/* Returns the elements of a dense tensor view */
+double *
+dense_tensor_elements(tensor_view *v)
+{
+    if(v->get_idx != dense_tensor_idx) {
+	return NULL;
+    }
+    return ((struct dense_tensor *) v->data)->elem;
+}
+
+
+
+/***************************************
+ * Block Sparse Tensor Representation/View
+ ***************************************/
+/* rebuild the prefix counts of the tile nonzeros */
+static void
+block_tensor_prefix(block_tensor *btns)
+{
+    unsigned int total = 0;
+    int t;
+
+    btns->tptr->size = 0;
+    vector_reserve(btns->tptr, btns->tnnz->size + 1);
+    for(t=0; t<btns->tnnz->size; t++) {
+	vector_push_back(btns->tptr, &total);
+	total += VVAL(unsigned int, btns->tnnz, t);
+    }
+    vector_push_back(btns->tptr, &total);
+    btns->stale = 0;
+}
+
+
+/* find the tile position (or where it should be) of an element index */
+static int
+block_tensor_find(tensor_view *v, sp_index_t *idx, unsigned int *offset)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    sp_index_t *bidx;
+    int i;
+    int ui;
+
+    /* split the index into block coordinate and tile offset */
+    bidx = TVIDX_ALLOC(v);
+    *offset = 0;
+    for(ui=0; ui<v->nmodes; ui++) {
+	bidx[ui] = (idx[ui]-1) / btns->bdim[ui] + 1;
+	*offset = *offset * btns->bdim[ui] + (idx[ui]-1) % btns->bdim[ui];
+    }
+
+    /* find the block */
+    i = vector_binsearch(btns->bidx, bidx, block_tensor_bincmp);
+    free(bidx);
+
+    return i;
+}
+
+
+/* locate the ith nonzero as a tile and an offset within that tile */
+static double *
+block_tensor_nth(tensor_view *v, unsigned int i, unsigned int *tile,
+		 unsigned int *offset)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    unsigned int *tptr;
+    unsigned int t, lo, hi;
+    unsigned int j;
+    double *elem;
+
+    /* binary search for the last tile starting at or before i */
+    if(btns->stale) {
+	block_tensor_prefix(btns);
+    }
+    tptr = (unsigned int*) btns->tptr->ar;
+    lo = 0;
+    hi = btns->tnnz->size;
+    while(hi - lo > 1) {
+	t = lo + (hi - lo) / 2;
+	if(tptr[t] <= i) {
+	    lo = t;
+	} else {
+	    hi = t;
+	}
+    }
+    t = lo;
+    i -= tptr[t];
+
+    /* find the ith nonzero within the tile */
+    elem = VVAL(double*, btns->tiles, t);
+    for(j=0; j<btns->tile_size; j++) {
+	if(elem[j] != 0.0) {
+	    if(i == 0) break;
+	    i--;
+	}
+    }
+
+    *tile = t;
+    *offset = j;
+    return elem;
+}
+
+
+static unsigned int
+block_tensor_nnz(tensor_view *v)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+
+    if(btns->stale) {
+	block_tensor_prefix(btns);
+    }
+    return VVAL(unsigned int, btns->tptr, btns->tptr->size-1);
+}
+
+
+static void
+block_tensor_idx(tensor_view *v, unsigned int i, sp_index_t *idx)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    sp_index_t *bidx;
+    unsigned int t, offset;
+    int ui;
+
+    /* find the element, then translate tile and offset into an index */
+    block_tensor_nth(v, i, &t, &offset);
+    bidx = (sp_index_t*) VPTR(btns->bidx, t);
+    for(ui=v->nmodes-1; ui>=0; ui--) {
+	idx[ui] = (bidx[ui]-1) * btns->bdim[ui] + offset % btns->bdim[ui] + 1;
+	offset /= btns->bdim[ui];
+    }
+}
+
+
+static double
+block_tensor_geti(tensor_view *v, unsigned int i)
+{
+    unsigned int t, offset;
+    double *elem;
+
+    elem = block_tensor_nth(v, i, &t, &offset);
+    return elem[offset];
+}
+
+
+static double
+block_tensor_get(tensor_view *v, sp_index_t *idx)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    unsigned int offset;
+    double *elem;
+    int i;
+
+    i = block_tensor_find(v, idx, &offset);
+    if(i < 0) {
+	return 0.0;
+    }
+    elem = VVAL(double*, btns->tiles, i);
+    return elem[offset];
+}
+
+
+static void
+block_tensor_insert(block_tensor *btns, int i, sp_index_t *bidx)
+{
+    double *elem;
+    unsigned int count = 0;
+
+    elem = calloc(btns->tile_size, sizeof(double));
+    vector_insert(btns->bidx, i, bidx);
+    vector_insert(btns->tiles, i, &elem);
+    vector_insert(btns->tnnz, i, &count);
+    btns->stale = 1;
+}
+
+
+static void
+block_tensor_remove(block_tensor *btns, int i)
+{
+    free(VVAL(double*, btns->tiles, i));
+    vector_remove(btns->bidx, i);
+    vector_remove(btns->tiles, i);
+    vector_remove(btns->tnnz, i);
+    btns->stale = 1;
+}
+
+
+static void
+block_tensor_set(tensor_view *v, sp_index_t *idx, double val)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    sp_index_t *bidx;
+    unsigned int offset;
+    unsigned int *count;
+    double *elem;
+    int i;
+    int ui;
+
+    i = block_tensor_find(v, idx, &offset);
+
+    /* zeroes never create a tile */
+    if(i < 0) {
+	if(val == 0.0) return;
+
+	bidx = TVIDX_ALLOC(v);
+	for(ui=0; ui<v->nmodes; ui++) {
+	    bidx[ui] = (idx[ui]-1) / btns->bdim[ui] + 1;
+	}
+	i = -(i+1);
+	block_tensor_insert(btns, i, bidx);
+	free(bidx);
+    }
+
+    /* write the value, keeping the tile count up to date */
+    elem = VVAL(double*, btns->tiles, i);
+    count = &VVAL(unsigned int, btns->tnnz, i);
+    if(elem[offset] != 0.0) (*count)--;
+    if(val != 0.0) (*count)++;
+    elem[offset] = val;
+    btns->stale = 1;
+
+    /* empty tiles are dropped */
+    if(*count == 0) {
+	block_tensor_remove(btns, i);
+    }
+}
+
+
+static void
+block_tensor_free(tensor_view *v)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    int i;
+
+    for(i=0; i<btns->tiles->size; i++) {
+	free(VVAL(double*, btns->tiles, i));
+    }
+    vector_free(btns->bidx);
+    vector_free(btns->tiles);
+    vector_free(btns->tnnz);
+    vector_free(btns->tptr);
+    free(btns->bdim);
+    free(btns);
+    free(v->dim);
+    free(v);
+}
+
+
+/* Create a block sparse tensor view */
+tensor_view *
+block_tensor_alloc(int nmodes, sp_index_t *dim, sp_index_t *bdim)
+{
+    tensor_view *v; /* the allocated view */
+    block_tensor *btns;
+    int i;
+
+    /* allocate and populate the view */
+    v = base_view_alloc();
+    v->dim = malloc(sizeof(sp_index_t) * nmodes);
+    memcpy(v->dim, dim, sizeof(sp_index_t) * nmodes);
+    v->nmodes = nmodes;
+    v->nnz = block_tensor_nnz;
+    v->get_idx = block_tensor_idx;
+    v->geti = block_tensor_geti;
+    v->get = block_tensor_get;
+    v->set = block_tensor_set;
+    v->to = dense_tensor_idxcpy;
+    v->from = dense_tensor_idxcpy;
+    v->tvfree = block_tensor_free;
+
+    /* set up the tile list */
+    btns = malloc(sizeof(block_tensor));
+    v->data = btns;
+    btns->bdim = malloc(sizeof(sp_index_t) * nmodes);
+    memcpy(btns->bdim, bdim, sizeof(sp_index_t) * nmodes);
+    btns->tile_size = 1;
+    for(i=0; i<nmodes; i++) {
+	btns->tile_size *= bdim[i];
+    }
+    btns->bidx = vector_alloc(sizeof(sp_index_t) * nmodes,
+			      SPTENSOR_DEFAULT_CAPACITY);
+    btns->tiles = vector_alloc(sizeof(double*), SPTENSOR_DEFAULT_CAPACITY);
+    btns->tnnz = vector_alloc(sizeof(unsigned int),
+			      SPTENSOR_DEFAULT_CAPACITY);
+    btns->tptr = vector_alloc(sizeof(unsigned int),
+			      SPTENSOR_DEFAULT_CAPACITY);
+    block_tensor_prefix(btns);
+
+    return v;
+}
+
+
+/* Returns the block tensor behind v, or NULL if v is not a block tensor */
+block_tensor *
+tensor_view_block(tensor_view *v)
+{
+    if(v->get_idx != block_tensor_idx) {
+	return NULL;
+    }
+    return (block_tensor *) v->data;
+}
+
+
+/* Returns the dense tile at block coordinate bidx */
+double *
+block_tensor_tile(tensor_view *v, sp_index_t *bidx, int create)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    int i;
+
+    i = vector_binsearch(btns->bidx, bidx, block_tensor_bincmp);
+    if(i < 0) {
+	if(!create) return NULL;
+	i = -(i+1);
+	block_tensor_insert(btns, i, bidx);
+    }
+
+    return VVAL(double*, btns->tiles, i);
+}
+
+
+/* Recount the nonzeros of each tile, dropping the tiles which are empty */
+void
+block_tensor_refresh(tensor_view *v)
+{
+    block_tensor *btns = (block_tensor *) v->data;
+    double *elem;
+    unsigned int count;
+    int i, j;
+
+    for(i=btns->tiles->size-1; i>=0; i--) {
+	elem = VVAL(double*, btns->tiles, i);
+	count = 0;
+	for(j=0; j<btns->tile_size; j++) {
+	    if(elem[j] != 0.0) {
+		count++;
+	    }
+	}
+
+	if(count) {
+	    VVAL(unsigned int, btns->tnnz, i) = count;
+	} else {
+	    block_tensor_remove(btns, i);
+	}
+    }
+    block_tensor_prefix(btns);
+}
+
+
+/* Compare two block coordinates */
+int
+block_tensor_bincmp(int element_size, void *a, void *b)
+{
+    return sptensor_indexcmp(element_size / sizeof(sp_index_t), a, b);
+}
+
+
+
+/***************************************
+ * Symmetric Tensor
+ ***************************************/
+
+/* gather the symmetric indexes of idx in nondecreasing order */
+static void
+symmetric_tensor_gather(symmetric_tensor *stns, unsigned int nmodes,
+			sp_index_t *idx, sp_index_t *s)
+{
+    unsigned int i, j, k;
+    sp_index_t x;
+
+    /* insertion sort (there are never many symmetric modes) */
+    k = 0;
+    for(i=0; i<nmodes; i++) {
+	if(!stns->sym[i]) continue;
+	x = idx[i];
+	for(j=k; j>0 && s[j-1] > x; j--) {
+	    s[j] = s[j-1];
+	}
+	s[j] = x;
+	k++;
+    }
+}
+
+
+/* write the symmetric indexes in s back into idx */
+static void
+symmetric_tensor_scatter(symmetric_tensor *stns, unsigned int nmodes,
+			 sp_index_t *s, sp_index_t *idx)
+{
+    unsigned int i, k;
+
+    k = 0;
+    for(i=0; i<nmodes; i++) {
+	if(stns->sym[i]) {
+	    idx[i] = s[k++];
+	}
+    }
+}
+
+
+/* rearrange s into its next lexicographic permutation (0 if it was last) */
+static int
+symmetric_tensor_next_perm(sp_index_t *s, unsigned int n)
+{
+    int i, j;
+    sp_index_t x;
+
+    /* find the rightmost ascent */
+    for(i=(int)n-2; i>=0 && s[i] >= s[i+1]; i--);
+    if(i < 0) return 0;
+
+    /* swap with the rightmost larger element, then reverse the tail */
+    for(j=n-1; s[j] <= s[i]; j--);
+    x = s[i]; s[i] = s[j]; s[j] = x;
+    for(i++, j=n-1; i<j; i++, j--) {
+	x = s[i]; s[i] = s[j]; s[j] = x;
+    }
+    return 1;
+}
+
+
+/*
+ * Rearrange the sorted s into its rth lexicographic permutation, where
+ * count is the number of distinct permutations of s.  Each position
+ * takes the smallest remaining value whose permutations of the rest
+ * reach past r, so this takes O(n^2) steps rather than r.
+ */
+static void
+symmetric_tensor_unrank(sp_index_t *s, unsigned int n, unsigned long r,
+			unsigned long count)
+{
+    unsigned int p, j, k, run;
+    unsigned long c;
+    sp_index_t x;
+
+    for(p=0; p+1<n; p++) {
+	/* s[p..n-1] is sorted, try each distinct value in turn */
+	for(j=p; j<n; j+=run) {
+	    for(run=1; j+run<n && s[j+run] == s[j]; run++);
+	    c = count * run / (n-p);
+	    if(r < c) break;
+	    r -= c;
+	}
+
+	/* move it to the front, keeping the rest sorted */
+	x = s[j];
+	for(k=j; k>p; k--) {
+	    s[k] = s[k-1];
+	}
+	s[p] = x;
+	count = c;
+    }
+}
+
+
+/* translate idx into the index of its stored representative */
+static void
+symmetric_tensor_canon(tensor_view *v, sp_index_t *in, sp_index_t *out)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    sp_index_t *s;
+
+    s = TVIDX_ALLOC(v);
+    memmove(out, in, sizeof(sp_index_t) * v->nmodes);
+    symmetric_tensor_gather(stns, v->nmodes, in, s);
+    symmetric_tensor_scatter(stns, v->nmodes, s, out);
+    free(s);
+}
+
+
+/* The number of distinct permutations of the symmetric modes of idx */
+unsigned int
+symmetric_tensor_multiplicity(tensor_view *v, sp_index_t *idx)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    sp_index_t *s;
+    unsigned int result = 1;
+    unsigned int run = 1;
+    int i;
+
+    /* k!/(c1! c2! ...) where the c's are the lengths of repeated runs */
+    s = TVIDX_ALLOC(v);
+    symmetric_tensor_gather(stns, v->nmodes, idx, s);
+    for(i=1; i<stns->nsym; i++) {
+	if(s[i] == s[i-1]) {
+	    run++;
+	} else {
+	    run = 1;
+	}
+	result = result * (i+1) / run;
+    }
+    free(s);
+
+    return result;
+}
+
+
+/* make sure the expanded positions of the representatives are current */
+static void
+symmetric_tensor_update(tensor_view *v)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    unsigned int n;
+    int i;
+
+    if(!stns->dirty) return;
+
+    n = stns->tns->ar->size;
+    free(stns->start);
+    stns->start = malloc(sizeof(unsigned int) * (n+1));
+    stns->start[0] = 0;
+    for(i=0; i<n; i++) {
+	stns->start[i+1] = stns->start[i] +
+	    symmetric_tensor_multiplicity(v, VPTR(stns->tns->idx, i));
+    }
+    stns->dirty = 0;
+}
+
+
+/* find the representative of the ith expanded element */
+static unsigned int
+symmetric_tensor_find(tensor_view *v, unsigned int i)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    unsigned int left, right, mid;
+
+    symmetric_tensor_update(v);
+
+    /* the last representative which starts at or before i */
+    left = 0;
+    right = stns->tns->ar->size;
+    while(right - left > 1) {
+	mid = (left + right) / 2;
+	if(stns->start[mid] <= i) {
+	    left = mid;
+	} else {
+	    right = mid;
+	}
+    }
+
+    return left;
+}
+
+
+static unsigned int
+symmetric_tensor_nnz(tensor_view *v)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+
+    symmetric_tensor_update(v);
+    return stns->start[stns->tns->ar->size];
+}
+
+
+static void
+symmetric_tensor_idx(tensor_view *v, unsigned int i, sp_index_t *idx)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    unsigned int j;
+    sp_index_t *s;
+
+    /* start with the representative */
+    j = symmetric_tensor_find(v, i);
+    memcpy(idx, VPTR(stns->tns->idx, j), stns->tns->idx->element_size);
+
+    /* go straight to the permutation we want */
+    s = TVIDX_ALLOC(v);
+    symmetric_tensor_gather(stns, v->nmodes, idx, s);
+    symmetric_tensor_unrank(s, stns->nsym, i - stns->start[j],
+			    stns->start[j+1] - stns->start[j]);
+    symmetric_tensor_scatter(stns, v->nmodes, s, idx);
+    free(s);
+}
+
+
+static double
+symmetric_tensor_geti(tensor_view *v, unsigned int i)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+
+    return VVAL(double, stns->tns->ar, symmetric_tensor_find(v, i));
+}
+
+
+static double
+symmetric_tensor_get(tensor_view *v, sp_index_t *idx)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    sp_index_t *cidx;
+    double result;
+
+    cidx = TVIDX_ALLOC(v);
+    symmetric_tensor_canon(v, idx, cidx);
+    result = sptensor_get(stns->tns, cidx);
+    free(cidx);
+
+    return result;
+}
+
+
+static void
+symmetric_tensor_set(tensor_view *v, sp_index_t *idx, double val)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    sp_index_t *cidx;
+
+    cidx = TVIDX_ALLOC(v);
+    symmetric_tensor_canon(v, idx, cidx);
+    sptensor_set(stns->tns, cidx, val);
+    stns->dirty = 1;
+    free(cidx);
+}
+
+
+static void
+symmetric_tensor_free(tensor_view *v)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+
+    sptensor_free(stns->tns);
+    free(stns->sym);
+    free(stns->start);
+    free(stns);
+    free(v);
+}
+
+
+/* Create a symmetric tensor view */
+tensor_view *
+symmetric_tensor_alloc(int nmodes, sp_index_t *dim, int *sym)
+{
+    tensor_view *v;
+    symmetric_tensor *stns;
+    int i;
+
+    /* set up the representative storage */
+    stns = malloc(sizeof(symmetric_tensor));
+    stns->tns = sptensor_alloc(nmodes, dim);
+    stns->sym = malloc(sizeof(int) * nmodes);
+    stns->nsym = 0;
+    for(i=0; i<nmodes; i++) {
+	stns->sym[i] = sym ? sym[i] : 1;
+	if(stns->sym[i]) {
+	    stns->nsym++;
+	}
+    }
+    stns->start = NULL;
+    stns->dirty = 1;
+
+    /* allocate and populate the view */
+    v = base_view_alloc();
+    v->data = stns;
+    v->dim = stns->tns->dim;
+    v->nmodes = nmodes;
+    v->nnz = symmetric_tensor_nnz;
+    v->get_idx = symmetric_tensor_idx;
+    v->geti = symmetric_tensor_geti;
+    v->get = symmetric_tensor_get;
+    v->set = symmetric_tensor_set;
+    v->to = dense_tensor_idxcpy;
+    v->from = dense_tensor_idxcpy;
+    v->tvfree = symmetric_tensor_free;
+
+    return v;
+}
+
+
+/* Step idx to the next permutation of its symmetric modes */
+int
+symmetric_tensor_next(tensor_view *v, sp_index_t *idx)
+{
+    symmetric_tensor *stns = (symmetric_tensor *) v->data;
+    sp_index_t *s;
+    unsigned int i, k;
+    int result;
+
+    /* the symmetric indexes in mode order (not sorted) */
+    s = TVIDX_ALLOC(v);
+    for(i=0, k=0; i<v->nmodes; i++) {
+	if(stns->sym[i]) {
+	    s[k++] = idx[i];
+	}
+    }
+    result = symmetric_tensor_next_perm(s, stns->nsym);
+    symmetric_tensor_scatter(stns, v->nmodes, s, idx);
+    free(s);
+
+    return result;
+}
+
+
+/* Returns the symmetric tensor behind v, or NULL if v is not symmetric */
+symmetric_tensor *
+tensor_view_symmetric(tensor_view *v)
+{
+    if(v->get_idx != symmetric_tensor_idx) {
+	return NULL;
+    }
+    return (symmetric_tensor *) v->data;
+}
+
+
 
 /***************************************
  * Identity Tensor
@@ -707,6 +1415,341 @@ identity_tensor(int nmodes, sp_index_t *dim)
 
 
 
+/***************************************
+ * Khatri-Rao Product View
+ ***************************************/
+struct khatri_rao {
+    tensor_view **u;       /* the factor matrices */
+    unsigned int count;    /* the number of factor matrices */
+    unsigned int **colptr; /* start of each column's nonzeros (per factor) */
+    sp_index_t **rows;     /* nonzero rows, grouped by column (per factor) */
+    double **vals;         /* nonzero values, grouped by column (per factor) */
+    unsigned int *start;   /* result nonzeros before each column */
+};
+
+
+static unsigned int
+khatri_rao_nnz(tensor_view *v)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+
+    return kr->start[v->dim[1]];
+}
+
+
+/* find the column and the nonzero of each factor for the ith nonzero */
+static sp_index_t
+khatri_rao_locate(tensor_view *v, unsigned int i, unsigned int *pos)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+    sp_index_t r;
+    unsigned int n;
+    int k;
+
+    /* find the column */
+    for(r=0; kr->start[r+1] <= i; r++);
+    i -= kr->start[r];
+
+    /* decode the position within each factor's column (last is fastest) */
+    for(k=kr->count-1; k>=0; k--) {
+	n = kr->colptr[k][r+1] - kr->colptr[k][r];
+	pos[k] = kr->colptr[k][r] + i % n;
+	i /= n;
+    }
+
+    return r;
+}
+
+
+static void
+khatri_rao_idx(tensor_view *v, unsigned int i, sp_index_t *idx)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+    unsigned int *pos;
+    int k;
+
+    pos = malloc(sizeof(unsigned int) * kr->count);
+    idx[1] = khatri_rao_locate(v, i, pos) + 1;
+    idx[0] = 0;
+    for(k=0; k<kr->count; k++) {
+	idx[0] = idx[0] * kr->u[k]->dim[0] + kr->rows[k][pos[k]] - 1;
+    }
+    idx[0]++;
+    free(pos);
+}
+
+
+static double
+khatri_rao_geti(tensor_view *v, unsigned int i)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+    unsigned int *pos;
+    double result = 1.0;
+    int k;
+
+    pos = malloc(sizeof(unsigned int) * kr->count);
+    khatri_rao_locate(v, i, pos);
+    for(k=0; k<kr->count; k++) {
+	result *= kr->vals[k][pos[k]];
+    }
+    free(pos);
+
+    return result;
+}
+
+
+static double
+khatri_rao_get(tensor_view *v, sp_index_t *idx)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+    sp_index_t uidx[2];
+    sp_index_t row;
+    double result = 1.0;
+    int k;
+
+    /* split the row into the rows of each factor */
+    row = idx[0] - 1;
+    uidx[1] = idx[1];
+    for(k=kr->count-1; k>=0 && result != 0.0; k--) {
+	uidx[0] = row % kr->u[k]->dim[0] + 1;
+	row /= kr->u[k]->dim[0];
+	result *= TVGET(kr->u[k], uidx);
+    }
+
+    return result;
+}
+
+
+static void
+khatri_rao_free(tensor_view *v)
+{
+    struct khatri_rao *kr = (struct khatri_rao *) v->data;
+    int k;
+
+    for(k=0; k<kr->count; k++) {
+	free(kr->colptr[k]);
+	free(kr->rows[k]);
+	free(kr->vals[k]);
+    }
+    free(kr->colptr);
+    free(kr->rows);
+    free(kr->vals);
+    free(kr->start);
+    free(kr->u);
+    free(kr);
+    free(v->dim);
+    free(v);
+}
+
+
+/* A lazy Khatri-Rao product of matrices */
+tensor_view *
+khatri_rao_view(tensor_view **u, unsigned int count)
+{
+    tensor_view *v;
+    struct khatri_rao *kr;
+    sp_index_t idx[2];
+    sp_index_t ncol;
+    unsigned int nnz, n;
+    unsigned int *cur;
+    int i, k, r;
+
+    /* allocate and populate the view */
+    ncol = u[0]->dim[1];
+    kr = malloc(sizeof(struct khatri_rao));
+    kr->count = count;
+    kr->u = malloc(sizeof(tensor_view*) * count);
+    memcpy(kr->u, u, sizeof(tensor_view*) * count);
+    v = base_view_alloc();
+    v->data = kr;
+    v->nmodes = 2;
+    v->dim = malloc(sizeof(sp_index_t) * 2);
+    v->dim[0] = 1;
+    v->dim[1] = ncol;
+    for(k=0; k<count; k++) {
+	v->dim[0] *= u[k]->dim[0];
+    }
+    v->nnz = khatri_rao_nnz;
+    v->get_idx = khatri_rao_idx;
+    v->geti = khatri_rao_geti;
+    v->get = khatri_rao_get;
+    v->set = 0x00;  /* products are immutable */
+    v->to = dense_tensor_idxcpy;
+    v->from = dense_tensor_idxcpy;
+    v->tvfree = khatri_rao_free;
+
+    /* group the nonzeros of each factor by column, sorted by row */
+    kr->colptr = malloc(sizeof(unsigned int*) * count);
+    kr->rows = malloc(sizeof(sp_index_t*) * count);
+    kr->vals = malloc(sizeof(double*) * count);
+    cur = malloc(sizeof(unsigned int) * (ncol+1));
+    for(k=0; k<count; k++) {
+	nnz = TVNNZ(u[k]);
+	kr->colptr[k] = calloc(ncol+1, sizeof(unsigned int));
+	kr->rows[k] = malloc(sizeof(sp_index_t) * (nnz+1));
+	kr->vals[k] = malloc(sizeof(double) * (nnz+1));
+	for(i=0; i<nnz; i++) {
+	    TVIDX(u[k], i, idx);
+	    kr->colptr[k][idx[1]]++;
+	}
+	for(r=0; r<ncol; r++) {
+	    kr->colptr[k][r+1] += kr->colptr[k][r];
+	}
+	memcpy(cur, kr->colptr[k], sizeof(unsigned int) * (ncol+1));
+	for(i=0; i<nnz; i++) {
+	    TVIDX(u[k], i, idx);
+	    n = cur[idx[1]-1]++;
+
+	    /* insertion keeps each column sorted by row */
+	    for(; n > kr->colptr[k][idx[1]-1] && kr->rows[k][n-1] > idx[0]; n--) {
+		kr->rows[k][n] = kr->rows[k][n-1];
+		kr->vals[k][n] = kr->vals[k][n-1];
+	    }
+	    kr->rows[k][n] = idx[0];
+	    kr->vals[k][n] = TVGET(u[k], idx);
+	}
+    }
+    free(cur);
+
+    /* count the nonzeros of each column of the result */
+    kr->start = malloc(sizeof(unsigned int) * (ncol+1));
+    kr->start[0] = 0;
+    for(r=0; r<ncol; r++) {
+	nnz = 1;
+	for(k=0; k<count; k++) {
+	    nnz *= kr->colptr[k][r+1] - kr->colptr[k][r];
+	}
+	kr->start[r+1] = kr->start[r] + nnz;
+    }
+
+    return v;
+}
+
+
+
+/***************************************
+ * Kronecker Product View
+ ***************************************/
+
+/* split an index of the product into the indexes of a and b */
+static void
+kronecker_split(tensor_view *v, sp_index_t *idx, sp_index_t *aidx,
+		sp_index_t *bidx)
+{
+    tensor_view **f = (tensor_view **) v->data;
+    int i;
+
+    for(i=0; i<v->nmodes; i++) {
+	aidx[i] = (idx[i]-1) / f[1]->dim[i] + 1;
+	bidx[i] = (idx[i]-1) % f[1]->dim[i] + 1;
+    }
+}
+
+
+static unsigned int
+kronecker_nnz(tensor_view *v)
+{
+    tensor_view **f = (tensor_view **) v->data;
+
+    return TVNNZ(f[0]) * TVNNZ(f[1]);
+}
+
+
+static void
+kronecker_idx(tensor_view *v, unsigned int i, sp_index_t *idx)
+{
+    tensor_view **f = (tensor_view **) v->data;
+    sp_index_t *aidx, *bidx;
+    unsigned int bnnz;
+    int j;
+
+    aidx = TVIDX_ALLOC(v);
+    bidx = TVIDX_ALLOC(v);
+    bnnz = TVNNZ(f[1]);
+    TVIDX(f[0], i / bnnz, aidx);
+    TVIDX(f[1], i % bnnz, bidx);
+    for(j=0; j<v->nmodes; j++) {
+	idx[j] = (aidx[j]-1) * f[1]->dim[j] + bidx[j];
+    }
+    free(aidx);
+    free(bidx);
+}
+
+
+static double
+kronecker_geti(tensor_view *v, unsigned int i)
+{
+    tensor_view **f = (tensor_view **) v->data;
+    unsigned int bnnz;
+
+    bnnz = TVNNZ(f[1]);
+    return TVGETI(f[0], i / bnnz) * TVGETI(f[1], i % bnnz);
+}
+
+
+static double
+kronecker_get(tensor_view *v, sp_index_t *idx)
+{
+    tensor_view **f = (tensor_view **) v->data;
+    sp_index_t *aidx, *bidx;
+    double result;
+
+    aidx = TVIDX_ALLOC(v);
+    bidx = TVIDX_ALLOC(v);
+    kronecker_split(v, idx, aidx, bidx);
+    result = TVGET(f[0], aidx);
+    if(result != 0.0) {
+	result *= TVGET(f[1], bidx);
+    }
+    free(aidx);
+    free(bidx);
+
+    return result;
+}
+
+
+static void
+kronecker_free(tensor_view *v)
+{
+    free(v->data);
+    free(v->dim);
+    free(v);
+}
+
+
+/* A lazy Kronecker product of two tensors */
+tensor_view *
+kronecker_view(tensor_view *a, tensor_view *b)
+{
+    tensor_view *v;
+    tensor_view **f;
+    int i;
+
+    f = malloc(sizeof(tensor_view*) * 2);
+    f[0] = a;
+    f[1] = b;
+
+    v = base_view_alloc();
+    v->data = f;
+    v->nmodes = a->nmodes;
+    v->dim = TVIDX_ALLOC(v);
+    for(i=0; i<v->nmodes; i++) {
+	v->dim[i] = a->dim[i] * b->dim[i];
+    }
+    v->nnz = kronecker_nnz;
+    v->get_idx = kronecker_idx;
+    v->geti = kronecker_geti;
+    v->get = kronecker_get;
+    v->set = 0x00;  /* products are immutable */
+    v->to = dense_tensor_idxcpy;
+    v->from = dense_tensor_idxcpy;
+    v->tvfree = kronecker_free;
+
+    return v;
+}
+
+
+
 /***************************************
  * Unfoleded Tensor View
  ***************************************/
@@ -798,7 +1841,7 @@ unfold_tensor(tensor_view *v, sp_index_t n)
     /* compute the dimensions and jk coeffecients */
     tv->dim[0] = v->dim[n];
     tv->dim[1] = 1;
-    uv->jk = malloc(sizeof(sp_index_t) * (v->nmodes - 1));
+    uv->jk = malloc(sizeof(sp_index_t) * v->nmodes);
     uv->jk[0]=1;
     k=1;
     for(i=0; i<v->nmodes; i++) {
@@ -33,12 +33,32 @@ double a_values[]={1,2,3,4,5};
 #define ANELEM ARSIZE(a_values)
 #define ANDIM ARSIZE(adim)
 
+/* a 2x2x2 core with every entry filled */
+sp_index_t cdim[] = {2, 2, 2};
+sp_index_t cidx_list[][3] = {{1,1,1},
+			     {2,1,1},
+			     {1,2,1},
+			     {2,2,1},
+			     {1,1,2},
+			     {2,1,2},
+			     {1,2,2},
+			     {2,2,2}};
+double c_values[]={1.0, 0.5, 0.25, 0.5, 0.5, 0.25, 0.5, 1.0};
+#define CNELEM ARSIZE(c_values)
+
 
 int main()
 {
     tensor_view *a;
     tensor_view *b;
+    tensor_view *c;
     ccd_result *result;
+    ccd_result *copy;
+    ccd_result *bad;
+    tensor_view *u0;
+    sp_index_t udim[2];
+    tensor_view *b2;
+    FILE *file;
     int i;
     double lambda[] = {0.33, 0.33, 0.33};
 
@@ -70,9 +90,63 @@ int main()
     printf("Iterations: %d\n", result->iter);
     printf("Final Error: %lf\n", result->final_error);
     printf("Fit: %lf\n", result->fit);
+    printf("Fit of iteration 1: %lf\n", result->fits[0]);
+    printf("ccd_fit: %lf\n", ccd_fit(result, a));
+    tensor_decrease(b, a);
+    printf("Fit by construction: %lf\n", 
+	   1.0 - tensor_lpnorm(b, 2.0)/tensor_lpnorm(a, 2.0));
+
+    /* run ccd again with a full core */
+    c = tensor_alloc(ANDIM, cdim);
+    for(i = 0; i < CNELEM; i++) {
+	TVSET(c, cidx_list[i], c_values[i]);
+    }
+    ccd_free(result);
+    TVFREE(b);
+    result = ccd_core(a, c, lambda, 100, 0.0);
+    b = ccd_construct(result);
+    printf("Constructed Tensor (full core)\n");
+    tensor_print(b, 2);
+    printf("\n\n");
+    printf("Iterations: %d\n", result->iter);
+    printf("Final Error: %lf\n", result->final_error);
+    printf("Fit: %lf\n", result->fit);
+    printf("ccd_fit: %lf\n", ccd_fit(result, a));
+
+    /* write the result out and read it back */
+    file = tmpfile();
+    ccd_write(file, result);
+    rewind(file);
+    copy = ccd_read(file);
+    fclose(file);
+    printf("\n\nRead back (full core)\n");
+    printf("Iterations: %d\n", copy->iter);
+    printf("Final Error: %lf\n", copy->final_error);
+    printf("Fit: %lf\n", copy->fit);
+    b2 = ccd_construct(copy);
+    printf("Construction matches: %s\n", 
+	   tensor_lpnorm(b2, 2.0) == tensor_lpnorm(b, 2.0) ? "yes" : "no");
+    TVFREE(b2);
+
+    /* a result whose factors don't fit its core can't be read back */
+    u0 = copy->u[0];
+    udim[0] = u0->dim[0];
+    udim[1] = u0->dim[1] + 1;
+    copy->u[0] = tensor_alloc(2, udim);
+    file = tmpfile();
+    ccd_write(file, copy);
+    rewind(file);
+    bad = ccd_read(file);
+    fclose(file);
+    printf("Mismatched factors rejected: %s\n", bad ? "no" : "yes");
+    if(bad) ccd_free(bad);
+    TVFREE(copy->u[0]);
+    copy->u[0] = u0;
+    ccd_free(copy);
 
     /* cleanup */
     TVFREE(a);
     TVFREE(b);
+    TVFREE(c);
     ccd_free(result);
 }
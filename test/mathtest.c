@@ -18,9 +18,11 @@
 
 */
 #include <stdio.h>
+#include <math.h>
 #include <sptensor/sptensor.h>
 
 #define ARSIZE(a) (sizeof(a)/sizeof(a[0]))
+#define BIGN 1001
 
 /* set up a couple of 3x2 tensors */
 sp_index_t adim[] = {3,2};
@@ -38,11 +40,68 @@ double b_values[] = {6, 7, 8};
 #define BNELEM ARSIZE(b_values)
 #define BNDIM ARSIZE(bdim)
 
+/* a symmetric 3x3x3 tensor (given by its representatives) */
+sp_index_t sdim[] = {3,3,3};
+sp_index_t sidx_list[][3] = {{1,1,1},
+			     {1,2,3},
+			     {2,2,3}};
+double s_values[] = {1, 2, 3};
+#define SNELEM ARSIZE(s_values)
+#define SNDIM ARSIZE(sdim)
+
+/* a 2x3x4 tensor to reduce */
+sp_index_t rdim[] = {2,3,4};
+#define RNDIM ARSIZE(rdim)
+
+
+/* a map for tensor_map */
+static double
+half(double x, void *arg)
+{
+    return x / 2;
+}
+
+
+/* a parallel loop body, setting x[i] = i */
+static void
+fill(void *arg, unsigned long first, unsigned long last, unsigned int thread)
+{
+    double *x = (double*) arg;
+
+    for(; first<last; first++) {
+	x[first] = first;
+    }
+}
+
+
+/* a parallel reduction body */
+static double
+sum_range(void *arg, unsigned long first, unsigned long last)
+{
+    return dense_sum(last - first, (double*) arg + first);
+}
+
+
+/* another parallel reduction body */
+static double
+max_range(void *arg, unsigned long first, unsigned long last)
+{
+    return dense_amax(last - first, (double*) arg + first);
+}
+
 
 int main()
 {
     tensor_view *a, *b;  /* primary tensor view */
     tensor_view *c;      /* another one for results */
+    tensor_view *s;      /* symmetric tensor */
+    tensor_view *u, *ut; /* a factor for s, and its transpose */
+    tensor_view *fu[3];  /* the factors of each mode of s */
+    tensor_view *tmp, *t; /* temporary results */
+    double *big;         /* a long array to reduce */
+    tensor_expr *e;      /* a lazy expression */
+    sp_index_t idx[3];   /* an index */
+    unsigned int modes[3]; /* modes to reduce */
     int i;
 
     /* build a and b */
@@ -77,6 +136,28 @@ int main()
     printf("\n\n");
     TVFREE(c);
 
+    /* test addition of a view which is not an sptensor */
+    printf("A+B^T^T\n");
+    s = tensor_transpose(b, 0, 1);
+    c = tensor_transpose(s, 0, 1);
+    tmp = tensor_add(a, c);
+    tensor_print(tmp, 0);
+    printf("\n\n");
+    TVFREE(tmp);
+    TVFREE(c);
+    TVFREE(s);
+
+    /* test inplace addition and subtraction */
+    printf("A+=B, A-=B\n");
+    c = tensor_view_deep_copy(a);
+    tensor_increase(c, b);
+    tensor_print(c, 0);
+    printf("\n");
+    tensor_decrease(c, b);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+
     /* test scalar multiplication */
     printf("3 * A\n");
     c = scalar_mul(a, 3);
@@ -91,11 +172,241 @@ int main()
     printf("\n\n");
     TVFREE(c);
 
+    /* test the elementwise maps */
+    c = tensor_sub(a, b);
+    tensor_abs(c);
+    printf("|A-B|\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    c = tensor_sub(a, b);
+    tensor_clamp(c);
+    printf("max(A-B, 0)\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    c = tensor_sub(a, b);
+    tensor_threshold(c, 6.5);
+    printf("A-B thresholded at 6.5\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    c = tensor_add(a, b);
+    tensor_pow(c, 2);
+    printf("(A+B)^2\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    tmp = tensor_view_deep_copy(a);
+    s = tensor_transpose(tmp, 0, 1);
+    tensor_map(s, half, NULL);
+    printf("(A^T)/2\n");
+    tensor_print(s, 1);
+    printf("\n\n");
+    TVFREE(s);
+    TVFREE(tmp);
+
     /* test the norms */
     for(i=1; i<=3; i++) {
 	printf("L-%d norm of A: %lf\n", i, tensor_lpnorm(a, i));
     }
+    printf("\n\n");
+
+    /* test elementwise products and quotients */
+    printf("A.*B\n");
+    c = tensor_hadamard(a, b);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    printf("A./B\n");
+    c = tensor_elem_div(a, b);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    tmp = dense_tensor_alloc(BNDIM, bdim);
+    for(i=0; i<BNELEM; i++) {
+	TVSET(tmp, bidx_list[i], b_values[i] + 1);
+    }
+    printf("A.*dense(B+1), dense(B+1).*A, A./dense(B+1), dense(B+1)./A\n");
+    c = tensor_hadamard(a, tmp);
+    tensor_print(c, 0);
+    printf("\n");
+    TVFREE(c);
+    c = tensor_hadamard(tmp, a);
+    tensor_print(c, 0);
+    printf("\n");
+    TVFREE(c);
+    c = tensor_elem_div(a, tmp);
+    tensor_print(c, 1);
+    printf("\n");
+    TVFREE(c);
+    c = tensor_elem_div(tmp, a);
+    tensor_print(c, 3);
+    printf("\n\n");
+    TVFREE(c);
+    TVFREE(tmp);
+
+    /* test lazy expressions */
+    e = expr_sub(expr_tensor(a), expr_scale(expr_tensor(b), 2));
+    printf("A-2B (lazy), L-2 norm %lf, sum %lf\n", expr_lpnorm(e, 2),
+	   expr_sum(e));
+    c = expr_eval(e);
+    tensor_print(c, 0);
+    printf("\n\n");
+    expr_free(e);
+    tmp = dense_tensor_alloc(ANDIM, adim);
+    for(i=0; i<ANELEM; i++) {
+	TVSET(tmp, aidx_list[i], a_values[i]);
+    }
+    s = tensor_transpose(c, 0, 1);
+    t = tensor_transpose(s, 0, 1);
+    e = expr_hadamard(expr_tensor(tmp), expr_map(expr_tensor(t), half, NULL));
+    printf("dense A .* (A-2B)^T^T/2 (lazy), L-1 norm %lf\n", 
+	   expr_lpnorm(e, 1));
+    u = expr_eval(e);
+    tensor_print(u, 1);
+    printf("\n\n");
+    expr_free(e);
+    TVFREE(u);
+    TVFREE(t);
+    TVFREE(s);
+    TVFREE(c);
+    TVFREE(tmp);
 
+    /* test the reductions on a longer array, and their scaling */
+    big = malloc(sizeof(double) * BIGN);
+    for(i=0; i<BIGN; i++) {
+	big[i] = (i % 7) - 3.0;
+    }
+    printf("sum %lf asum %lf nrm2 %lf amax %lf l3 %lf l2.5 %lf\n",
+	   dense_sum(BIGN, big), dense_asum(BIGN, big), 
+	   dense_nrm2(BIGN, big), dense_amax(BIGN, big),
+	   dense_lpnorm(BIGN, big, 3), dense_lpnorm(BIGN, big, 2.5));
+    for(i=0; i<BIGN; i++) {
+	big[i] *= 1e200;
+    }
+    printf("scaled nrm2 %lg l3 %lg\n", dense_nrm2(BIGN, big), 
+	   dense_lpnorm(BIGN, big, 3));
+    for(i=0; i<BIGN; i++) {
+	big[i] *= 1e-200;
+	big[i] *= 1e-200;
+    }
+    printf("scaled nrm2 %lg l-inf %lg\n", dense_nrm2(BIGN, big), 
+	   dense_lpnorm(BIGN, big, HUGE_VAL));
+    printf("\n\n");
+    free(big);
+
+    /* test the thread pool */
+    big = malloc(sizeof(double) * BIGN);
+    for(i=1; i<=4; i*=4) {
+	sptensor_set_threads(i);
+	parallel_for(BIGN, 0, fill, big);
+	printf("%d threads: sum %lf, max %lf\n", i,
+	       parallel_reduce(BIGN, 100, sum_range, big, PARALLEL_SUM),
+	       parallel_reduce(BIGN, 10, max_range, big, PARALLEL_MAX));
+    }
+    sptensor_set_threads(1);
+    printf("\n\n");
+    free(big);
+
+    /* test symmetric storage */
+    s = symmetric_tensor_alloc(SNDIM, sdim, NULL);
+    for(i=0; i<SNELEM; i++) {
+	TVSET(s, sidx_list[i], s_values[i]);
+    }
+    printf("S\n");
+    tensor_print(s, 0);
+    printf("\n\n");
+    c = tensor_view_deep_copy(s);
+    printf("Expanded nnz of S: %u\n", TVNNZ(s));
+    printf("L-2 norm of S: %lf (expanded %lf)\n",
+	   tensor_lpnorm(s, 2), tensor_lpnorm(c, 2));
+    printf("L-1 norm of S: %lf (expanded %lf)\n",
+	   tensor_lpnorm(s, 1), tensor_lpnorm(c, 1));
+    printf("L-3 norm of S: %lf (expanded %lf)\n",
+	   tensor_lpnorm(s, 3), tensor_lpnorm(c, 3));
+    printf("L-inf norm of S: %lf (expanded %lf)\n",
+	   tensor_lpnorm(s, HUGE_VAL), tensor_lpnorm(c, HUGE_VAL));
+    tensor_scale(s, 2);
+    printf("2 * S\n");
+    tensor_print(s, 0);
+    printf("\n\n");
+
+    /* products of S work on the representatives */
+    u = tensor_alloc(2, adim);
+    for(i=0; i<ANELEM; i++) {
+	TVSET(u, aidx_list[i], a_values[i]);
+    }
+    tmp = tensor_view_deep_copy(s);
+    ut = tensor_transpose(u, 0, 1);
+    t = nmode_product(0, s, ut);
+    printf("S x_0 A^T\n");
+    tensor_print(t, 0);
+    printf("\n\n");
+    TVFREE(t);
+    TVFREE(ut);
+    for(i=0; i<SNDIM; i++) {
+	fu[i] = u;
+    }
+    t = dense_tensor_alloc(2, adim);
+    mttkrp(s, fu, 1, t);
+    printf("mttkrp(S, 1)\n");
+    tensor_print(t, 0);
+    mttkrp(tmp, fu, 1, t);
+    printf("mttkrp(expanded S, 1)\n");
+    tensor_print(t, 0);
+    printf("\n\n");
+    TVFREE(t);
+    TVFREE(tmp);
+    TVFREE(u);
+    TVFREE(c);
+    TVFREE(s);
+
+    /* test the mode reductions on a 2x3x4 tensor */
+    c = tensor_alloc(RNDIM, rdim);
+    for(idx[0]=1; idx[0]<=rdim[0]; idx[0]++) {
+	for(idx[1]=1; idx[1]<=rdim[1]; idx[1]++) {
+	    for(idx[2]=1; idx[2]<=rdim[2]; idx[2]++) {
+		if((idx[0] + idx[1] + idx[2]) % 2) {
+		    TVSET(c, idx, 100*idx[0] + 10*idx[1] + idx[2]);
+		}
+	    }
+	}
+    }
+    s = tensor_transpose(c, 1, 2);
+    for(i=0; i<3; i++) {
+	printf("R reduced over mode 2 (op %d), and over mode 1 of R^T\n", i);
+	modes[0] = 2;
+	tmp = tensor_reduce(c, modes, 1, i);
+	tensor_print(tmp, 0);
+	printf("\n");
+	TVFREE(tmp);
+	modes[0] = 1;
+	tmp = tensor_reduce(s, modes, 1, i);
+	tensor_print(tmp, 0);
+	printf("\n\n");
+	TVFREE(tmp);
+    }
+    printf("R reduced over modes 0 and 2, and all modes\n");
+    modes[0] = 0;
+    modes[1] = 2;
+    modes[2] = 1;
+    tmp = tensor_reduce(c, modes, 2, TENSOR_REDUCE_SUM);
+    tensor_print(tmp, 0);
+    printf("\n");
+    TVFREE(tmp);
+    tmp = tensor_reduce(c, modes, 3, TENSOR_REDUCE_SUM);
+    tensor_print(tmp, 0);
+    printf("\n\n");
+    TVFREE(tmp);
+    printf("R reduced over mode 1\n");
+    modes[0] = 1;
+    tmp = tensor_reduce(c, modes, 1, TENSOR_REDUCE_SUM);
+    tensor_clprint(tmp);
+    printf("\n\n");
+    TVFREE(tmp);
+    TVFREE(s);
+    TVFREE(c);
 }
 
 
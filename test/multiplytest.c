@@ -59,6 +59,46 @@ double v2_values[] = {7.0, 11.0, 13.0};
 #define V2NDIM ARSIZE(v2dim)
 
 
+/* copy a tensor view into a block tensor with the given tiles */
+tensor_view *
+block_copy(tensor_view *v, sp_index_t *bdim)
+{
+    tensor_view *result;
+    sp_index_t *idx;
+    int i;
+
+    result = block_tensor_alloc(v->nmodes, v->dim, bdim);
+    idx = TVIDX_ALLOC(v);
+    for(i=0; i<TVNNZ(v); i++) {
+	TVIDX(v, i, idx);
+	TVSET(result, idx, TVGET(v, idx));
+    }
+    free(idx);
+
+    return result;
+}
+
+
+/* copy a tensor view into a dense tensor */
+tensor_view *
+dense_copy(tensor_view *v)
+{
+    tensor_view *result;
+    sp_index_t *idx;
+    int i;
+
+    result = dense_tensor_alloc(v->nmodes, v->dim);
+    idx = TVIDX_ALLOC(v);
+    for(i=0; i<TVNNZ(v); i++) {
+	TVIDX(v, i, idx);
+	TVSET(result, idx, TVGET(v, idx));
+    }
+    free(idx);
+
+    return result;
+}
+
+
 int main()
 {
     tensor_view *a;
@@ -66,8 +106,14 @@ int main()
     tensor_view *b;
     tensor_view *m1, *m2;
     tensor_view *v1, *v2;
-    tensor_view *c;
+    tensor_view *c, *d;
+    tensor_view *ba, *bu, *bm1, *bm2;
+    tensor_view *dm1, *dm2;
+    tensor_view *kr[2];
+    tensor_view *fu[3];
+    unsigned int cma[3], cmb[3];
     tensor_slice_spec *slice;
+    sp_index_t bdim[3];
     int i;
 
     /* build tensor a */
@@ -125,6 +171,98 @@ int main()
     tensor_print(b, 0);
     printf("\n\n");
 
+    /* dense and mixed products */
+    dm1 = dense_copy(m1);
+    dm2 = dense_copy(m2);
+    printf("dense m1 x dense m2\n");
+    c = matrix_product(dm1, dm2);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    printf("dense m1 x m2\n");
+    c = matrix_product(dm1, m2);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    printf("m1 x dense m2\n");
+    c = matrix_product(m1, dm2);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    TVFREE(dm1);
+    TVFREE(dm2);
+    dm1 = dense_copy(u);
+    for(i=0; i<ANDIM; i++) {
+	printf("A x_%d dense U\n", i);
+	c = nmode_product(i, a, dm1);
+	tensor_print(c, 0);
+	printf("\n\n");
+	TVFREE(c);
+    }
+    TVFREE(dm1);
+
+    /* block sparse products */
+    bdim[0] = bdim[1] = bdim[2] = 2;
+    ba = block_copy(a, bdim);
+    bu = block_copy(u, bdim);
+    for(i=0; i<ANDIM; i++) {
+	printf("block A x_%d U\n", i);
+	c = nmode_product(i, ba, bu);
+	tensor_print(c, 0);
+	printf("\n\n");
+	TVFREE(c);
+    }
+    bdim[0] = 1;
+    bm1 = block_copy(m1, bdim);
+    bdim[0] = 2;
+    bdim[1] = 1;
+    bm2 = block_copy(m2, bdim);
+    printf("block m1 x m2\n");
+    c = matrix_product(bm1, bm2);
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    TVFREE(ba);
+    TVFREE(bu);
+    TVFREE(bm1);
+    TVFREE(bm2);
+
+    /* lazy products */
+    kr[0] = kr[1] = u;
+    c = khatri_rao_view(kr, 2);
+    printf("U kr U\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+    c = kronecker_view(m1, m2);
+    printf("m1 kron m2\n");
+    tensor_print(c, 0);
+    printf("\n\n");
+    TVFREE(c);
+
+    /* mttkrp variants */
+    fu[0] = m1;
+    fu[1] = m2;
+    fu[2] = m1;
+    bdim[0] = bdim[1] = 2;
+    for(i=0; i<ANDIM; i++) {
+	c = dense_tensor_alloc(2, bdim);
+	printf("mttkrp(A, %d)\n", i);
+	mttkrp(a, fu, i, c);
+	tensor_print(c, 0);
+	printf("mttkrp_csf(A, %d)\n", i);
+	mttkrp_csf(a, fu, i, c);
+	tensor_print(c, 0);
+	printf("mttkrp_parallel(A, %d)\n", i);
+	mttkrp_parallel(a, fu, i, c, 2);
+	tensor_print(c, 0);
+	printf("mttkrp_parallel(A, %d) split slices\n", i);
+	mttkrp_parallel(a, fu, i, c, 5);
+	tensor_print(c, 0);
+	printf("\n\n");
+	TVFREE(c);
+    }
+
     /* tensor product */
     printf("V1\n");
     tensor_print(v1, 0);
@@ -135,6 +273,58 @@ int main()
     tensor_print(c, 0);
     printf("\n\n");
 
+    /* contractions */
+    cma[0] = 0;
+    cmb[0] = 1;
+    printf("contract A_0 U_1\n");
+    d = tensor_contract(a, cma, u, cmb, 1);
+    tensor_clprint(d);
+    printf("\n\n");
+    TVFREE(d);
+    cma[0] = 1;
+    cmb[0] = 0;
+    printf("contract m1_1 m2_0\n");
+    d = tensor_contract(m1, cma, m2, cmb, 1);
+    tensor_print(d, 0);
+    printf("\n\n");
+    TVFREE(d);
+    for(i=0; i<ANDIM; i++) {
+	cma[i] = cmb[i] = i;
+    }
+    printf("contract A A (all modes)\n");
+    d = tensor_contract(a, cma, a, cmb, ANDIM);
+    tensor_print(d, 0);
+    printf("\n\n");
+    TVFREE(d);
+
+    /* threaded products match the serial ones */
+    sptensor_threads = 3;
+    for(i=0; i<ANDIM; i++) {
+	printf("threaded A x_%d U\n", i);
+	b = nmode_product(i, a, u);
+	tensor_print(b, 0);
+	printf("\n\n");
+	TVFREE(b);
+    }
+    printf("threaded m1 x m2\n");
+    b = matrix_product(m1, m2);
+    tensor_print(b, 0);
+    printf("\n\n");
+    TVFREE(b);
+    cma[0] = 0;
+    cmb[0] = 1;
+    printf("threaded contract A_0 U_1\n");
+    b = tensor_contract(a, cma, u, cmb, 1);
+    tensor_clprint(b);
+    printf("\n\n");
+    TVFREE(b);
+    printf("threaded V1 xt V2\n");
+    b = tensor_product(v1, v2);
+    tensor_print(b, 0);
+    printf("\n\n");
+    TVFREE(b);
+    sptensor_threads = 1;
+
     /* cleanup! */
     tensor_slice_spec_free(slice);
     TVFREE(m1);
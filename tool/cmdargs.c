@@ -67,6 +67,10 @@ cmdargs_parse(int argc, char **argv)
     args->tol = 1e-7;
     args->nfactors = 5;
     args->precision = 0;
+    args->checkpoint = NULL;
+    args->checkpoint_iter = 10;
+    args->checkpoint_time = 0;
+    args->resume = NULL;
     args->args = vector_alloc(sizeof(char*), 8);
 
     /* run through the list of arguments, processing and pushing as we go */
@@ -86,6 +90,14 @@ cmdargs_parse(int argc, char **argv)
 	    args->nfactors = atoi(argv[++i]);
 	} else if(!strcmp(argv[i], "-precision")) {
 	    args->precision = atoi(argv[++i]);
+	} else if(!strcmp(argv[i], "-checkpoint")) {
+	    args->checkpoint = argv[++i];
+	} else if(!strcmp(argv[i], "-checkpoint-iter")) {
+	    args->checkpoint_iter = atoi(argv[++i]);
+	} else if(!strcmp(argv[i], "-checkpoint-time")) {
+	    args->checkpoint_time = atof(argv[++i]);
+	} else if(!strcmp(argv[i], "-resume")) {
+	    args->resume = argv[++i];
 	} else {
 	    vector_push_back(args->args, &argv[i]);
 	}
@@ -32,6 +32,10 @@ typedef struct cmdargs
     double tol;       /* tolerance level */
     int nfactors;     /* number of factors */
     int precision;    /* pretty print precision */
+    char *checkpoint; /* ntfd checkpoint file.  NULL for none */
+    int checkpoint_iter;    /* iterations between checkpoints */
+    double checkpoint_time; /* seconds between checkpoints */
+    char *resume;     /* ntfd checkpoint to resume from.  NULL for none */
     vector *args;     /* additional arguments (not captured here) */
 } cmdargs;
 
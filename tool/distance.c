@@ -27,9 +27,10 @@ cmd_distance(cmdargs *args)
 {
     sptensor **t;
     tensor_view **u;
-    tensor_view *diff;
-    sptensor *dist;
-    tensor_view *dist_view;
+    tensor_expr *diff;
+    tensor_view *dist;
+    sptensor *sorted;
+    tensor_view *out;
     int ntns;
     FILE *file;
     int i,j;
@@ -42,7 +43,6 @@ cmd_distance(cmdargs *args)
     double mean;
     double sp, ss;
     int count=0;
-    int swap;
     
     /* ensure proper usage */
     if(argc < 3) {
@@ -65,9 +65,10 @@ cmd_distance(cmdargs *args)
     fprintf(stderr, "Loaded %d\n", i);
     }
 
-    /* allocate the distances */
+    /* allocate the distances (the matrix is symmetric, so each distance
+       is only stored once) */
     idx[0] = idx[1] = ntns;
-    dist = sptensor_alloc(2, idx);
+    dist = symmetric_tensor_alloc(2, idx, NULL);
 
     /* compute the distances */
     for(j=0; j<ntns; j++) {
@@ -75,14 +76,10 @@ cmd_distance(cmdargs *args)
 	for(i=0; i<j; i++) {
 	    idx[0] = j+1;
 	    idx[1] = i+1;
-	    diff = tensor_sub(u[j], u[i]);
-	    x=tensor_lpnorm(diff, args->lp);
-	    sptensor_set(dist, idx, x);
-        swap=idx[0];
-        idx[0]=idx[1];
-        idx[1]=swap;
-	    sptensor_set(dist, idx, x);
-	    TVFREE(diff);
+	    diff = expr_sub(expr_tensor(u[j]), expr_tensor(u[i]));
+	    x=expr_lpnorm(diff, args->lp);
+	    TVSET(dist, idx, x);
+	    expr_free(diff);
 
 	    /* gather statistiscs */
 	    if(i != j) {
@@ -93,17 +90,20 @@ cmd_distance(cmdargs *args)
 	}
     }
 
-    /* write the output */
-    dist_view = sptensor_view(dist);
-    cmd_write_tensor(args, "distance", -1, dist_view);
+    /* write the output (the symmetric view lists each representative's
+       permutations together, so copy it out in sorted order first) */
+    sorted = tensor_view_sptensor(dist);
+    out = sptensor_view(sorted);
+    cmd_write_tensor(args, "distance", -1, out);
 
     /* cleanup */
-    sptensor_free(dist);
+    TVFREE(out);
+    sptensor_free(sorted);
+    TVFREE(dist);
     for(i=0; i<ntns; i++) {
 	TVFREE(u[i]);
 	sptensor_free(t[i]);
     }
-    TVFREE(dist_view);
 
     /* compute statitstics and print to stderr */
     mean=sum/count;
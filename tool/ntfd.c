@@ -59,8 +59,43 @@ cmd_ntfd(cmdargs *args)
 	}
     }
 
+    /* pick up a checkpointed decomposition */
+    result = NULL;
+    if(args->resume) {
+	file = fopen(args->resume, "rb");
+	if(file) {
+	    result = ccd_read(file);
+	    fclose(file);
+	}
+	/* it has to be a decomposition of this tensor, at this rank */
+	for(i=0; result && i<result->n; i++) {
+	    if(result->n != t->nmodes || result->u[i]->dim[0] != t->dim[i] ||
+	       result->u[i]->dim[1] != args->nfactors) {
+		ccd_free(result);
+		result = NULL;
+	    }
+	}
+	if(!result) {
+	    fprintf(stderr, "Could not resume from %s\n", args->resume);
+	    TVFREE(t);
+	    sptensor_free(sptns);
+	    free(lambda);
+	    return;
+	}
+    }
+
     /* do the decomposition */
-    result = ccd_identity(t, args->nfactors, lambda, args->iter, args->tol);
+    if(args->checkpoint) {
+	ccd_checkpoint(args->checkpoint, args->checkpoint_iter, 
+		       args->checkpoint_time);
+    }
+    if(result) {
+	result = ccd_resume(t, result, lambda, args->iter, args->tol);
+    } else {
+	result = ccd_identity(t, args->nfactors, lambda, args->iter, 
+			      args->tol);
+    }
+    ccd_checkpoint(NULL, 0, 0);
 
     /* print stats to std err */
     fprintf(stderr, "Iterations: %d\n", result->iter);
@@ -124,6 +124,10 @@ usage()
     fprintf(stderr, "  -tol tolerance\tTolerance level for convergance. Default: 1e-7\n");
     fprintf(stderr, "  -nfactors n\tNumber of factors to compute.  Default: 5\n");
     fprintf(stderr, "  -precision p\tSet numeric precision for pretty printing. Default: 0\n");
+    fprintf(stderr, "  -checkpoint file\tntfd: Periodically save the factorization to file.\n");
+    fprintf(stderr, "  -checkpoint-iter n\tIterations between checkpoints (0 for none). Default: 10\n");
+    fprintf(stderr, "  -checkpoint-time t\tSeconds between checkpoints (0 for none). Default: 0\n");
+    fprintf(stderr, "  -resume file\tntfd: Continue the factorization saved in a checkpoint.\n");
     fprintf(stderr, "\nCommands:\n");
     for(i=0; i<ncmd; i++) {
 	fprintf(stderr, "  %s\t%s\n", cmdlist[i].name, cmdlist[i].description);